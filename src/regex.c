@@ -7,32 +7,6422 @@
  */
 
 
+/*  for clock_gettime and pthreads  */
+#define _POSIX_C_SOURCE 200112L
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "regex.h"
 
+/*  types of syntax tree nodes  */
+#define AST_EMPTY 0
+#define AST_BYTES 1
+#define AST_CONCAT 2
+#define AST_ALTERNATE 3
+#define AST_REPEAT 4
+#define AST_GROUP 5
+
+/*  largest count allowed in a counted repetition, eg 'a{1000}'  */
+#define MAX_REPEAT 1000
+/*  largest NFA allowed, in nodes  */
+#define MAX_NFA_NODES (1 << 22)
+/*  memory an NFA takes per node, charged to max_dfa_bytes  */
+#define NFA_NODE_BYTES (sizeof(Node) + sizeof(NfaLabel) + sizeof(Bucket))
+
+typedef struct AstTag Ast;
+typedef struct ParserTag Parser;
+typedef struct DfaBuilderTag DfaBuilder;
+typedef struct RegexPoolTag RegexPool;
+typedef struct SharedDfaTag SharedDfa;
+typedef struct BatchTag Batch;
+typedef struct CompileBatchTag CompileBatch;
+typedef struct RunnerTag Runner;
+typedef struct PikeTag Pike;
+typedef struct LimiterTag Limiter;
+
+static int parse_alternate(Parser *parser);
+static int parse_concat(Parser *parser);
+static int parse_repeat(Parser *parser);
+static int parse_atom(Parser *parser);
+static int parse_class(Parser *parser, unsigned char *bytes);
+static int parse_escape(Parser *parser, unsigned char *bytes);
+static int parse_count(Parser *parser, int *min, int *max);
+static int parser_new_node(Parser *parser, int type);
+static long nfa_count_nodes(Ast *tree, int idx);
+static short nfa_build(Regex *regex, Ast *tree, int root, int reverse,
+                       unsigned long *memory);
+static void nfa_build_fragment(Regex *regex, Ast *tree, int idx, int *start,
+                               int *end, int reverse);
+static int nfa_new_node(Regex *regex, int type);
+static short literal_build(Regex *regex, Ast *tree, int root);
+static void literal_factors(Ast *tree, int idx, int *factors, int *count);
+static int literal_repeats(Ast *tree, int idx, unsigned char *byte);
+static long ast_max_len(Ast *tree, int idx);
+static size_t literal_find(const unsigned char *literal, size_t literal_len,
+                           const unsigned char *str, size_t len, size_t from);
+static int search_earliest(const Regex *regex, const unsigned char *str,
+                           size_t len, size_t from, size_t *end,
+                           Limiter *limiter);
+static void nfa_add_edge(Regex *regex, int from_id, int to_id);
+static void nfa_add_choice(Regex *regex, int from_id, int body_id, int exit_id,
+                           int lazy);
+static short classes_build(Regex *regex);
+static short builder_init(DfaBuilder *builder, const Regex *regex,
+                          int max_states, unsigned long max_memory,
+                          int search);
+static void builder_free(DfaBuilder *builder);
+static int builder_start(DfaBuilder *builder);
+static void builder_new_mark(DfaBuilder *builder);
+static int builder_closure(DfaBuilder *builder, int *seeds, int num_seeds);
+static int builder_close(DfaBuilder *builder, int *seeds, int num_seeds,
+                         int *out);
+static int builder_search_next(DfaBuilder *builder, int *set, int len,
+                               int byte);
+static int builder_search_group(DfaBuilder *builder, int num_seeds,
+                                int *count);
+static int builder_intern(DfaBuilder *builder, int *set, int len);
+static int builder_accepts(DfaBuilder *builder, int state);
+static int builder_step(DfaBuilder *builder, int state, int class_idx);
+static short builder_run(DfaBuilder *builder);
+static void builder_clear(DfaBuilder *builder);
+static short pool_init(Regex *regex, RegexOptions *options,
+                       DfaBuilder *builder);
+static short shared_init(Regex *regex, RegexOptions *options,
+                         DfaBuilder *builder);
+static void shared_free(SharedDfa *shared);
+static int shared_intern(SharedDfa *shared, int *set, int len);
+static int shared_step(SharedDfa *shared, DfaBuilder *scratch, int state,
+                       int class_idx);
+static const unsigned char *shared_scan(SharedDfa *shared, DfaBuilder *scratch,
+                                        int *state,
+                                        const unsigned char *cursor,
+                                        const unsigned char *end);
+static int shared_leave(SharedDfa *shared, DfaBuilder *builder, int state);
+static int lazy_scan(DfaBuilder *builder, int state,
+                     const unsigned char *cursor, const unsigned char *end);
+static unsigned int dfa_scan(const Dfa *dfa, const unsigned char *classes,
+                             unsigned int state, const unsigned char *cursor,
+                             const unsigned char *end);
+static unsigned long clock_millis(void);
+static void limiter_init(Limiter *limiter, RegexLimits *limits, size_t begin);
+static size_t limiter_next(Limiter *limiter, size_t pos, size_t end);
+static short runner_init(Runner *runner, const Regex *regex,
+                         RegexCache *cache);
+static void runner_reset(Runner *runner);
+static void runner_scan(Runner *runner, const unsigned char *cursor,
+                        const unsigned char *end);
+static int runner_accepts(Runner *runner);
+static void first_bytes_build(Regex *regex, DfaBuilder *builder);
+static void plan_match(Regex *regex, RegexOptions *options);
+static void plan_search(Regex *regex, RegexOptions *options);
+static void plan_prefilter(Regex *regex, int nullable);
+static size_t explain_add(char *out, size_t size, size_t len,
+                          const char *text);
+static void export_bytes(char *out, const unsigned char *bytes);
+static char *export_byte(char *out, int byte);
+static size_t export_head(char *out, size_t size, size_t len, int format,
+                          const char *name, int num_states, long num_edges,
+                          int start, const int *fan_out);
+static size_t export_edge(char *out, size_t size, size_t len, int format,
+                          int from, int to, const char *label, int first);
+static size_t export_nfa(const Regex *regex, int format, char *out,
+                         size_t size);
+static int export_targets(DfaBuilder *builder, int state, int *to,
+                          unsigned char (*bytes)[32], int *complete);
+static size_t export_dfa(const Regex *regex, int format, int max_states,
+                         char *out, size_t size);
+static short search_build(Regex *regex, Regex *reverse, RegexOptions *options);
+static short dfa_build(Regex *regex, RegexOptions *options, int search,
+                       Dfa *dfa);
+static unsigned int dense_next(const Dfa *dfa, unsigned int state,
+                               int class_idx);
+static int search_find(const Regex *regex, const unsigned char *str,
+                       size_t len, size_t from, size_t *start, size_t *end,
+                       Limiter *limiter);
+static short pike_init(Pike *pike, const Regex *regex);
+static void pike_free(Pike *pike);
+static void pike_add(Pike *pike, int list, int node_id, size_t pos);
+static void pike_clear(Pike *pike, int list);
+static int pike_run(Pike *pike, const unsigned char *str, size_t start,
+                    size_t end, size_t *slots, int num_slots);
+static int pike_earliest(Pike *pike, const Regex *regex,
+                         const unsigned char *str, size_t len, size_t from,
+                         size_t *end, Limiter *limiter);
+static int pike_first(Pike *pike, const Regex *regex, const unsigned char *str,
+                      size_t len, size_t from, size_t *start, size_t *end,
+                      Limiter *limiter);
+static short cache_pike(RegexCache *cache, const Regex *regex);
+static int pike_longest(Pike *pike, const Regex *regex,
+                        const unsigned char *str, size_t len, size_t from,
+                        size_t *start, size_t *end, Limiter *limiter);
+static short find_all(Regex *regex, const char *str, size_t len,
+                      int num_slots, size_t **found, size_t *num_found,
+                      RegexLimits *limits);
+static int replacement_ref(const char **cursor);
+static int replacement_check(const char *replacement, int num_groups);
+static size_t replacement_expand(char *out, const char *replacement,
+                                 const char *str, const size_t *slots);
+static short output_init(char **out, size_t *out_len, size_t size);
+static int thread_shard(int num_shards);
+static unsigned long *stats_shard(const Regex *regex);
+static void stats_add(const Regex *regex, int stat, unsigned long count);
+static void stats_call(const Regex *regex, size_t bytes, short status);
+static void stats_cache(const Regex *regex, Runner *runner,
+                        unsigned long misses, unsigned long clears);
+static void find_stats(RegexIter *iter, size_t bytes, short status,
+                       unsigned long hits, Runner *runner,
+                       unsigned long misses, unsigned long clears);
+static short regex_exec(const Regex *regex, RegexCache *cache,
+                        const unsigned char *str, size_t len,
+                        RegexLimits *limits);
+static void *batch_work(void *arg);
+static void *compile_work(void *arg);
+static short dfa_encode(DfaBuilder *builder, RegexOptions *options, Dfa *dfa);
+static short dfa_encode_dense(DfaBuilder *builder, int *order,
+                              int first_accepting, Dfa *dfa);
+static int builder_ranges(DfaBuilder *builder, int state, int *ends,
+                          int *targets);
+static int record_kind(int format, int stride, int count, int *targets);
+static unsigned long record_size(int kind, int stride, int count);
+static short dfa_encode_records(DfaBuilder *builder, int *order,
+                                int first_accepting, Dfa *dfa);
+
+/*
+ * A node of the syntax tree. Nodes are kept in an array and refer to their
+ * children by index.
+ *
+ * @type: One of the AST_* types.
+ * @left: First child of a AST_CONCAT/AST_ALTERNATE, the repeated node of a
+ *   AST_REPEAT, or the contents of a AST_GROUP.
+ * @right: Second child of a AST_CONCAT/AST_ALTERNATE.
+ * @min: Minimum number of repetitions of a AST_REPEAT, or the number of a
+ *   AST_GROUP.
+ * @max: Maximum number of repetitions of a AST_REPEAT, -1 if unbounded.
+ * @lazy: Bool. A AST_REPEAT prefers fewer repetitions, eg 'a*?'.
+ * @bytes: Bitset of the bytes matched by a AST_BYTES.
+ */
+struct AstTag
+{
+    int type;
+    int left;
+    int right;
+    int min;
+    int max;
+    int lazy;
+    unsigned char bytes[32];
+};
+
+/*
+ * State of the recursive descent parser.
+ *
+ * @cursor: The next character to parse.
+ * @nodes: Growable array of syntax tree nodes.
+ * @num_nodes: Number of nodes used in @nodes.
+ * @size: Capacity of @nodes.
+ * @num_groups: Number of groups parsed so far.
+ * @lazy: Bool. A lazy quantifier was parsed.
+ * @error: REGEX_SUCCESS, or the first error encountered.
+ */
+struct ParserTag
+{
+    const char *cursor;
+    Ast *nodes;
+    int num_nodes;
+    int size;
+    int num_groups;
+    int lazy;
+    short error;
+};
+
+/*
+ * State of the subset construction.
+ * Each DFA state is a sorted set of NFA nodes, stored back to back in @pool.
+ * For a leftmost-first search DFA, sets are instead in order of priority,
+ * and end at the first NFA_MATCH node, since the nodes after it can only
+ * lead to matches a backtracking engine would never get to.
+ * Only NFA_BYTES and NFA_MATCH nodes are kept in sets, epsilon nodes are
+ * always followed through.
+ * States can be built all at once by builder_run, or one transition at a
+ * time by builder_step, which is how a lazy DFA uses the builder as a cache.
+ * Only pointers to the regex's heap storage are kept, so the regex struct
+ * itself may be copied around.
+ * The sets of a search DFA are laid out differently, see
+ * builder_search_next.
+ *
+ * @search: Bool. Build a search DFA rather than an anchored one.
+ * @priority: Bool. Keep sets in order of priority, for leftmost-first.
+ * @nfa: The NFA being converted.
+ * @nfa_start: Id of the start node of @nfa.
+ * @labels: Extra information on the nodes of @nfa.
+ * @classes: Map of bytes to their class.
+ * @stride: Number of classes.
+ * @representative: A byte of each class.
+ * @max_states: Stop adding states past this many, 0 if unlimited.
+ * @max_memory: Stop adding states past this much memory, 0 if unlimited.
+ * @memory: Memory taken by the states, in bytes.
+ * @marks: Per NFA node, the value of @mark when it was last visited.
+ * @mark: Incremented on every closure so @marks never needs clearing.
+ * @stack: Scratch stack for closures, one slot per NFA node and edge.
+ * @seeds: Scratch space for the nodes reached by a transition.
+ * @saved: Scratch space to keep a set while the states are cleared.
+ * @work: Scratch space for the set of a search DFA state, null otherwise.
+ * @pool: The sets of every state.
+ * @pool_len, @pool_size: Used length and capacity of @pool.
+ * @set_offset, @set_len: Where each state's set lives in @pool.
+ * @num_states, @states_size: Number of states and capacity of the arrays
+ *   indexed by state.
+ * @hash: Open addressing hash table of state ids, -1 if empty.
+ * @hash_size: Capacity of @hash, a power of two.
+ * @trans: Transitions of each state, @states_size rows of one cell per class.
+ *   BUILDER_UNKNOWN until computed.
+ * @start: Id of the start state.
+ * @clears: Number of times the states were cleared by builder_clear.
+ * @misses: Number of transitions computed while matching, by builder_step or
+ *   by shared_step with the builder as scratch.
+ */
+struct DfaBuilderTag
+{
+    int search;
+    int priority;
+    Graph nfa;
+    int nfa_start;
+    NfaLabel *labels;
+    unsigned char *classes;
+    int stride;
+    int representative[256];
+    int max_states;
+    unsigned long max_memory;
+    unsigned long memory;
+    int *marks;
+    int mark;
+    int *stack;
+    int *seeds;
+    int *saved;
+    int *work;
+    int *pool;
+    long pool_len;
+    long pool_size;
+    long *set_offset;
+    int *set_len;
+    int num_states;
+    int states_size;
+    int *hash;
+    int hash_size;
+    int *trans;
+    int start;
+    unsigned long clears;
+    unsigned long misses;
+};
+
+/*
+ * The caches of a regex not in use by any thread.
+ *
+ * @lock: Guards @free. Only held to take or give back a cache, never while
+ *   matching.
+ * @free: The caches, linked through their @next.
+ * @max_states, @max_memory: Limits of each cache's states.
+ * @shared: States of the lazy DFA shared by every cache, or null if each
+ *   cache only has its own.
+ * @stats: Counts of RegexOptions.stats, NUM_STATS per shard, or null if they
+ *   aren't kept.
+ */
+struct RegexPoolTag
+{
+    pthread_mutex_t lock;
+    RegexCache *free;
+    int max_states;
+    unsigned long max_memory;
+    SharedDfa *shared;
+    unsigned long *stats;
+};
+
+/*
+ * A lazy DFA whose states are shared by every thread matching a regex.
+ * States are only ever added, never moved or removed, so it is read and
+ * written without locks. A new state is written out first, then published
+ * with a compare and swap on its hash slot. If two threads add the same state
+ * at once only one wins the slot, and the other's copy is never used.
+ * Transitions are filled in with a compare and swap on their cell.
+ * Everything is allocated up front, within the DFA budget. Once it is full,
+ * threads carry on in their own caches.
+ *
+ * @labels: Extra information on the nodes of the NFA.
+ * @stride: Number of classes.
+ * @capacity: Most states.
+ * @num_states: Number of state ids handed out, may pass @capacity.
+ * @trans: Transitions of each state, @capacity rows of one cell per class.
+ *   Each cell holds the id of the next state plus one, 0 until computed.
+ * @accepts: Per state, 1 if it accepts.
+ * @sets: The sets of every state.
+ * @sets_len, @sets_size: Used length and capacity of @sets. @sets_len may
+ *   pass @sets_size.
+ * @set_offset, @set_len: Where each state's set lives in @sets.
+ * @hash: Open addressing hash table of state ids plus one, 0 if empty.
+ * @hash_size: Capacity of @hash, a power of two at least twice @capacity.
+ * @start: Id of the start state.
+ */
+struct SharedDfaTag
+{
+    NfaLabel *labels;
+    int stride;
+    int capacity;
+    volatile int num_states;
+    volatile int *trans;
+    unsigned char *accepts;
+    int *sets;
+    volatile long sets_len;
+    long sets_size;
+    long *set_offset;
+    int *set_len;
+    volatile int *hash;
+    int hash_size;
+    int start;
+};
+
+/*
+ * A regex being run over some bytes, whatever the format of its DFA.
+ *
+ * @regex: The regex.
+ * @lazy: Cache of states if the regex is lazy, null otherwise.
+ * @shared: Shared states of a lazy regex, or null if it has none or they were
+ *   full, in which case @lazy is used instead.
+ * @state: The current state, of the shared states, @lazy, or the DFA table.
+ */
+struct RunnerTag
+{
+    const Regex *regex;
+    DfaBuilder *lazy;
+    SharedDfa *shared;
+    unsigned long state;
+};
+
+/*
+ * Scratch space to find the groups of a match by simulating the NFA with one
+ * thread per node, kept in order of priority (a Pike VM). A thread records
+ * where it went through each NFA_CAPTURE node in its slots.
+ *
+ * @nfa: The NFA of the regex.
+ * @labels: Extra information on the nodes of @nfa.
+ * @nfa_start: Id of the start node of @nfa.
+ * @num_slots: Slots per thread, two per group and two for the whole match.
+ * @threads: Two lists of the nodes of live threads, in order of priority:
+ *   those at the current position and those at the next.
+ * @num_threads: Number of threads in each list.
+ * @slots: The slots of the threads of each list, @num_slots per thread.
+ * @marks: Per NFA node, the value of @mark when it was last added to a list.
+ * @mark: Incremented whenever a list is started, so @marks never needs
+ *   clearing.
+ * @stack: Nodes left to follow while adding a thread, or if negative, minus
+ *   one minus a slot to restore from @saved once they are followed.
+ * @saved: Values of the slots to restore, in step with @stack.
+ * @current: The slots of the thread being added.
+ */
+struct PikeTag
+{
+    Graph nfa;
+    NfaLabel *labels;
+    int nfa_start;
+    int num_slots;
+    int *threads[2];
+    int num_threads[2];
+    size_t *slots[2];
+    int *marks;
+    int mark;
+    int *stack;
+    size_t *saved;
+    size_t *current;
+};
+
+/*  value of the slots of a group that didn't take part in a match  */
+#define NO_SLOT ((size_t) -1)
+
+/*  results of replacement_ref besides a group  */
+#define REF_DOLLAR -1
+#define REF_INVALID -2
+/*  largest group a replacement may refer to  */
+#define MAX_GROUP_REF 100000
+
+/*
+ * A call to regex_match_batch, shared by the threads working on it.
+ * Strings are handed out in blocks of BATCH_BLOCK, so each thread works
+ * through neighbouring strings and results.
+ *
+ * @regex: The regex.
+ * @strs, @lens, @num_strs, @results, @limits: As passed to
+ *   regex_match_batch_limits.
+ * @next: Index of the next string no thread has taken yet.
+ */
+struct BatchTag
+{
+    Regex regex;
+    const char **strs;
+    const size_t *lens;
+    size_t num_strs;
+    unsigned char *results;
+    RegexLimits *limits;
+    volatile size_t next;
+};
+
+/*  length of a null terminated string whose end isn't found yet  */
+#define LEN_UNKNOWN ((size_t) -1)
 
-typedef struct TokenTag
+/*
+ * Limits on a match or search under way, checked between chunks of the
+ * input, see limiter_next.
+ *
+ * @limits: The limits, or null for none.
+ * @begin: Offset @limits->max_bytes is counted from.
+ * @started: When the work started, by clock_millis, if @limits->max_millis
+ *   is set.
+ * @interval: Bytes in a chunk.
+ * @hit: Bool. A limit was hit or the work cancelled, and it was given up.
+ */
+struct LimiterTag
+{
+    RegexLimits *limits;
+    size_t begin;
+    unsigned long started;
+    unsigned long interval;
+    int hit;
+};
+
+/*  strings a thread takes at a time in regex_match_batch  */
+#define BATCH_BLOCK 64
+
+/*
+ * A call to regex_compile_many, shared by the threads working on it.
+ * Regexes are handed out one at a time, since each takes a while to compile
+ * and some take far longer than others.
+ *
+ * @texts, @num_texts, @regexes, @statuses: As passed to regex_compile_many.
+ * @options: Options every regex is compiled with.
+ * @next: Index of the next regex no thread has taken yet.
+ * @failed: Number of regexes that failed to compile so far.
+ */
+struct CompileBatchTag
 {
-    char text[5]; // TODO may need to make bigger, small for regexes?
-} Token;
+    char **texts;
+    size_t num_texts;
+    RegexOptions options;
+    Regex *regexes;
+    short *statuses;
+    volatile size_t next;
+    volatile size_t failed;
+};
+
+/*  sizes of the parts of a sparse DFA record with @count ranges  */
+#define SPARSE_ENDS_SIZE(count) ((1 + (unsigned long) (count) + 3) & ~3UL)
+#define SPARSE_RECORD_SIZE(count) (SPARSE_ENDS_SIZE(count) + 4 * (count))
+
+/*  kinds of records in a hybrid DFA, kept in the low bits of each state  */
+#define HYBRID_SINGLE 0
+#define HYBRID_RANGES 1
+#define HYBRID_DENSE 2
+#define HYBRID_KIND_MASK 3UL
+/*  size of a HYBRID_SINGLE record  */
+#define HYBRID_SINGLE_SIZE 12
+/*  most ranges a hybrid state keeps in a range list before going dense  */
+#define HYBRID_MAX_RANGES 8
+
+/*  results of builder_intern and builder_step besides a state id  */
+#define BUILDER_NO_MEMORY -1
+#define BUILDER_FULL -2
+/*  transition that builder_step hasn't computed yet  */
+#define BUILDER_UNKNOWN -1
+/*  states always allowed, whatever the limits: dead, start, from and to  */
+#define BUILDER_MIN_STATES 4
+/*  status of builder_run when a limit was hit  */
+#define STATUS_OVER_BUDGET 3
+
+/*  helpers for bitsets of bytes  */
+#define BYTES_HAS(bytes, byte) ((bytes)[(byte) >> 3] & (1 << ((byte) & 7)))
+#define BYTES_ADD(bytes, byte) ((bytes)[(byte) >> 3] |= (1 << ((byte) & 7)))
+
+/*  counts of RegexOptions.stats, in the order of RegexStats  */
+#define STAT_CALLS 0
+#define STAT_BYTES 1
+#define STAT_MATCHES 2
+#define STAT_PREFILTER_HITS 3
+#define STAT_CACHE_MISSES 4
+#define STAT_CACHE_CLEARS 5
+#define STAT_FALLBACKS 6
+#define NUM_STATS 7
+/*  shards of the counts, and the room for each so none share a cache line  */
+#define STATS_SHARDS 16
+#define STATS_STRIDE 16
+/*  shards of the readers of a RegexHandle, and the room for each  */
+#define HANDLE_SHARDS 16
+#define HANDLE_STRIDE 16
+
+/*  busiest states regex_export lists, and room for an edge's label  */
+#define EXPORT_TOP 5
+#define EXPORT_LABEL_SIZE 1536
+
 
 /*  === INTERFACE IMPLEMENTATION ===  */
 
-short regex_compile(char* regex, Regex* regex)
+void regex_options_init(RegexOptions* options)
 {
-    regex->text = regex;
-    dfa = malloc(sizeof(Graph));
+    options->dfa_format = REGEX_DFA_AUTO;
+    options->dense_limit = REGEX_DENSE_LIMIT;
+    options->max_dfa_states = 0;
+    options->max_dfa_bytes = REGEX_DFA_BUDGET;
+    options->shared_cache = 0;
+    options->reverse_dfa = 1;
+    options->match_kind = REGEX_LEFTMOST_LONGEST;
+    options->stats = 0;
+}
+
+short regex_compile(char* regex_text, Regex* empty_regex)
+{
+    RegexOptions options;
+
+    regex_options_init(&options);
+    return regex_compile_options(regex_text, &options, empty_regex);
+}
+
+short regex_compile_options(char* regex_text, RegexOptions* options,
+                            Regex* empty_regex)
+{
+    Parser parser;
+    DfaBuilder builder;
+    Regex reverse;
+    size_t length;
+    unsigned long memory;
+    int root;
+    short status;
+
+    memset(empty_regex, 0, sizeof(Regex));
+    memset(&reverse, 0, sizeof(Regex));
+    empty_regex->text = regex_text;
+    empty_regex->match_kind = options->match_kind;
+
+    /*  a plain literal needs no automata, only its bytes  */
+    length = strlen(regex_text);
+    if (length > 0 && strcspn(regex_text, "()|*+?{[\\.") == length)
+    {
+        empty_regex->literal_only = length;
+        plan_match(empty_regex, options);
+        plan_search(empty_regex, options);
+        plan_prefilter(empty_regex, 0);
+        status = pool_init(empty_regex, options, 0);
+        if (status != REGEX_SUCCESS)
+        {
+            regex_free(empty_regex);
+        }
+        return status;
+    }
+
+    /*  parse the regex into a syntax tree  */
+    parser.cursor = regex_text;
+    parser.nodes = 0;
+    parser.num_nodes = 0;
+    parser.size = 0;
+    parser.num_groups = 0;
+    parser.lazy = 0;
+    parser.error = REGEX_SUCCESS;
+    root = parse_alternate(&parser);
+    if (parser.error == REGEX_SUCCESS && *parser.cursor != '\0')
+    {
+        /*  only an unbalanced ')' stops the parser early  */
+        parser.error = REGEX_ERR_SYNTAX;
+    }
+    if (parser.error != REGEX_SUCCESS)
+    {
+        free(parser.nodes);
+        return parser.error;
+    }
+
+    /*  a lazy quantifier only means something to leftmost-first matches  */
+    if (parser.lazy)
+    {
+        empty_regex->match_kind = REGEX_LEFTMOST_FIRST;
+    }
+
+    /*  build the NFAs now that the needed # of nodes is known  */
+    empty_regex->num_groups = parser.num_groups;
+    memory = options->max_dfa_bytes;
+    status = nfa_build(empty_regex, parser.nodes, root, 0, &memory);
+    if (status == REGEX_SUCCESS && options->reverse_dfa)
+    {
+        status = nfa_build(&reverse, parser.nodes, root, 1, &memory);
+    }
+    if (status == REGEX_SUCCESS)
+    {
+        status = literal_build(empty_regex, parser.nodes, root);
+    }
+    free(parser.nodes);
+    if (status == REGEX_SUCCESS)
+    {
+        status = classes_build(empty_regex);
+    }
+
+    /*  convert the NFA to a DFA  */
+    if (status == REGEX_SUCCESS)
+    {
+        status = builder_init(&builder, empty_regex, options->max_dfa_states,
+                              memory, 0);
+        if (status == REGEX_SUCCESS)
+        {
+            first_bytes_build(empty_regex, &builder);
+            plan_prefilter(empty_regex,
+                           builder_accepts(&builder, builder.start));
+            status = builder_run(&builder);
+        }
+        if (status == REGEX_SUCCESS)
+        {
+            status = dfa_encode(&builder, options, &empty_regex->dfa);
+        }
+        empty_regex->dfa.stride = builder.stride;
+
+        /*  over budget, stop determinizing and build states while matching  */
+        if (status == STATUS_OVER_BUDGET)
+        {
+            empty_regex->dfa.format = REGEX_DFA_LAZY;
+            status = REGEX_SUCCESS;
+        }
+        if (status == REGEX_SUCCESS)
+        {
+            plan_match(empty_regex, options);
+            status = pool_init(empty_regex, options, &builder);
+        }
+        builder_free(&builder);
+    }
+
+    /*  the search DFAs are no smaller, so don't try past the budget  */
+    if (status == REGEX_SUCCESS && options->reverse_dfa &&
+        empty_regex->dfa.format != REGEX_DFA_LAZY)
+    {
+        reverse.classes = empty_regex->classes;
+        status = search_build(empty_regex, &reverse, options);
+    }
+    if (status == REGEX_SUCCESS)
+    {
+        plan_search(empty_regex, options);
+    }
+    free(reverse.nfa.nodes);
+    free(reverse.nfa_labels);
+    free(reverse.nfa_buckets);
+
+    if (status != REGEX_SUCCESS)
+    {
+        regex_free(empty_regex);
+    }
+    return status;
+}
+
+size_t regex_compile_many(char** texts, size_t num_texts,
+                          RegexOptions* options, Regex* regexes,
+                          short* statuses, int num_threads)
+{
+    CompileBatch batch;
+    pthread_t *threads;
+    int started;
+
+    batch.texts = texts;
+    batch.num_texts = num_texts;
+    if (options != 0)
+    {
+        batch.options = *options;
+    }
+    else
+    {
+        regex_options_init(&batch.options);
+    }
+    batch.regexes = regexes;
+    batch.statuses = statuses;
+    batch.next = 0;
+    batch.failed = 0;
 
-    // TODO parse regex string and init'lz graph after needed # of nodes is known
+    /*  the caller always works, and no point in more threads than regexes  */
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+    if ((size_t) num_threads > num_texts)
+    {
+        num_threads = (int) num_texts;
+    }
+    threads = 0;
+    if (num_threads > 1)
+    {
+        threads = malloc((num_threads - 1) * sizeof(pthread_t));
+    }
+
+    /*  the calling thread works too, and alone if threads can't be made  */
+    started = 0;
+    while (threads != 0 && started < num_threads - 1 &&
+           pthread_create(&threads[started], 0, compile_work, &batch) == 0)
+    {
+        started++;
+    }
+    compile_work(&batch);
+    while (started > 0)
+    {
+        pthread_join(threads[--started], 0);
+    }
+    free(threads);
+    return batch.failed;
 }
 
 short regex_match(char* str, Regex regex)
 {
-    
+    return regex_match_limits(str, regex, 0);
+}
+
+short regex_find_iter(RegexIter* iter, Regex* regex, const char* str,
+                      size_t len)
+{
+    return regex_find_iter_limits(iter, regex, str, len, 0);
+}
+
+short regex_find_iter_limits(RegexIter* iter, Regex* regex, const char* str,
+                             size_t len, RegexLimits* limits)
+{
+    iter->regex = *regex;
+    iter->str = str;
+    iter->len = len;
+    iter->pos = 0;
+    iter->empty_at = len + 1;
+    iter->literal_at = len + 1;
+    iter->cache = 0;
+    iter->pike = 0;
+    iter->limits = limits;
+    iter->started = 0;
+    if (limits != 0 && limits->max_millis > 0)
+    {
+        iter->started = clock_millis();
+    }
+    if (regex->search.table == 0 && regex->literal_only == 0)
+    {
+        iter->pike = malloc(sizeof(Pike));
+        if (iter->pike == 0 || pike_init(iter->pike, regex) != REGEX_SUCCESS)
+        {
+            regex_find_free(iter);
+            return REGEX_ERR_MEMORY;
+        }
+    }
+    if (regex->dfa.format == REGEX_DFA_LAZY)
+    {
+        iter->cache = regex_cache_get(regex);
+        if (iter->cache == 0)
+        {
+            regex_find_free(iter);
+            return REGEX_ERR_MEMORY;
+        }
+    }
+    return REGEX_SUCCESS;
+}
+
+short regex_find_next(RegexIter* iter, size_t* start, size_t* end)
+{
+    Runner runner;
+    Limiter limiter;
+    const unsigned char *str;
+    const unsigned char *found;
+    size_t from;
+    size_t match_start;
+    size_t match_end;
+    size_t pos;
+    unsigned long misses;
+    unsigned long clears;
+    unsigned long hits;
+    int nullable;
+
+    str = (const unsigned char *) iter->str;
+    pos = iter->pos < iter->len ? iter->pos : iter->len;
+    if (iter->regex.literal_only > 0)
+    {
+        /*  every match of a plain literal is just where it occurs  */
+        from = literal_find((const unsigned char *) iter->regex.text,
+                            iter->regex.literal_only, str, iter->len,
+                            iter->pos);
+        if (from < iter->len)
+        {
+            *start = from;
+            *end = from + iter->regex.literal_only;
+            iter->pos = *end;
+            stats_call(&iter->regex, *end - pos, REGEX_MATCH);
+            return REGEX_MATCH;
+        }
+        iter->pos = iter->len + 1;
+        stats_call(&iter->regex, iter->len - pos, REGEX_NO_MATCH);
+        return REGEX_NO_MATCH;
+    }
+
+    /*  the limits are on the whole search, so its clock started with it  */
+    limiter_init(&limiter, iter->limits, 0);
+    limiter.started = iter->started;
+    runner_init(&runner, &iter->regex, iter->cache);
+    misses = runner.lazy != 0 ? runner.lazy->misses : 0;
+    clears = runner.lazy != 0 ? runner.lazy->clears : 0;
+    hits = 0;
+    match_start = 0;
+    nullable = runner_accepts(&runner);
+    for (from = iter->pos; from <= iter->len; from++)
+    {
+        if (iter->regex.plan.prefilter == REGEX_PREFILTER_LITERAL)
+        {
+            /*  every match holds the literal, starting not too far before  */
+            if (iter->literal_at > iter->len || iter->literal_at < from)
+            {
+                iter->literal_at = literal_find(iter->regex.literal,
+                                                iter->regex.literal_len, str,
+                                                iter->len, from);
+            }
+            if (iter->literal_at == iter->len)
+            {
+                break;
+            }
+            if (iter->regex.literal_before >= 0 &&
+                iter->literal_at - from >
+                (size_t) iter->regex.literal_before)
+            {
+                from = iter->literal_at - iter->regex.literal_before;
+            }
+        }
+
+        /*  skip to a byte a match can start with  */
+        if (!nullable && iter->regex.first_byte >= 0)
+        {
+            found = memchr(str + from, iter->regex.first_byte,
+                           iter->len - from);
+            if (found == 0)
+            {
+                break;
+            }
+            from = found - str;
+        }
+        else if (!nullable &&
+                 iter->regex.plan.prefilter != REGEX_PREFILTER_NONE)
+        {
+            while (from < iter->len &&
+                   !BYTES_HAS(iter->regex.first_bytes, str[from]))
+            {
+                from++;
+            }
+            if (from == iter->len)
+            {
+                break;
+            }
+        }
+        if (iter->regex.plan.prefilter == REGEX_PREFILTER_LITERAL ||
+            (!nullable && iter->regex.plan.prefilter != REGEX_PREFILTER_NONE))
+        {
+            hits++;
+        }
+
+        if (iter->regex.search.table != 0)
+        {
+            /*  find the leftmost-longest match in one pass each way  */
+            if (!search_find(&iter->regex, str, iter->len, from,
+                             &match_start, &match_end, &limiter))
+            {
+                break;
+            }
+            from = match_start;
+            match_end -= match_start;
+        }
+        else
+        {
+            /*  without the DFAs, run every start at once through the NFA  */
+            if (iter->regex.match_kind == REGEX_LEFTMOST_FIRST ?
+                !pike_first(iter->pike, &iter->regex, str, iter->len, from,
+                            &match_start, &match_end, &limiter) :
+                !pike_longest(iter->pike, &iter->regex, str, iter->len, from,
+                              &match_start, &match_end, &limiter))
+            {
+                break;
+            }
+            from = match_start;
+            match_end -= match_start;
+        }
+
+        /*  the longest match here, unless it is empty and was just found  */
+        if (match_end > 0 || from != iter->empty_at)
+        {
+            *start = from;
+            *end = from + match_end;
+            iter->pos = *end;
+            iter->empty_at = match_end == 0 ? from : iter->len + 1;
+            find_stats(iter, *end - pos, REGEX_MATCH, hits, &runner, misses,
+                       clears);
+            return REGEX_MATCH;
+        }
+    }
+
+    /*  a search given up can't say there are no more matches  */
+    if (limiter.hit)
+    {
+        find_stats(iter, from - pos, REGEX_ABORTED, hits, &runner, misses,
+                   clears);
+        return REGEX_ABORTED;
+    }
+    iter->pos = iter->len + 1;
+    find_stats(iter, iter->len - pos, REGEX_NO_MATCH, hits, &runner, misses,
+               clears);
+    return REGEX_NO_MATCH;
+}
+
+void regex_find_free(RegexIter* iter)
+{
+    if (iter->cache != 0)
+    {
+        regex_cache_put(&iter->regex, iter->cache);
+        iter->cache = 0;
+    }
+    if (iter->pike != 0)
+    {
+        pike_free(iter->pike);
+        free(iter->pike);
+        iter->pike = 0;
+    }
+}
+
+short regex_is_match(const Regex* regex, const char* str, size_t len)
+{
+    return regex_is_match_limits(regex, str, len, 0);
+}
+
+short regex_is_match_limits(const Regex* regex, const char* str, size_t len,
+                            RegexLimits* limits)
+{
+    size_t end;
+
+    return regex_shortest_match_limits(regex, str, len, &end, limits);
+}
+
+short regex_shortest_match(const Regex* regex, const char* str, size_t len,
+                           size_t* end)
+{
+    return regex_shortest_match_limits(regex, str, len, end, 0);
+}
+
+short regex_shortest_match_limits(const Regex* regex, const char* str,
+                                  size_t len, size_t* end,
+                                  RegexLimits* limits)
+{
+    RegexCache *cache;
+    Limiter limiter;
+    const unsigned char *bytes;
+    size_t from;
+    size_t found;
+    short status;
+
+    bytes = (const unsigned char *) str;
+    if (regex->literal_only > 0)
+    {
+        found = literal_find((const unsigned char *) regex->text,
+                             regex->literal_only, bytes, len, 0);
+        if (found == len)
+        {
+            stats_call(regex, len, REGEX_NO_MATCH);
+            return REGEX_NO_MATCH;
+        }
+        *end = found + regex->literal_only;
+        stats_call(regex, *end, REGEX_MATCH);
+        return REGEX_MATCH;
+    }
+
+    from = 0;
+    if (regex->plan.prefilter == REGEX_PREFILTER_LITERAL)
+    {
+        /*  no match without the literal, nor too far before it  */
+        found = literal_find(regex->literal, regex->literal_len, bytes, len,
+                             0);
+        if (found == len)
+        {
+            stats_call(regex, len, REGEX_NO_MATCH);
+            return REGEX_NO_MATCH;
+        }
+        stats_add(regex, STAT_PREFILTER_HITS, 1);
+        if (regex->literal_before >= 0 &&
+            found > (size_t) regex->literal_before)
+        {
+            from = found - regex->literal_before;
+        }
+    }
+
+    limiter_init(&limiter, limits, 0);
+    if (regex->search.table != 0)
+    {
+        status = search_earliest(regex, bytes, len, from, end, &limiter) ?
+                 REGEX_MATCH : REGEX_NO_MATCH;
+    }
+    else
+    {
+        /*  without a search DFA, run every match at once through the NFA,
+            with scratch space kept in a cache of the pool  */
+        status = REGEX_ABORTED;
+        cache = regex_cache_get((Regex *) regex);
+        if (cache != 0)
+        {
+            if (cache_pike(cache, regex) == REGEX_SUCCESS)
+            {
+                status = pike_earliest(cache->pike, regex, bytes, len, from,
+                                       end, &limiter) ?
+                         REGEX_MATCH : REGEX_NO_MATCH;
+            }
+            regex_cache_put((Regex *) regex, cache);
+        }
+        stats_add(regex, STAT_FALLBACKS, 1);
+    }
+    if (limiter.hit)
+    {
+        status = REGEX_ABORTED;
+    }
+    stats_call(regex, status == REGEX_MATCH ? *end : len, status);
+    return status;
+}
+
+short regex_replace_all(Regex* regex, const char* str, size_t len,
+                        const char* replacement, char** out,
+                        size_t* out_len)
+{
+    return regex_replace_all_limits(regex, str, len, replacement, out,
+                                    out_len, 0);
+}
+
+short regex_replace_all_limits(Regex* regex, const char* str, size_t len,
+                               const char* replacement, char** out,
+                               size_t* out_len, RegexLimits* limits)
+{
+    size_t *found;
+    size_t *slots;
+    size_t num_found;
+    size_t size;
+    size_t done;
+    size_t idx;
+    int max_group;
+    int num_slots;
+    char *cursor;
+    short status;
+
+    max_group = replacement_check(replacement, regex->num_groups);
+    if (max_group < 0)
+    {
+        return REGEX_ERR_SYNTAX;
+    }
+
+    /*  groups are only found if the replacement refers to them  */
+    num_slots = 2 * (max_group + 1);
+    status = find_all(regex, str, len, num_slots, &found, &num_found,
+                      limits);
+    if (status != REGEX_SUCCESS)
+    {
+        return status;
+    }
+
+    /*  size the output, then write it in one go  */
+    size = len + 1;
+    for (idx = 0; idx < num_found; idx++)
+    {
+        slots = &found[idx * num_slots];
+        size += replacement_expand(0, replacement, str, slots);
+        size -= slots[1] - slots[0];
+    }
+    status = output_init(out, out_len, size);
+    if (status == REGEX_SUCCESS)
+    {
+        cursor = *out;
+        done = 0;
+        for (idx = 0; idx < num_found; idx++)
+        {
+            slots = &found[idx * num_slots];
+            memcpy(cursor, str + done, slots[0] - done);
+            cursor += slots[0] - done;
+            cursor += replacement_expand(cursor, replacement, str, slots);
+            done = slots[1];
+        }
+        memcpy(cursor, str + done, len - done);
+        cursor[len - done] = '\0';
+        *out_len = size - 1;
+    }
+
+    free(found);
+    return status;
+}
+
+short regex_split(Regex* regex, const char* str, size_t len, char** out,
+                  size_t* out_len, size_t* num_pieces)
+{
+    return regex_split_limits(regex, str, len, out, out_len, num_pieces, 0);
+}
+
+short regex_split_limits(Regex* regex, const char* str, size_t len,
+                         char** out, size_t* out_len, size_t* num_pieces,
+                         RegexLimits* limits)
+{
+    size_t *found;
+    size_t num_found;
+    size_t size;
+    size_t done;
+    size_t idx;
+    char *cursor;
+    short status;
+
+    status = find_all(regex, str, len, 2, &found, &num_found, limits);
+    if (status != REGEX_SUCCESS)
+    {
+        return status;
+    }
+
+    /*  every piece but the matches, and a null after each  */
+    size = len + num_found + 1;
+    for (idx = 0; idx < num_found; idx++)
+    {
+        size -= found[2 * idx + 1] - found[2 * idx];
+    }
+    status = output_init(out, out_len, size);
+    if (status == REGEX_SUCCESS)
+    {
+        cursor = *out;
+        done = 0;
+        for (idx = 0; idx <= num_found; idx++)
+        {
+            if (idx == num_found)
+            {
+                memcpy(cursor, str + done, len - done);
+                cursor += len - done;
+            }
+            else
+            {
+                memcpy(cursor, str + done, found[2 * idx] - done);
+                cursor += found[2 * idx] - done;
+                done = found[2 * idx + 1];
+            }
+            *cursor++ = '\0';
+        }
+        *out_len = size;
+        *num_pieces = num_found + 1;
+    }
+
+    free(found);
+    return status;
+}
+
+void regex_limits_init(RegexLimits* limits)
+{
+    limits->max_bytes = 0;
+    limits->max_millis = 0;
+    limits->check_interval = REGEX_CHECK_INTERVAL;
+    limits->cancel = 0;
+}
+
+short regex_match_limits(char* str, Regex regex, RegexLimits* limits)
+{
+    RegexCache *cache;
+    short result;
+
+    if (regex.dfa.format != REGEX_DFA_LAZY)
+    {
+        return regex_exec(&regex, 0, (const unsigned char *) str,
+                          LEN_UNKNOWN, limits);
+    }
+
+    /*  borrow a cache from the pool for the length of the match  */
+    cache = regex_cache_get(&regex);
+    if (cache == 0)
+    {
+        return REGEX_ABORTED;
+    }
+    result = regex_exec(&regex, cache, (const unsigned char *) str,
+                        LEN_UNKNOWN, limits);
+    regex_cache_put(&regex, cache);
+    return result;
+}
+
+short regex_match_cache(char* str, Regex regex, RegexCache* cache,
+                        RegexLimits* limits)
+{
+    return regex_exec(&regex, cache, (const unsigned char *) str, LEN_UNKNOWN,
+                      limits);
+}
+
+void regex_match_batch(const Regex* regex, const char** strs,
+                       const size_t* lens, size_t num_strs,
+                       unsigned char* results)
+{
+    regex_match_batch_threads(regex, strs, lens, num_strs, results, 1);
+}
+
+void regex_match_batch_threads(const Regex* regex, const char** strs,
+                               const size_t* lens, size_t num_strs,
+                               unsigned char* results, int num_threads)
+{
+    regex_match_batch_limits(regex, strs, lens, num_strs, results,
+                             num_threads, 0);
+}
+
+void regex_match_batch_limits(const Regex* regex, const char** strs,
+                              const size_t* lens, size_t num_strs,
+                              unsigned char* results, int num_threads,
+                              RegexLimits* limits)
+{
+    Batch batch;
+    pthread_t *threads;
+    int started;
+
+    batch.regex = *regex;
+    batch.strs = strs;
+    batch.lens = lens;
+    batch.num_strs = num_strs;
+    batch.results = results;
+    batch.limits = limits;
+    batch.next = 0;
+
+    /*  the caller always works, and no point in more threads than blocks  */
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+    if ((size_t) num_threads > (num_strs + BATCH_BLOCK - 1) / BATCH_BLOCK)
+    {
+        num_threads = (int) ((num_strs + BATCH_BLOCK - 1) / BATCH_BLOCK);
+    }
+    threads = 0;
+    if (num_threads > 1)
+    {
+        threads = malloc((num_threads - 1) * sizeof(pthread_t));
+    }
+
+    /*  the calling thread works too, and alone if threads can't be made  */
+    started = 0;
+    while (threads != 0 && started < num_threads - 1 &&
+           pthread_create(&threads[started], 0, batch_work, &batch) == 0)
+    {
+        started++;
+    }
+    batch_work(&batch);
+    while (started > 0)
+    {
+        pthread_join(threads[--started], 0);
+    }
+    free(threads);
+}
+
+short regex_cache_init(RegexCache* cache, Regex* regex)
+{
+    short status;
+
+    cache->states = 0;
+    cache->pike = 0;
+    cache->next = 0;
+    if (regex->dfa.format != REGEX_DFA_LAZY)
+    {
+        return REGEX_SUCCESS;
+    }
+
+    cache->states = malloc(sizeof(DfaBuilder));
+    if (cache->states == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    status = builder_init(cache->states, regex, regex->caches->max_states,
+                          regex->caches->max_memory, 0);
+    if (status != REGEX_SUCCESS)
+    {
+        regex_cache_free(cache);
+    }
+    return status;
+}
+
+void regex_cache_free(RegexCache* cache)
+{
+    if (cache->states != 0)
+    {
+        builder_free(cache->states);
+        free(cache->states);
+        cache->states = 0;
+    }
+    if (cache->pike != 0)
+    {
+        pike_free(cache->pike);
+        free(cache->pike);
+        cache->pike = 0;
+    }
+}
+
+RegexCache* regex_cache_get(Regex* regex)
+{
+    RegexCache *cache;
+
+    pthread_mutex_lock(&regex->caches->lock);
+    cache = regex->caches->free;
+    if (cache != 0)
+    {
+        regex->caches->free = cache->next;
+    }
+    pthread_mutex_unlock(&regex->caches->lock);
+    if (cache != 0)
+    {
+        return cache;
+    }
+
+    /*  the pool is empty, make a new cache  */
+    cache = malloc(sizeof(RegexCache));
+    if (cache == 0)
+    {
+        return 0;
+    }
+    if (regex_cache_init(cache, regex) != REGEX_SUCCESS)
+    {
+        free(cache);
+        return 0;
+    }
+    return cache;
+}
+
+void regex_cache_put(Regex* regex, RegexCache* cache)
+{
+    pthread_mutex_lock(&regex->caches->lock);
+    cache->next = regex->caches->free;
+    regex->caches->free = cache;
+    pthread_mutex_unlock(&regex->caches->lock);
+}
+
+size_t regex_explain(const Regex* regex, char* out, size_t size)
+{
+    static const char *formats[] = {"", "dense", "sparse", "hybrid", "lazy"};
+    static const char *prefilters[] = {"none", "first byte", "first bytes",
+                                       "literal"};
+    const RegexPlan *plan;
+    char number[64];
+    size_t len;
+
+    plan = &regex->plan;
+    len = explain_add(out, size, 0, "match: ");
+    if (plan->match_engine == REGEX_ENGINE_LITERAL)
+    {
+        sprintf(number, "literal of %lu byte%s",
+                (unsigned long) regex->literal_only,
+                regex->literal_only == 1 ? "" : "s");
+        len = explain_add(out, size, len, number);
+    }
+    else if (plan->match_engine == REGEX_ENGINE_LAZY_DFA)
+    {
+        len = explain_add(out, size, len, "lazy DFA");
+    }
+    else
+    {
+        len = explain_add(out, size, len, formats[regex->dfa.format]);
+        sprintf(number, " DFA with %d states", regex->dfa.num_states);
+        len = explain_add(out, size, len, number);
+    }
+    len = explain_add(out, size, len, ", ");
+    len = explain_add(out, size, len, plan->match_reason);
+
+    len = explain_add(out, size, len, "\nsearch: ");
+    if (plan->search_engine == REGEX_ENGINE_SEARCH_DFA)
+    {
+        sprintf(number, "forward and reverse DFAs with %d and %d states",
+                regex->search.num_states, regex->reverse.num_states);
+        len = explain_add(out, size, len, number);
+    }
+    else if (plan->search_engine == REGEX_ENGINE_LITERAL)
+    {
+        len = explain_add(out, size, len, "memchr and memcmp");
+    }
+    else
+    {
+        len = explain_add(out, size, len, "Pike VM");
+    }
+    len = explain_add(out, size, len, ", ");
+    len = explain_add(out, size, len, plan->search_reason);
+
+    len = explain_add(out, size, len, "\nprefilter: ");
+    len = explain_add(out, size, len, prefilters[plan->prefilter]);
+    if (plan->prefilter == REGEX_PREFILTER_LITERAL && regex->literal_len > 0)
+    {
+        sprintf(number, " of %d byte%s", regex->literal_len,
+                regex->literal_len == 1 ? "" : "s");
+        len = explain_add(out, size, len, number);
+    }
+    len = explain_add(out, size, len, ", ");
+    len = explain_add(out, size, len, plan->prefilter_reason);
+    return explain_add(out, size, len, "\n");
+}
+
+size_t regex_export(const Regex* regex, int automaton, int format,
+                    int max_states, char* out, size_t size)
+{
+    if (automaton == REGEX_EXPORT_NFA)
+    {
+        return export_nfa(regex, format, out, size);
+    }
+    return export_dfa(regex, format, max_states, out, size);
+}
+
+void regex_stats(const Regex* regex, RegexStats* stats)
+{
+    unsigned long counts[NUM_STATS];
+    unsigned long *shard;
+    int stat;
+    int idx;
+
+    memset(counts, 0, sizeof(counts));
+    if (regex->caches != 0 && regex->caches->stats != 0)
+    {
+        for (idx = 0; idx < STATS_SHARDS; idx++)
+        {
+            shard = &regex->caches->stats[idx * STATS_STRIDE];
+            for (stat = 0; stat < NUM_STATS; stat++)
+            {
+                counts[stat] += __sync_fetch_and_add(&shard[stat], 0UL);
+            }
+        }
+    }
+    stats->calls = counts[STAT_CALLS];
+    stats->bytes = counts[STAT_BYTES];
+    stats->matches = counts[STAT_MATCHES];
+    stats->prefilter_hits = counts[STAT_PREFILTER_HITS];
+    stats->cache_misses = counts[STAT_CACHE_MISSES];
+    stats->cache_clears = counts[STAT_CACHE_CLEARS];
+    stats->fallbacks = counts[STAT_FALLBACKS];
+}
+
+void regex_stats_reset(Regex* regex)
+{
+    int idx;
+
+    if (regex->caches == 0 || regex->caches->stats == 0)
+    {
+        return;
+    }
+    for (idx = 0; idx < STATS_SHARDS * STATS_STRIDE; idx++)
+    {
+        __sync_fetch_and_and(&regex->caches->stats[idx], 0UL);
+    }
+}
+
+void regex_free(Regex* regex)
+{
+    RegexCache *cache;
+
+    if (regex->caches != 0)
+    {
+        while (regex->caches->free != 0)
+        {
+            cache = regex->caches->free;
+            regex->caches->free = cache->next;
+            regex_cache_free(cache);
+            free(cache);
+        }
+        if (regex->caches->shared != 0)
+        {
+            shared_free(regex->caches->shared);
+        }
+        free(regex->caches->stats);
+        pthread_mutex_destroy(&regex->caches->lock);
+        free(regex->caches);
+    }
+    free(regex->nfa.nodes);
+    free(regex->nfa_labels);
+    free(regex->nfa_buckets);
+    free(regex->classes);
+    free(regex->dfa.table);
+    free(regex->search.table);
+    free(regex->reverse.table);
+    regex->nfa.nodes = 0;
+    regex->nfa_labels = 0;
+    regex->nfa_buckets = 0;
+    regex->classes = 0;
+    regex->dfa.table = 0;
+    regex->search.table = 0;
+    regex->reverse.table = 0;
+    regex->caches = 0;
+}
+
+
+void regex_set_init(RegexSet* set, RegexOptions* options)
+{
+    set->regexes = 0;
+    set->num_ids = 0;
+    set->size = 0;
+    set->count = 0;
+    if (options != 0)
+    {
+        set->options = *options;
+    }
+    else
+    {
+        regex_options_init(&set->options);
+    }
+}
+
+short regex_set_add(RegexSet* set, char* regex_text, int* id)
+{
+    Regex regex;
+    Regex *regexes;
+    short status;
+    int free_id;
+
+    status = regex_compile_options(regex_text, &set->options, &regex);
+    if (status != REGEX_SUCCESS)
+    {
+        return status;
+    }
+
+    /*  reuse a removed regex's id before handing out a new one  */
+    for (free_id = 0; free_id < set->num_ids; free_id++)
+    {
+        if (set->regexes[free_id].text == 0)
+        {
+            break;
+        }
+    }
+    if (free_id == set->size)
+    {
+        regexes = realloc(set->regexes,
+                          (set->size * 2 + 8) * sizeof(Regex));
+        if (regexes == 0)
+        {
+            regex_free(&regex);
+            return REGEX_ERR_MEMORY;
+        }
+        set->regexes = regexes;
+        set->size = set->size * 2 + 8;
+    }
+    if (free_id == set->num_ids)
+    {
+        set->num_ids++;
+    }
+    set->regexes[free_id] = regex;
+    set->count++;
+    *id = free_id;
+    return REGEX_SUCCESS;
+}
+
+void regex_set_remove(RegexSet* set, int id)
+{
+    if (id < 0 || id >= set->num_ids || set->regexes[id].text == 0)
+    {
+        return;
+    }
+    regex_free(&set->regexes[id]);
+    set->regexes[id].text = 0;
+    set->count--;
+    while (set->num_ids > 0 && set->regexes[set->num_ids - 1].text == 0)
+    {
+        set->num_ids--;
+    }
+}
+
+size_t regex_set_matches(const RegexSet* set, const char* str, size_t len,
+                         int* ids, size_t max_ids)
+{
+    size_t count;
+    int id;
+
+    count = 0;
+    for (id = 0; id < set->num_ids; id++)
+    {
+        if (set->regexes[id].text != 0 &&
+            regex_is_match(&set->regexes[id], str, len) == REGEX_MATCH)
+        {
+            if (count < max_ids)
+            {
+                ids[count] = id;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+short regex_handle_init(RegexHandle* handle, RegexSet* set)
+{
+    handle->readers = calloc(2 * HANDLE_SHARDS * HANDLE_STRIDE,
+                             sizeof(unsigned long));
+    handle->current = malloc(sizeof(RegexSet));
+    if (handle->readers == 0 || handle->current == 0)
+    {
+        free((void *) handle->readers);
+        free(handle->current);
+        return REGEX_ERR_MEMORY;
+    }
+    *handle->current = *set;
+    handle->epoch = 0;
+    handle->writing = 0;
+    return REGEX_SUCCESS;
+}
+
+const RegexSet* regex_handle_acquire(RegexHandle* handle, int* ticket)
+{
+    unsigned long epoch;
+
+    /*  count in with this epoch, unless a writer moved on meanwhile. Both
+        fields are read with atomic adds of 0, which are full barriers  */
+    for (;;)
+    {
+        epoch = __sync_fetch_and_add(&handle->epoch, 0UL);
+        *ticket = (int) (epoch & 1) * HANDLE_SHARDS +
+                  thread_shard(HANDLE_SHARDS);
+        __sync_fetch_and_add(&handle->readers[*ticket * HANDLE_STRIDE], 1UL);
+        if (__sync_fetch_and_add(&handle->epoch, 0UL) == epoch)
+        {
+            break;
+        }
+        __sync_fetch_and_sub(&handle->readers[*ticket * HANDLE_STRIDE], 1UL);
+    }
+    return __sync_fetch_and_add(&handle->current, 0);
+}
+
+void regex_handle_release(RegexHandle* handle, int ticket)
+{
+    __sync_fetch_and_sub(&handle->readers[ticket * HANDLE_STRIDE], 1UL);
+}
+
+short regex_handle_publish(RegexHandle* handle, RegexSet* set)
+{
+    RegexSet *fresh;
+    RegexSet *old;
+    unsigned long count;
+    int parity;
+    int shard;
+
+    fresh = malloc(sizeof(RegexSet));
+    if (fresh == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    *fresh = *set;
+    while (__sync_lock_test_and_set(&handle->writing, 1) != 0)
+    {
+        sched_yield();
+    }
+
+    /*  readers from now on get the new set, and count in on the other side.
+        Only the writer changes @current, so the swap can't fail, but unlike
+        __sync_lock_test_and_set it is a full barrier, so the new set is
+        written before any reader can see it  */
+    old = __sync_fetch_and_add(&handle->current, 0);
+    __sync_val_compare_and_swap(&handle->current, old, fresh);
+    parity = (int) (__sync_fetch_and_add(&handle->epoch, 1UL) & 1);
+
+    /*  wait for those who may have the old set to be done with it  */
+    do
+    {
+        count = 0;
+        for (shard = 0; shard < HANDLE_SHARDS; shard++)
+        {
+            count += __sync_fetch_and_add(
+                &handle->readers[(parity * HANDLE_SHARDS + shard) *
+                                 HANDLE_STRIDE], 0UL);
+        }
+        if (count != 0)
+        {
+            sched_yield();
+        }
+    } while (count != 0);
+
+    __sync_lock_release(&handle->writing);
+    regex_set_free(old);
+    free(old);
+    return REGEX_SUCCESS;
+}
+
+void regex_handle_free(RegexHandle* handle)
+{
+    regex_set_free(handle->current);
+    free(handle->current);
+    free((void *) handle->readers);
+    handle->current = 0;
+    handle->readers = 0;
+}
+
+void regex_set_free(RegexSet* set)
+{
+    int id;
+
+    for (id = 0; id < set->num_ids; id++)
+    {
+        if (set->regexes[id].text != 0)
+        {
+            regex_free(&set->regexes[id]);
+        }
+    }
+    free(set->regexes);
+    set->regexes = 0;
+    set->num_ids = 0;
+    set->size = 0;
+    set->count = 0;
 }
 
 /*  === HELPER METHODS ===  */
 
-Token* tokenize_regex(char* regex)
+/*
+ * Parse an alternation, the lowest precedence construct.
+ *
+ * @return: Index of the parsed node. Undefined if @parser->error is set.
+ */
+static int parse_alternate(Parser *parser)
+{
+    int left;
+    int right;
+    int node;
+
+    left = parse_concat(parser);
+    while (parser->error == REGEX_SUCCESS && *parser->cursor == '|')
+    {
+        parser->cursor++;
+        node = parser_new_node(parser, AST_ALTERNATE);
+        if (node < 0)
+        {
+            break;
+        }
+        /*  parsing may grow the tree, so don't hold on to a pointer  */
+        right = parse_concat(parser);
+        parser->nodes[node].left = left;
+        parser->nodes[node].right = right;
+        left = node;
+    }
+
+    return left;
+}
+
+/*
+ * Parse a sequence of repeated atoms. An empty sequence is a AST_EMPTY node.
+ *
+ * @return: Index of the parsed node. Undefined if @parser->error is set.
+ */
+static int parse_concat(Parser *parser)
 {
+    int left;
+    int right;
+    int node;
+
+    left = -1;
+    while (parser->error == REGEX_SUCCESS && *parser->cursor != '\0' &&
+           *parser->cursor != '|' && *parser->cursor != ')')
+    {
+        right = parse_repeat(parser);
+        if (left < 0)
+        {
+            left = right;
+            continue;
+        }
+
+        node = parser_new_node(parser, AST_CONCAT);
+        if (node < 0)
+        {
+            break;
+        }
+        parser->nodes[node].left = left;
+        parser->nodes[node].right = right;
+        left = node;
+    }
+
+    if (left < 0)
+    {
+        left = parser_new_node(parser, AST_EMPTY);
+    }
+    return left;
+}
+
+/*
+ * Parse an atom followed by any number of quantifiers.
+ *
+ * @return: Index of the parsed node. Undefined if @parser->error is set.
+ */
+static int parse_repeat(Parser *parser)
+{
+    int atom;
+    int node;
+    int min;
+    int max;
+
+    atom = parse_atom(parser);
+    while (parser->error == REGEX_SUCCESS)
+    {
+        if (*parser->cursor == '*')
+        {
+            min = 0;
+            max = -1;
+        }
+        else if (*parser->cursor == '+')
+        {
+            min = 1;
+            max = -1;
+        }
+        else if (*parser->cursor == '?')
+        {
+            min = 0;
+            max = 1;
+        }
+        else if (*parser->cursor == '{' && parse_count(parser, &min, &max))
+        {
+            /*  parse_count leaves the cursor on the closing brace  */
+        }
+        else
+        {
+            break;
+        }
+        parser->cursor++;
+
+        node = parser_new_node(parser, AST_REPEAT);
+        if (node < 0)
+        {
+            break;
+        }
+        parser->nodes[node].left = atom;
+        parser->nodes[node].min = min;
+        parser->nodes[node].max = max;
+        if (*parser->cursor == '?')
+        {
+            /*  a lazy quantifier, eg 'a*?'  */
+            parser->nodes[node].lazy = 1;
+            parser->lazy = 1;
+            parser->cursor++;
+        }
+        atom = node;
+    }
+
+    return atom;
+}
+
+/*
+ * Parse a single atom: a group, a class, an escape or a literal byte.
+ *
+ * @return: Index of the parsed node. Undefined if @parser->error is set.
+ */
+static int parse_atom(Parser *parser)
+{
+    int node;
+    int group;
+    int idx;
+    unsigned char byte;
+
+    byte = (unsigned char) *parser->cursor;
+    if (byte == '(')
+    {
+        /*  groups are numbered in the order they open  */
+        parser->cursor++;
+        idx = ++parser->num_groups;
+        node = parse_alternate(parser);
+        if (parser->error == REGEX_SUCCESS && *parser->cursor != ')')
+        {
+            parser->error = REGEX_ERR_SYNTAX;
+        }
+        if (parser->error != REGEX_SUCCESS)
+        {
+            return -1;
+        }
+        parser->cursor++;
+        group = parser_new_node(parser, AST_GROUP);
+        if (group >= 0)
+        {
+            parser->nodes[group].left = node;
+            parser->nodes[group].min = idx;
+        }
+        return group;
+    }
+    if (byte == '*' || byte == '+' || byte == '?')
+    {
+        /*  quantifier with nothing to repeat  */
+        parser->error = REGEX_ERR_SYNTAX;
+        return -1;
+    }
+
+    node = parser_new_node(parser, AST_BYTES);
+    if (node < 0)
+    {
+        return -1;
+    }
+
+    parser->cursor++;
+    if (byte == '[')
+    {
+        parse_class(parser, parser->nodes[node].bytes);
+    }
+    else if (byte == '\\')
+    {
+        parse_escape(parser, parser->nodes[node].bytes);
+    }
+    else if (byte == '.')
+    {
+        /*  anything but a newline  */
+        for (idx = 0; idx < 32; idx++)
+        {
+            parser->nodes[node].bytes[idx] = 0xff;
+        }
+        parser->nodes[node].bytes['\n' >> 3] &= ~(1 << ('\n' & 7));
+    }
+    else
+    {
+        BYTES_ADD(parser->nodes[node].bytes, byte);
+    }
+
+    return node;
+}
+
+/*
+ * Parse a bracketed class, eg '[^a-z_]'. The cursor is just past the '['.
+ *
+ * @bytes: Bitset to add the bytes of the class to.
+ * @return: 0 on success, 1 on a syntax error.
+ */
+static int parse_class(Parser *parser, unsigned char *bytes)
+{
+    unsigned char item[32];
+    unsigned char low;
+    unsigned char high;
+    int negate;
+    int first;
+    int count;
+    int idx;
+
+    negate = 0;
+    if (*parser->cursor == '^')
+    {
+        negate = 1;
+        parser->cursor++;
+    }
+
+    /*  a ']' right after the '[' or '[^' is taken literally  */
+    first = 1;
+    while (*parser->cursor != ']' || first)
+    {
+        first = 0;
+        if (*parser->cursor == '\0')
+        {
+            parser->error = REGEX_ERR_SYNTAX;
+            return 1;
+        }
+
+        memset(item, 0, sizeof(item));
+        low = (unsigned char) *parser->cursor++;
+        if (low == '\\')
+        {
+            /*  an escape may stand for a whole set, eg '\d'  */
+            if (parse_escape(parser, item))
+            {
+                return 1;
+            }
+            for (count = 0, idx = 0; idx < 256; idx++)
+            {
+                if (BYTES_HAS(item, idx))
+                {
+                    low = (unsigned char) idx;
+                    count++;
+                }
+            }
+            if (count != 1)
+            {
+                for (idx = 0; idx < 32; idx++)
+                {
+                    bytes[idx] |= item[idx];
+                }
+                continue;
+            }
+
+            /*  a single escaped byte may start a range like any other  */
+            memset(item, 0, sizeof(item));
+        }
+
+        high = low;
+        if (parser->cursor[0] == '-' && parser->cursor[1] != ']' &&
+            parser->cursor[1] != '\0')
+        {
+            high = (unsigned char) parser->cursor[1];
+            parser->cursor += 2;
+            if (high == '\\')
+            {
+                /*  only a single escaped byte can end a range, not a set
+                    like '\d'  */
+                if (parse_escape(parser, item))
+                {
+                    return 1;
+                }
+                for (count = 0, idx = 0; idx < 256; idx++)
+                {
+                    if (BYTES_HAS(item, idx))
+                    {
+                        high = (unsigned char) idx;
+                        count++;
+                    }
+                }
+                if (count != 1)
+                {
+                    parser->error = REGEX_ERR_SYNTAX;
+                    return 1;
+                }
+            }
+            if (high < low)
+            {
+                parser->error = REGEX_ERR_SYNTAX;
+                return 1;
+            }
+        }
+        for (idx = low; idx <= high; idx++)
+        {
+            BYTES_ADD(bytes, idx);
+        }
+    }
+    parser->cursor++;
+
+    if (negate)
+    {
+        for (idx = 0; idx < 32; idx++)
+        {
+            bytes[idx] = (unsigned char) ~bytes[idx];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Parse the character after a '\'. The cursor is just past the '\'.
+ * Supports the '\d', '\w' and '\s' sets and their negations, the usual
+ * control characters, '\xHH' and escaped punctuation.
+ *
+ * @bytes: Bitset to add the bytes of the escape to.
+ * @return: 0 on success, 1 on a syntax error.
+ */
+static int parse_escape(Parser *parser, unsigned char *bytes)
+{
+    unsigned char set[32];
+    int letter;
+    int byte;
+    int idx;
+    int digit;
+
+    letter = (unsigned char) *parser->cursor;
+    if (letter == '\0')
+    {
+        parser->error = REGEX_ERR_SYNTAX;
+        return 1;
+    }
+    parser->cursor++;
+
+    memset(set, 0, sizeof(set));
+    switch (letter)
+    {
+    case 'd':
+    case 'D':
+        for (idx = '0'; idx <= '9'; idx++)
+        {
+            BYTES_ADD(set, idx);
+        }
+        break;
+    case 'w':
+    case 'W':
+        for (idx = 0; idx < 256; idx++)
+        {
+            if ((idx >= 'a' && idx <= 'z') || (idx >= 'A' && idx <= 'Z') ||
+                (idx >= '0' && idx <= '9') || idx == '_')
+            {
+                BYTES_ADD(set, idx);
+            }
+        }
+        break;
+    case 's':
+    case 'S':
+        BYTES_ADD(set, ' ');
+        BYTES_ADD(set, '\t');
+        BYTES_ADD(set, '\n');
+        BYTES_ADD(set, '\v');
+        BYTES_ADD(set, '\f');
+        BYTES_ADD(set, '\r');
+        break;
+    case 'n':
+        BYTES_ADD(set, '\n');
+        break;
+    case 't':
+        BYTES_ADD(set, '\t');
+        break;
+    case 'r':
+        BYTES_ADD(set, '\r');
+        break;
+    case 'f':
+        BYTES_ADD(set, '\f');
+        break;
+    case 'v':
+        BYTES_ADD(set, '\v');
+        break;
+    case 'x':
+        byte = 0;
+        for (idx = 0; idx < 2; idx++)
+        {
+            digit = *parser->cursor;
+            if (digit >= '0' && digit <= '9')
+            {
+                digit -= '0';
+            }
+            else if (digit >= 'a' && digit <= 'f')
+            {
+                digit -= 'a' - 10;
+            }
+            else if (digit >= 'A' && digit <= 'F')
+            {
+                digit -= 'A' - 10;
+            }
+            else
+            {
+                parser->error = REGEX_ERR_SYNTAX;
+                return 1;
+            }
+            byte = byte * 16 + digit;
+            parser->cursor++;
+        }
+        BYTES_ADD(set, byte);
+        break;
+    default:
+        if ((letter >= 'a' && letter <= 'z') ||
+            (letter >= 'A' && letter <= 'Z') ||
+            (letter >= '0' && letter <= '9'))
+        {
+            /*  reserve unknown letter escapes for later use  */
+            parser->error = REGEX_ERR_SYNTAX;
+            return 1;
+        }
+        BYTES_ADD(set, letter);
+        break;
+    }
+
+    /*  upper case sets are negations  */
+    if (letter == 'D' || letter == 'W' || letter == 'S')
+    {
+        for (idx = 0; idx < 32; idx++)
+        {
+            set[idx] = (unsigned char) ~set[idx];
+        }
+    }
+    for (idx = 0; idx < 32; idx++)
+    {
+        bytes[idx] |= set[idx];
+    }
+    return 0;
+}
+
+/*
+ * Try to parse a counted repetition, eg '{2}', '{2,}' or '{2,5}'. The cursor
+ * is on the '{'. If it doesn't start a valid repetition, the '{' is a literal.
+ *
+ * @min, @max: Set to the bounds of the repetition, @max is -1 if unbounded.
+ * @return: 1 if a repetition was parsed, leaving the cursor on the '}'.
+ *   0 if not, leaving the cursor untouched.
+ */
+static int parse_count(Parser *parser, int *min, int *max)
+{
+    const char *cursor;
+    int count;
+
+    cursor = parser->cursor + 1;
+    if (*cursor < '0' || *cursor > '9')
+    {
+        return 0;
+    }
+
+    for (count = 0; *cursor >= '0' && *cursor <= '9'; cursor++)
+    {
+        count = count * 10 + (*cursor - '0');
+        if (count > MAX_REPEAT)
+        {
+            parser->error = REGEX_ERR_SYNTAX;
+            return 0;
+        }
+    }
+    *min = count;
+    *max = count;
+
+    if (*cursor == ',')
+    {
+        cursor++;
+        *max = -1;
+        if (*cursor >= '0' && *cursor <= '9')
+        {
+            for (count = 0; *cursor >= '0' && *cursor <= '9'; cursor++)
+            {
+                count = count * 10 + (*cursor - '0');
+                if (count > MAX_REPEAT)
+                {
+                    parser->error = REGEX_ERR_SYNTAX;
+                    return 0;
+                }
+            }
+            if (count < *min)
+            {
+                parser->error = REGEX_ERR_SYNTAX;
+                return 0;
+            }
+            *max = count;
+        }
+    }
+
+    if (*cursor != '}')
+    {
+        return 0;
+    }
+    parser->cursor = cursor;
+    return 1;
+}
+
+/*
+ * Add a zeroed node to the syntax tree, growing it if needed.
+ *
+ * @type: Type of the new node.
+ * @return: Index of the new node, or -1 if out of memory.
+ */
+static int parser_new_node(Parser *parser, int type)
+{
+    Ast *nodes;
+    int size;
+
+    if (parser->num_nodes == parser->size)
+    {
+        size = parser->size == 0 ? 16 : parser->size * 2;
+        nodes = realloc(parser->nodes, size * sizeof(Ast));
+        if (nodes == 0)
+        {
+            parser->error = REGEX_ERR_MEMORY;
+            return -1;
+        }
+        parser->nodes = nodes;
+        parser->size = size;
+    }
+
+    memset(&parser->nodes[parser->num_nodes], 0, sizeof(Ast));
+    parser->nodes[parser->num_nodes].type = type;
+    return parser->num_nodes++;
+}
+
+/*
+ * Count the NFA nodes Thompson's construction needs for a syntax tree.
+ * Has to agree with nfa_build_fragment.
+ *
+ * @tree: The syntax tree.
+ * @idx: Index of the root of the subtree to count.
+ * @return: The number of nodes, capped just above MAX_NFA_NODES.
+ */
+static long nfa_count_nodes(Ast *tree, int idx)
+{
+    Ast *node;
+    long body;
+    long count;
+
+    node = &tree[idx];
+    switch (node->type)
+    {
+    case AST_EMPTY:
+        return 1;
+    case AST_BYTES:
+        return 2;
+    case AST_CONCAT:
+        count = nfa_count_nodes(tree, node->left) +
+                nfa_count_nodes(tree, node->right);
+        break;
+    case AST_ALTERNATE:
+        count = nfa_count_nodes(tree, node->left) +
+                nfa_count_nodes(tree, node->right) + 2;
+        break;
+    case AST_GROUP:
+        count = nfa_count_nodes(tree, node->left) + 2;
+        break;
+    default:
+        body = nfa_count_nodes(tree, node->left);
+        if (node->max == 0)
+        {
+            count = 1;
+        }
+        else if (node->max < 0 && node->min == 0)
+        {
+            /*  a star  */
+            count = body + 2;
+        }
+        else if (node->max < 0)
+        {
+            /*  copies of the body, then a plus  */
+            count = body * node->min + 1;
+        }
+        else
+        {
+            /*  copies of the body, then optional copies sharing an exit  */
+            count = body * node->min;
+            if (node->max > node->min)
+            {
+                count += (body + 1) * (node->max - node->min) + 1;
+            }
+        }
+        break;
+    }
+
+    if (count > MAX_NFA_NODES)
+    {
+        return MAX_NFA_NODES + 1;
+    }
+    return count;
+}
+
+/*
+ * Build the NFA of a regex from its syntax tree.
+ *
+ * @regex: The regex to build the NFA of. Its NFA members are populated.
+ * @tree: The syntax tree.
+ * @root: Index of the root of @tree.
+ * @reverse: Bool. Build the NFA of the reversed regex, which matches the
+ *   reverse of each string the regex matches.
+ * @memory: Bytes left of the budget, 0 if unlimited. The NFA is charged to
+ *   it, and it's left above 0 if it was.
+ * @return: REGEX_SUCCESS, or REGEX_ERR_MEMORY if the NFA would be over the
+ *   budget or MAX_NFA_NODES, or an allocation failed.
+ */
+static short nfa_build(Regex *regex, Ast *tree, int root, int reverse,
+                       unsigned long *memory)
+{
+    Node *nodes;
+    long num_nodes;
+    unsigned long cost;
+    int start;
+    int end;
+
+    /*  and a match node after the end of the tree's fragment  */
+    num_nodes = nfa_count_nodes(tree, root) + 1;
+    if (num_nodes > MAX_NFA_NODES)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    cost = (unsigned long) num_nodes * NFA_NODE_BYTES;
+    if (*memory > 0)
+    {
+        if (cost >= *memory)
+        {
+            return REGEX_ERR_MEMORY;
+        }
+        *memory -= cost;
+    }
+
+    nodes = malloc(num_nodes * sizeof(Node));
+    regex->nfa_labels = calloc(num_nodes, sizeof(NfaLabel));
+    regex->nfa_buckets = malloc(num_nodes * sizeof(Bucket));
+    if (nodes == 0 || regex->nfa_labels == 0 || regex->nfa_buckets == 0)
+    {
+        free(nodes);
+        return REGEX_ERR_MEMORY;
+    }
+    graph_init(&regex->nfa, nodes, (int) num_nodes);
+
+    nfa_build_fragment(regex, tree, root, &start, &end, reverse);
+    nfa_add_edge(regex, end, nfa_new_node(regex, NFA_MATCH));
+    regex->nfa_start = start;
+
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Build the fragment of the NFA for a subtree, Thompson style.
+ * Every fragment has a single start node and a single end node, and the end
+ * node is an epsilon or capture node without edges out.
+ *
+ * @tree: The syntax tree.
+ * @idx: Index of the root of the subtree.
+ * @start: Set to the id of the start node of the fragment.
+ * @end: Set to the id of the end node of the fragment.
+ * @reverse: Bool. Build the fragment of the reversed subtree.
+ */
+static void nfa_build_fragment(Regex *regex, Ast *tree, int idx, int *start,
+                               int *end, int reverse)
+{
+    Ast *node;
+    int body_start;
+    int body_end;
+    int next_start;
+    int next_end;
+    int copy;
+    int split;
+
+    node = &tree[idx];
+    switch (node->type)
+    {
+    case AST_EMPTY:
+        *start = nfa_new_node(regex, NFA_EPSILON);
+        *end = *start;
+        break;
+
+    case AST_BYTES:
+        *start = nfa_new_node(regex, NFA_BYTES);
+        *end = nfa_new_node(regex, NFA_EPSILON);
+        memcpy(regex->nfa_labels[*start].bytes, node->bytes, 32);
+        nfa_add_edge(regex, *start, *end);
+        break;
+
+    case AST_CONCAT:
+        /*  reversing a regex only changes the order of concatenations  */
+        nfa_build_fragment(regex, tree, reverse ? node->right : node->left,
+                           start, &body_end, reverse);
+        nfa_build_fragment(regex, tree, reverse ? node->left : node->right,
+                           &next_start, end, reverse);
+        nfa_add_edge(regex, body_end, next_start);
+        break;
+
+    case AST_ALTERNATE:
+        *start = nfa_new_node(regex, NFA_EPSILON);
+        nfa_build_fragment(regex, tree, node->left, &body_start,
+                           &body_end, reverse);
+        nfa_add_edge(regex, *start, body_start);
+        nfa_build_fragment(regex, tree, node->right, &next_start,
+                           &next_end, reverse);
+        nfa_add_edge(regex, *start, next_start);
+        *end = nfa_new_node(regex, NFA_EPSILON);
+        nfa_add_edge(regex, body_end, *end);
+        nfa_add_edge(regex, next_end, *end);
+        break;
+
+    case AST_GROUP:
+        *start = nfa_new_node(regex, NFA_CAPTURE);
+        regex->nfa_labels[*start].capture = 2 * node->min;
+        nfa_build_fragment(regex, tree, node->left, &body_start,
+                           &body_end, reverse);
+        *end = nfa_new_node(regex, NFA_CAPTURE);
+        regex->nfa_labels[*end].capture = 2 * node->min + 1;
+        nfa_add_edge(regex, *start, body_start);
+        nfa_add_edge(regex, body_end, *end);
+        break;
+
+    default:
+        if (node->max == 0)
+        {
+            *start = nfa_new_node(regex, NFA_EPSILON);
+            *end = *start;
+            break;
+        }
+
+        /*  the mandatory copies, the last one looping back if unbounded  */
+        *start = -1;
+        *end = -1;
+        for (copy = 0; copy < node->min; copy++)
+        {
+            nfa_build_fragment(regex, tree, node->left, &body_start,
+                               &body_end, reverse);
+            if (*start < 0)
+            {
+                *start = body_start;
+            }
+            else
+            {
+                nfa_add_edge(regex, *end, body_start);
+            }
+            *end = body_end;
+
+            if (copy == node->min - 1 && node->max < 0)
+            {
+                next_end = nfa_new_node(regex, NFA_EPSILON);
+                nfa_add_choice(regex, body_end, body_start, next_end,
+                               node->lazy);
+                *end = next_end;
+            }
+        }
+        if (node->max < 0 && node->min == 0)
+        {
+            /*  a star  */
+            *start = nfa_new_node(regex, NFA_EPSILON);
+            nfa_build_fragment(regex, tree, node->left, &body_start,
+                               &body_end, reverse);
+            *end = nfa_new_node(regex, NFA_EPSILON);
+            nfa_add_choice(regex, *start, body_start, *end, node->lazy);
+            nfa_add_choice(regex, body_end, body_start, *end, node->lazy);
+        }
+        if (node->max < 0)
+        {
+            break;
+        }
+
+        /*  the optional copies, nested as in 'x(x(x)?)?'  */
+        if (node->max > node->min)
+        {
+            next_end = nfa_new_node(regex, NFA_EPSILON);
+            for (copy = node->min; copy < node->max; copy++)
+            {
+                split = nfa_new_node(regex, NFA_EPSILON);
+                if (*start < 0)
+                {
+                    *start = split;
+                }
+                else
+                {
+                    nfa_add_edge(regex, *end, split);
+                }
+                nfa_build_fragment(regex, tree, node->left, &body_start,
+                                   &body_end, reverse);
+                nfa_add_choice(regex, split, body_start, next_end,
+                               node->lazy);
+                *end = body_end;
+            }
+            nfa_add_edge(regex, *end, next_end);
+            *end = next_end;
+        }
+        break;
+    }
+}
+
+/*
+ * Find the literal searches look for first, see Regex.literal: the literal
+ * bytes at the end of the regex if it ends with some, else its longest run of
+ * literal bytes. Only bytes the regex is a concatenation of count, not those
+ * inside alternations or repetitions.
+ *
+ * @tree: The syntax tree.
+ * @root: Index of the root of @tree.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short literal_build(Regex *regex, Ast *tree, int root)
+{
+    unsigned char byte;
+    int *factors;
+    int *repeats;
+    int num_factors;
+    int first;
+    int last;
+    int len;
+    int best_first;
+    int best_last;
+    int best_len;
+    int idx;
+    long before;
+    long max_len;
+
+    regex->literal_len = 0;
+    regex->literal_suffix = 0;
+    regex->literal_before = -1;
+    factors = malloc(2 * nfa_count_nodes(tree, root) * sizeof(int));
+    if (factors == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    num_factors = 0;
+    byte = 0;
+    literal_factors(tree, root, factors, &num_factors);
+    repeats = factors + num_factors;
+    for (idx = 0; idx < num_factors; idx++)
+    {
+        repeats[idx] = literal_repeats(tree, factors[idx], &byte);
+    }
+
+    /*  the run of literal factors at the end, or the longest one  */
+    best_first = 0;
+    best_last = 0;
+    best_len = 0;
+    for (first = 0; first < num_factors; first = last + 1)
+    {
+        len = 0;
+        for (last = first; last < num_factors && repeats[last] > 0; last++)
+        {
+            len += repeats[last];
+        }
+        if (len > best_len || (len > 0 && last == num_factors))
+        {
+            best_first = first;
+            best_last = last;
+            best_len = len;
+        }
+    }
+    if (best_len == 0)
+    {
+        free(factors);
+        return REGEX_SUCCESS;
+    }
+    regex->literal_suffix = best_last == num_factors;
+
+    before = 0;
+    for (idx = 0; idx < best_first && before >= 0; idx++)
+    {
+        max_len = ast_max_len(tree, factors[idx]);
+        before = max_len < 0 ? -1 : before + max_len;
+    }
+
+    /*  keep the end of a long suffix, the start of any other literal  */
+    if (best_len > REGEX_MAX_LITERAL && regex->literal_suffix)
+    {
+        if (before >= 0)
+        {
+            before += best_len - REGEX_MAX_LITERAL;
+        }
+        len = 0;
+        for (idx = best_last - 1; len < REGEX_MAX_LITERAL; idx--)
+        {
+            for (first = 0; first < repeats[idx] && len < REGEX_MAX_LITERAL;
+                 first++)
+            {
+                literal_repeats(tree, factors[idx], &byte);
+                regex->literal[REGEX_MAX_LITERAL - ++len] = byte;
+            }
+        }
+        regex->literal_len = REGEX_MAX_LITERAL;
+    }
+    else
+    {
+        len = 0;
+        for (idx = best_first; idx < best_last && len < REGEX_MAX_LITERAL;
+             idx++)
+        {
+            for (first = 0; first < repeats[idx] && len < REGEX_MAX_LITERAL;
+                 first++)
+            {
+                literal_repeats(tree, factors[idx], &byte);
+                regex->literal[len++] = byte;
+            }
+        }
+        regex->literal_len = len;
+    }
+    regex->literal_before = before;
+
+    free(factors);
+    return REGEX_SUCCESS;
+}
+
+/*
+ * List the nodes a subtree is a concatenation of, looking through groups.
+ *
+ * @idx: Index of the root of the subtree.
+ * @factors: Where to add the nodes, in order.
+ * @count: Number of nodes in @factors, updated.
+ */
+static void literal_factors(Ast *tree, int idx, int *factors, int *count)
+{
+    if (tree[idx].type == AST_CONCAT)
+    {
+        literal_factors(tree, tree[idx].left, factors, count);
+        literal_factors(tree, tree[idx].right, factors, count);
+    }
+    else if (tree[idx].type == AST_GROUP)
+    {
+        literal_factors(tree, tree[idx].left, factors, count);
+    }
+    else
+    {
+        factors[(*count)++] = idx;
+    }
+}
+
+/*
+ * Tell if a node only matches one byte repeated a fixed number of times,
+ * eg 'a' or 'a{3}'.
+ *
+ * @idx: Index of the node.
+ * @byte: Set to the byte.
+ * @return: Number of times the byte is repeated, 0 if the node isn't so.
+ */
+static int literal_repeats(Ast *tree, int idx, unsigned char *byte)
+{
+    Ast *node;
+    int count;
+    int found;
+
+    node = &tree[idx];
+    if (node->type == AST_REPEAT && node->min == node->max)
+    {
+        return node->min * literal_repeats(tree, node->left, byte);
+    }
+    if (node->type == AST_GROUP)
+    {
+        return literal_repeats(tree, node->left, byte);
+    }
+    if (node->type != AST_BYTES)
+    {
+        return 0;
+    }
+
+    count = 0;
+    for (found = 0; found < 256; found++)
+    {
+        if (BYTES_HAS(node->bytes, found))
+        {
+            *byte = (unsigned char) found;
+            count++;
+        }
+    }
+    return count == 1;
+}
+
+/*
+ * Find the length of the longest string a subtree matches.
+ * It is never more than the number of nodes of the NFA, so it can't overflow.
+ *
+ * @idx: Index of the root of the subtree.
+ * @return: The length, -1 if unbounded.
+ */
+static long ast_max_len(Ast *tree, int idx)
+{
+    Ast *node;
+    long left;
+    long right;
+
+    node = &tree[idx];
+    switch (node->type)
+    {
+    case AST_EMPTY:
+        return 0;
+    case AST_BYTES:
+        return 1;
+    case AST_GROUP:
+        return ast_max_len(tree, node->left);
+    case AST_CONCAT:
+    case AST_ALTERNATE:
+        left = ast_max_len(tree, node->left);
+        right = ast_max_len(tree, node->right);
+        if (left < 0 || right < 0)
+        {
+            return -1;
+        }
+        if (node->type == AST_CONCAT)
+        {
+            return left + right;
+        }
+        return left > right ? left : right;
+    default:
+        if (node->max == 0)
+        {
+            return 0;
+        }
+        left = ast_max_len(tree, node->left);
+        if (node->max < 0)
+        {
+            return left == 0 ? 0 : -1;
+        }
+        return left < 0 ? -1 : left * node->max;
+    }
+}
+
+/*
+ * Take the next unused node of the NFA and give it a bucket for its edges.
+ *
+ * @type: The NFA_* type of the node.
+ * @return: Id of the node.
+ */
+static int nfa_new_node(Regex *regex, int type)
+{
+    int node_id;
+
+    node_id = regex->nfa.num_nodes++;
+    regex->nfa_labels[node_id].type = (unsigned char) type;
+    graph_add_bucket(&regex->nfa, node_id, &regex->nfa_buckets[node_id]);
+
+    return node_id;
+}
+
+/*
+ * Add an edge to the NFA. Edges added first have the highest priority.
+ * No node has more edges than fit in its bucket, so this can't fail.
+ *
+ * @from_id: Id of the node the edge starts at.
+ * @to_id: Id of the node the edge ends at.
+ */
+static void nfa_add_edge(Regex *regex, int from_id, int to_id)
+{
+    graph_add_edge(&regex->nfa, from_id, to_id);
+    regex->nfa.num_edges++;
+}
+
+/*
+ * Add the two edges of a repetition's choice between going through its body
+ * again and leaving it. A greedy repetition prefers the body, a lazy one
+ * prefers leaving.
+ *
+ * @from_id: Id of the node the choice is made at.
+ * @body_id: Id of the start node of the body.
+ * @exit_id: Id of the node past the repetition.
+ * @lazy: Bool. The repetition is lazy.
+ */
+static void nfa_add_choice(Regex *regex, int from_id, int body_id, int exit_id,
+                           int lazy)
+{
+    nfa_add_edge(regex, from_id, lazy ? exit_id : body_id);
+    nfa_add_edge(regex, from_id, lazy ? body_id : exit_id);
+}
+
+/*
+ * Split the 256 bytes into classes of bytes that no node of the NFA tells
+ * apart. DFA rows then only need one cell per class instead of one per byte.
+ *
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short classes_build(Regex *regex)
+{
+    unsigned char boundary[256];
+    NfaLabel *label;
+    int node_id;
+    int byte;
+
+    regex->classes = malloc(256);
+    if (regex->classes == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+
+    /*  a new class starts wherever a node's set changes membership  */
+    memset(boundary, 0, sizeof(boundary));
+    for (node_id = 0; node_id < regex->nfa.num_nodes; node_id++)
+    {
+        label = &regex->nfa_labels[node_id];
+        if (label->type != NFA_BYTES)
+        {
+            continue;
+        }
+        for (byte = 1; byte < 256; byte++)
+        {
+            if (!BYTES_HAS(label->bytes, byte) !=
+                !BYTES_HAS(label->bytes, byte - 1))
+            {
+                boundary[byte] = 1;
+            }
+        }
+    }
+
+    regex->classes[0] = 0;
+    for (byte = 1; byte < 256; byte++)
+    {
+        regex->classes[byte] = (unsigned char) (regex->classes[byte - 1] +
+                                                boundary[byte]);
+    }
+
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Allocate the scratch space of a subset construction and add its first
+ * states: the dead state (the empty set) as state 0, then the start state.
+ *
+ * @regex: The regex whose NFA to convert. Only its heap storage is kept.
+ * @max_states: Most states to build, 0 if unlimited.
+ * @max_memory: Most memory the states may take, 0 if unlimited.
+ * @search: Bool. Build a search DFA, see builder_search_next.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY. @builder must be freed either
+ *   way.
+ */
+static short builder_init(DfaBuilder *builder, const Regex *regex,
+                          int max_states, unsigned long max_memory,
+                          int search)
+{
+    int num_nodes;
+    int idx;
+
+    num_nodes = regex->nfa.num_nodes;
+    memset(builder, 0, sizeof(DfaBuilder));
+    builder->search = search;
+    builder->priority = search && regex->match_kind == REGEX_LEFTMOST_FIRST;
+    builder->nfa = regex->nfa;
+    builder->labels = regex->nfa_labels;
+    builder->classes = regex->classes;
+    builder->stride = regex->classes[255] + 1;
+    builder->max_states = max_states;
+    builder->max_memory = max_memory;
+    for (idx = 255; idx >= 0; idx--)
+    {
+        builder->representative[builder->classes[idx]] = idx;
+    }
+
+    builder->marks = calloc(num_nodes, sizeof(int));
+    builder->stack = malloc((num_nodes + regex->nfa.num_edges) * sizeof(int));
+    builder->seeds = malloc(num_nodes * sizeof(int));
+    builder->saved = malloc(num_nodes * sizeof(int));
+    builder->hash_size = 64;
+    builder->hash = malloc(builder->hash_size * sizeof(int));
+    if (builder->marks == 0 || builder->stack == 0 || builder->seeds == 0 ||
+        builder->saved == 0 || builder->hash == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    if (search)
+    {
+        /*  the flag, then each node and at most one -1 per node  */
+        builder->work = malloc((1 + 2 * (long) num_nodes) * sizeof(int));
+        if (builder->work == 0)
+        {
+            return REGEX_ERR_MEMORY;
+        }
+    }
+    for (idx = 0; idx < builder->hash_size; idx++)
+    {
+        builder->hash[idx] = -1;
+    }
+
+    if (builder_intern(builder, 0, 0) < 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    builder->nfa_start = regex->nfa_start;
+    builder->start = builder_start(builder);
+    if (builder->start < 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Release the scratch space of a subset construction.
+ */
+static void builder_free(DfaBuilder *builder)
+{
+    free(builder->marks);
+    free(builder->stack);
+    free(builder->seeds);
+    free(builder->saved);
+    free(builder->work);
+    free(builder->pool);
+    free(builder->set_offset);
+    free(builder->set_len);
+    free(builder->hash);
+    free(builder->trans);
+}
+
+/*
+ * Add the start state of a subset construction.
+ *
+ * @return: Id of the state, BUILDER_FULL or BUILDER_NO_MEMORY.
+ */
+static int builder_start(DfaBuilder *builder)
+{
+    int num_seeds;
+
+    if (builder->search)
+    {
+        return builder_search_next(builder, 0, 0, -1);
+    }
+    builder->seeds[0] = builder->nfa_start;
+    num_seeds = builder_closure(builder, builder->seeds, 1);
+    return builder_intern(builder, builder->seeds, num_seeds);
+}
+
+/*
+ * Compare two NFA node ids, for qsort.
+ */
+static int compare_ids(const void *left, const void *right)
+{
+    return *(const int *) left - *(const int *) right;
+}
+
+/*
+ * Start a new mark, so no NFA node counts as visited.
+ */
+static void builder_new_mark(DfaBuilder *builder)
+{
+    if (builder->mark == INT_MAX)
+    {
+        /*  a long lived lazy DFA can run out of marks, start over  */
+        memset(builder->marks, 0, builder->nfa.num_nodes * sizeof(int));
+        builder->mark = 0;
+    }
+    builder->mark++;
+}
+
+/*
+ * Compute the epsilon closure of a set of NFA nodes.
+ * The closure is left in @builder->seeds, sorted, and only keeps the nodes
+ * that matter to a DFA state: NFA_BYTES and NFA_MATCH nodes.
+ *
+ * @seeds: The nodes to start from. May alias @builder->seeds.
+ * @num_seeds: Number of nodes in @seeds.
+ * @return: The number of nodes in the closure.
+ */
+static int builder_closure(DfaBuilder *builder, int *seeds, int num_seeds)
+{
+    builder_new_mark(builder);
+    return builder_close(builder, seeds, num_seeds, builder->seeds);
+}
+
+/*
+ * Compute the epsilon closure of a set of NFA nodes, leaving out the nodes
+ * visited since the last builder_new_mark, and marking the others.
+ * Nodes are visited in order of priority, like a backtracking engine would.
+ *
+ * @seeds: The nodes to start from, in order of priority.
+ * @num_seeds: Number of nodes in @seeds.
+ * @out: Where to put the closure, sorted, or in order of priority up to the
+ *   first NFA_MATCH if @builder->priority is set. May alias @seeds.
+ * @return: The number of nodes in the closure.
+ */
+static int builder_close(DfaBuilder *builder, int *seeds, int num_seeds,
+                         int *out)
+{
+    Graph *nfa;
+    Bucket *bucket;
+    int *stack;
+    int depth;
+    int node_id;
+    int count;
+    int idx;
+
+    nfa = &builder->nfa;
+    stack = builder->stack;
+
+    /*  each seed's edges were followed, seeds are pushed like edge targets  */
+    depth = 0;
+    for (idx = num_seeds - 1; idx >= 0; idx--)
+    {
+        stack[depth++] = seeds[idx];
+    }
+
+    count = 0;
+    while (depth > 0)
+    {
+        node_id = stack[--depth];
+        if (builder->marks[node_id] == builder->mark)
+        {
+            continue;
+        }
+        builder->marks[node_id] = builder->mark;
+
+        if (builder->labels[node_id].type == NFA_MATCH && builder->priority)
+        {
+            out[count++] = node_id;
+            return count;
+        }
+        if (builder->labels[node_id].type == NFA_BYTES ||
+            builder->labels[node_id].type == NFA_MATCH)
+        {
+            out[count++] = node_id;
+            continue;
+        }
+
+        /*  every node has one bucket, push its edges so the first pops
+            first  */
+        bucket = nfa->nodes[node_id].edges_out;
+        for (idx = BUCKET_SIZE - 1; bucket != 0 && idx >= 0; idx--)
+        {
+            if (bucket->adj_nodes[idx] != 0)
+            {
+                stack[depth++] = bucket->adj_nodes[idx]->id;
+            }
+        }
+    }
+
+    if (!builder->priority)
+    {
+        qsort(out, count, sizeof(int), compare_ids);
+    }
+    return count;
+}
+
+/*
+ * Find the state of a search DFA after a byte. A search DFA runs from where
+ * a search starts, and accepts where the leftmost-longest match ends the
+ * last time it accepts.
+ * Its sets start with a flag telling if matches may still start. Then come
+ * groups of the nodes of matches that started at the same place, each ending
+ * with a -1, earliest start first. A node reached by several groups is only
+ * kept in the earliest. Once a group holds a match, no more matches start and
+ * later groups are dropped, since their matches would start further right.
+ *
+ * @set: The set of the state to step, unused for the start state.
+ * @len: Number of ints in @set.
+ * @byte: Byte to step on, or -1 to find the start state.
+ * @return: Id of the state, BUILDER_FULL or BUILDER_NO_MEMORY.
+ */
+static int builder_search_next(DfaBuilder *builder, int *set, int len,
+                               int byte)
+{
+    NfaLabel *label;
+    int starting;
+    int matched;
+    int num_seeds;
+    int count;
+    int idx;
+
+    starting = byte < 0 || (len > 0 && set[0]);
+    matched = 0;
+    count = 1;
+    builder_new_mark(builder);
+    for (idx = 1; idx < len && !matched; idx++)
+    {
+        /*  step the group up to its -1  */
+        num_seeds = 0;
+        for (; set[idx] >= 0; idx++)
+        {
+            label = &builder->labels[set[idx]];
+            if (label->type == NFA_BYTES && BYTES_HAS(label->bytes, byte))
+            {
+                builder->seeds[num_seeds++] =
+                    builder->nfa.nodes[set[idx]].edges_out->adj_nodes[0]->id;
+            }
+        }
+        matched = builder_search_group(builder, num_seeds, &count);
+    }
+    if (starting && !matched)
+    {
+        builder->seeds[0] = builder->nfa_start;
+        matched = builder_search_group(builder, 1, &count);
+    }
+
+    /*  nothing left to match is the dead state  */
+    builder->work[0] = starting && !matched;
+    if (count == 1 && !builder->work[0])
+    {
+        count = 0;
+    }
+    return builder_intern(builder, builder->work, count);
+}
+
+/*
+ * Add a group to the set builder_search_next is building: the closure of
+ * some nodes, less those earlier groups hold.
+ *
+ * @num_seeds: Number of nodes in @builder->seeds to start from.
+ * @count: Number of ints in @builder->work so far, updated.
+ * @return: 1 if the group holds a match, 0 if not.
+ */
+static int builder_search_group(DfaBuilder *builder, int num_seeds,
+                                int *count)
+{
+    int *group;
+    int num_nodes;
+    int matched;
+    int idx;
+
+    group = builder->work + *count;
+    num_nodes = builder_close(builder, builder->seeds, num_seeds, group);
+    if (num_nodes == 0)
+    {
+        return 0;
+    }
+
+    matched = 0;
+    for (idx = 0; idx < num_nodes; idx++)
+    {
+        if (builder->labels[group[idx]].type == NFA_MATCH)
+        {
+            matched = 1;
+        }
+    }
+    group[num_nodes] = -1;
+    *count += num_nodes + 1;
+    return matched;
+}
+
+/*
+ * Find the DFA state of a set of NFA nodes, adding it if it is new.
+ * New states start with every transition BUILDER_UNKNOWN.
+ *
+ * @set: The sorted set of NFA nodes.
+ * @len: Number of nodes in @set.
+ * @return: Id of the state, BUILDER_FULL if it is new but the limits of
+ *   @builder are reached, or BUILDER_NO_MEMORY.
+ */
+static int builder_intern(DfaBuilder *builder, int *set, int len)
+{
+    unsigned long hash;
+    unsigned long cost;
+    int *table;
+    int state;
+    int size;
+    int slot;
+    int idx;
+    void *grown;
+
+    hash = 2166136261UL;
+    for (idx = 0; idx < len; idx++)
+    {
+        hash = (hash ^ (unsigned long) set[idx]) * 16777619UL;
+    }
+
+    /*  look the set up  */
+    slot = (int) (hash & (builder->hash_size - 1));
+    while (builder->hash[slot] >= 0)
+    {
+        state = builder->hash[slot];
+        if (builder->set_len[state] == len &&
+            memcmp(&builder->pool[builder->set_offset[state]], set,
+                   len * sizeof(int)) == 0)
+        {
+            return state;
+        }
+        slot = (slot + 1) & (builder->hash_size - 1);
+    }
+
+    /*  a row of transitions, the set, and its bookkeeping  */
+    cost = (builder->stride + len + 4) * sizeof(int) + sizeof(long);
+    if (builder->num_states >= BUILDER_MIN_STATES &&
+        ((builder->max_states > 0 &&
+          builder->num_states >= builder->max_states) ||
+         (builder->max_memory > 0 &&
+          builder->memory + cost > builder->max_memory)))
+    {
+        return BUILDER_FULL;
+    }
+
+    /*  make room for a new state  */
+    if (builder->num_states == builder->states_size)
+    {
+        size = builder->states_size == 0 ? 64 : builder->states_size * 2;
+        grown = realloc(builder->set_offset, size * sizeof(long));
+        if (grown == 0)
+        {
+            return BUILDER_NO_MEMORY;
+        }
+        builder->set_offset = grown;
+        grown = realloc(builder->set_len, size * sizeof(int));
+        if (grown == 0)
+        {
+            return BUILDER_NO_MEMORY;
+        }
+        builder->set_len = grown;
+        grown = realloc(builder->trans,
+                        (size_t) size * builder->stride * sizeof(int));
+        if (grown == 0)
+        {
+            return BUILDER_NO_MEMORY;
+        }
+        builder->trans = grown;
+        builder->states_size = size;
+    }
+    if (builder->pool_len + len > builder->pool_size)
+    {
+        size = builder->pool_size == 0 ? 256 : (int) builder->pool_size * 2;
+        while (size < builder->pool_len + len)
+        {
+            size *= 2;
+        }
+        grown = realloc(builder->pool, size * sizeof(int));
+        if (grown == 0)
+        {
+            return BUILDER_NO_MEMORY;
+        }
+        builder->pool = grown;
+        builder->pool_size = size;
+    }
+
+    /*  add it  */
+    state = builder->num_states++;
+    builder->set_offset[state] = builder->pool_len;
+    builder->set_len[state] = len;
+    if (len > 0)
+    {
+        memcpy(&builder->pool[builder->pool_len], set, len * sizeof(int));
+    }
+    builder->pool_len += len;
+    builder->hash[slot] = state;
+    builder->memory += cost;
+    for (idx = 0; idx < builder->stride; idx++)
+    {
+        builder->trans[state * builder->stride + idx] = BUILDER_UNKNOWN;
+    }
+
+    /*  keep the hash table at most half full  */
+    if (builder->num_states * 2 > builder->hash_size)
+    {
+        size = builder->hash_size * 2;
+        table = malloc(size * sizeof(int));
+        if (table == 0)
+        {
+            return BUILDER_NO_MEMORY;
+        }
+        for (idx = 0; idx < size; idx++)
+        {
+            table[idx] = -1;
+        }
+        for (idx = 0; idx < builder->num_states; idx++)
+        {
+            len = builder->set_len[idx];
+            set = &builder->pool[builder->set_offset[idx]];
+            hash = 2166136261UL;
+            for (slot = 0; slot < len; slot++)
+            {
+                hash = (hash ^ (unsigned long) set[slot]) * 16777619UL;
+            }
+            slot = (int) (hash & (size - 1));
+            while (table[slot] >= 0)
+            {
+                slot = (slot + 1) & (size - 1);
+            }
+            table[slot] = idx;
+        }
+        free(builder->hash);
+        builder->hash = table;
+        builder->hash_size = size;
+    }
+
+    return state;
+}
+
+/*
+ * Determine if a DFA state accepts, ie its set holds the NFA_MATCH node.
+ *
+ * @state: Id of the state.
+ * @return: Bool. 1 if @state accepts, 0 if not.
+ */
+static int builder_accepts(DfaBuilder *builder, int state)
+{
+    int *set;
+    int idx;
+
+    /*  skip the flag and the -1s of a search DFA's sets  */
+    set = &builder->pool[builder->set_offset[state]];
+    for (idx = builder->search; idx < builder->set_len[state]; idx++)
+    {
+        if (set[idx] >= 0 && builder->labels[set[idx]].type == NFA_MATCH)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Compute one transition of a state, adding the state it leads to if new.
+ *
+ * @state: Id of the state to step.
+ * @class_idx: Class of the byte to step on.
+ * @return: Id of the next state, BUILDER_FULL or BUILDER_NO_MEMORY.
+ */
+static int builder_step(DfaBuilder *builder, int state, int class_idx)
+{
+    NfaLabel *label;
+    int *set;
+    int num_seeds;
+    int byte;
+    int next;
+    int idx;
+
+    builder->misses++;
+    byte = builder->representative[class_idx];
+    set = &builder->pool[builder->set_offset[state]];
+    if (builder->search)
+    {
+        next = builder_search_next(builder, set, builder->set_len[state],
+                                   byte);
+        if (next >= 0)
+        {
+            builder->trans[state * builder->stride + class_idx] = next;
+        }
+        return next;
+    }
+
+    /*  step every node that consumes this class  */
+    num_seeds = 0;
+    for (idx = 0; idx < builder->set_len[state]; idx++)
+    {
+        label = &builder->labels[set[idx]];
+        if (label->type == NFA_BYTES && BYTES_HAS(label->bytes, byte))
+        {
+            builder->seeds[num_seeds++] =
+                builder->nfa.nodes[set[idx]].edges_out->adj_nodes[0]->id;
+        }
+    }
+
+    num_seeds = builder_closure(builder, builder->seeds, num_seeds);
+    next = builder_intern(builder, builder->seeds, num_seeds);
+    if (next >= 0)
+    {
+        builder->trans[state * builder->stride + class_idx] = next;
+    }
+    return next;
+}
+
+/*
+ * Run the subset construction to the end, filling in the transitions of
+ * every reachable state.
+ *
+ * @return: REGEX_SUCCESS, REGEX_ERR_MEMORY, or STATUS_OVER_BUDGET if the
+ *   limits of @builder were reached.
+ */
+static short builder_run(DfaBuilder *builder)
+{
+    int state;
+    int class_idx;
+    int next;
+
+    /*  states are numbered in the order they're found, so this is a BFS  */
+    for (state = 0; state < builder->num_states; state++)
+    {
+        for (class_idx = 0; class_idx < builder->stride; class_idx++)
+        {
+            next = builder_step(builder, state, class_idx);
+            if (next == BUILDER_FULL)
+            {
+                return STATUS_OVER_BUDGET;
+            }
+            if (next < 0)
+            {
+                return REGEX_ERR_MEMORY;
+            }
+        }
+    }
+
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Forget every state but the dead and start states, keeping the memory.
+ * Ids of other states are invalidated.
+ */
+static void builder_clear(DfaBuilder *builder)
+{
+    int idx;
+
+    builder->num_states = 0;
+    builder->pool_len = 0;
+    builder->memory = 0;
+    builder->clears++;
+    for (idx = 0; idx < builder->hash_size; idx++)
+    {
+        builder->hash[idx] = -1;
+    }
+
+    /*  these were added before, so there is room for them  */
+    builder_intern(builder, 0, 0);
+    builder->start = builder_start(builder);
+}
+
+/*
+ * Find the bytes a non-empty match of a regex can start with: those some
+ * node of the start state consumes.
+ *
+ * @regex: The regex, whose first bytes are set.
+ * @builder: The subset construction of the regex's DFA, just started.
+ */
+static void first_bytes_build(Regex *regex, DfaBuilder *builder)
+{
+    NfaLabel *label;
+    int *set;
+    int count;
+    int idx;
+
+    memset(regex->first_bytes, 0, sizeof(regex->first_bytes));
+    set = &builder->pool[builder->set_offset[builder->start]];
+    for (idx = 0; idx < builder->set_len[builder->start]; idx++)
+    {
+        label = &builder->labels[set[idx]];
+        if (label->type == NFA_BYTES)
+        {
+            for (count = 0; count < 32; count++)
+            {
+                regex->first_bytes[count] |= label->bytes[count];
+            }
+        }
+    }
+
+    count = 0;
+    regex->first_byte = -1;
+    for (idx = 0; idx < 256; idx++)
+    {
+        if (BYTES_HAS(regex->first_bytes, idx))
+        {
+            regex->first_byte = idx;
+            count++;
+        }
+    }
+    if (count != 1)
+    {
+        regex->first_byte = -1;
+    }
+}
+
+/*
+ * Choose how a regex matches whole strings, once its DFA is built.
+ *
+ * @regex: The regex, whose plan is set.
+ * @options: Options the regex is compiled with.
+ */
+static void plan_match(Regex *regex, RegexOptions *options)
+{
+    RegexPlan *plan;
+
+    plan = &regex->plan;
+    plan->match_engine = REGEX_ENGINE_DFA;
+    if (regex->literal_only > 0)
+    {
+        plan->match_engine = REGEX_ENGINE_LITERAL;
+        plan->match_reason = "the regex has no metacharacters";
+    }
+    else if (regex->dfa.format == REGEX_DFA_LAZY)
+    {
+        plan->match_engine = REGEX_ENGINE_LAZY_DFA;
+        plan->match_reason = "the DFA is over max_dfa_states or max_dfa_bytes";
+    }
+    else if (options->dfa_format != REGEX_DFA_AUTO)
+    {
+        plan->match_reason = "the format was set by dfa_format";
+    }
+    else if (regex->dfa.format == REGEX_DFA_HYBRID)
+    {
+        plan->match_reason = "the dense table is over dense_limit";
+    }
+    else if (regex->dfa.size <= options->dense_limit)
+    {
+        plan->match_reason = "the table is within dense_limit";
+    }
+    else
+    {
+        plan->match_reason = "a hybrid table would be no smaller";
+    }
+}
+
+/*
+ * Choose how a regex is searched for, once its search DFAs are built or not.
+ *
+ * @regex: The regex, whose plan is set.
+ * @options: Options the regex is compiled with.
+ */
+static void plan_search(Regex *regex, RegexOptions *options)
+{
+    RegexPlan *plan;
+
+    plan = &regex->plan;
+    if (regex->literal_only > 0)
+    {
+        plan->search_engine = REGEX_ENGINE_LITERAL;
+        plan->search_reason = "the regex has no metacharacters";
+        return;
+    }
+    if (regex->search.table != 0)
+    {
+        plan->search_engine = REGEX_ENGINE_SEARCH_DFA;
+        plan->search_reason = "both are within the budget";
+        return;
+    }
+
+    /*  the NFA runs every start at once, in one pass  */
+    plan->search_engine = REGEX_ENGINE_PIKE;
+    if (!options->reverse_dfa)
+    {
+        plan->search_reason = "reverse_dfa is off";
+    }
+    else if (regex->dfa.format == REGEX_DFA_LAZY)
+    {
+        plan->search_reason = "the search DFAs would be over budget like the "
+                              "DFA";
+    }
+    else
+    {
+        plan->search_reason = "the search DFAs are over budget";
+    }
+}
+
+/*
+ * Choose how searches skip ahead, once the regex's literal and first bytes
+ * are known.
+ *
+ * @regex: The regex, whose plan is set.
+ * @nullable: Bool. The regex matches the empty string.
+ */
+static void plan_prefilter(Regex *regex, int nullable)
+{
+    RegexPlan *plan;
+    int idx;
+
+    plan = &regex->plan;
+    if (regex->literal_only > 0)
+    {
+        plan->prefilter = REGEX_PREFILTER_LITERAL;
+        plan->prefilter_reason = "the regex has no metacharacters";
+    }
+    else if (regex->literal_len > 1 ||
+             (regex->literal_len == 1 && (regex->literal_before != 0 ||
+                                          regex->first_byte !=
+                                          regex->literal[0])))
+    {
+        /*  a single byte every match starts with is left to memchr  */
+        plan->prefilter = REGEX_PREFILTER_LITERAL;
+        plan->prefilter_reason = regex->literal_before >= 0 ?
+                                 "every match holds it near its start" :
+                                 "every match holds it";
+    }
+    else if (nullable)
+    {
+        plan->prefilter = REGEX_PREFILTER_NONE;
+        plan->prefilter_reason = "the regex matches the empty string";
+    }
+    else if (regex->first_byte >= 0)
+    {
+        plan->prefilter = REGEX_PREFILTER_BYTE;
+        plan->prefilter_reason = "every match starts with it";
+    }
+    else
+    {
+        plan->prefilter = REGEX_PREFILTER_NONE;
+        plan->prefilter_reason = "a match can start with any byte";
+        for (idx = 0; idx < 32; idx++)
+        {
+            if (regex->first_bytes[idx] != 0xff)
+            {
+                plan->prefilter = REGEX_PREFILTER_BYTES;
+                plan->prefilter_reason = "a match can only start with some "
+                                         "bytes";
+            }
+        }
+    }
+}
+
+/*
+ * Append text to a buffer, as much as fits with a null after it.
+ *
+ * @out: The buffer, may be null if @size is 0.
+ * @size: Size of @out.
+ * @len: Length of the text appended so far, even if it didn't fit.
+ * @text: The text to append.
+ * @return: Length of the text appended so far, with @text.
+ */
+static size_t explain_add(char *out, size_t size, size_t len,
+                          const char *text)
+{
+    size_t text_len;
+    size_t fits;
+
+    text_len = strlen(text);
+    if (len + 1 < size)
+    {
+        fits = size - 1 - len;
+        fits = text_len < fits ? text_len : fits;
+        memcpy(out + len, text, fits);
+        out[len + fits] = '\0';
+    }
+    else if (len == 0 && size > 0)
+    {
+        out[0] = '\0';
+    }
+    return len + text_len;
+}
+
+/*
+ * Write a set of bytes the way a class would, without the brackets, eg
+ * 'a-z0-9'. Bytes that aren't printable, or that would need escaping in DOT
+ * or JSON, are written as '\xHH' with the backslash escaped.
+ *
+ * @out: Set to the text and a null, at most EXPORT_LABEL_SIZE bytes.
+ * @bytes: Bitset of the bytes.
+ */
+static void export_bytes(char *out, const unsigned char *bytes)
+{
+    int first;
+    int last;
+
+    *out = '\0';
+    for (first = 0; first < 256; first = last + 1)
+    {
+        if (!BYTES_HAS(bytes, first))
+        {
+            last = first;
+            continue;
+        }
+        for (last = first; last < 255 && BYTES_HAS(bytes, last + 1); last++)
+        {
+        }
+        out = export_byte(out, first);
+        if (last > first + 1)
+        {
+            *out++ = '-';
+        }
+        if (last > first)
+        {
+            out = export_byte(out, last);
+        }
+        *out = '\0';
+    }
+}
+
+/*
+ * Write one byte for export_bytes.
+ *
+ * @out: Where to write it.
+ * @return: Just past what was written.
+ */
+static char *export_byte(char *out, int byte)
+{
+    if (byte > ' ' && byte < 127 && byte != '"' && byte != '\\' &&
+        byte != '-')
+    {
+        *out++ = (char) byte;
+        return out;
+    }
+    sprintf(out, "\\\\x%02x", byte);
+    return out + 5;
+}
+
+/*
+ * Write what regex_export puts before the states: the counts, and the states
+ * with the most edges out.
+ *
+ * @format: REGEX_EXPORT_DOT or REGEX_EXPORT_JSON.
+ * @name: "nfa" or "dfa".
+ * @num_states, @num_edges: Counts of the automaton.
+ * @start: Id of the start state, -1 if there is none.
+ * @fan_out: Number of edges out of each state.
+ * @return: Length of the text written so far, as explain_add.
+ */
+static size_t export_head(char *out, size_t size, size_t len, int format,
+                          const char *name, int num_states, long num_edges,
+                          int start, const int *fan_out)
+{
+    char line[128];
+    int top[EXPORT_TOP];
+    int num_top;
+    int best;
+    int state;
+    int idx;
+
+    /*  the few busiest states, busiest first  */
+    for (num_top = 0; num_top < EXPORT_TOP; num_top++)
+    {
+        best = -1;
+        for (state = 0; state < num_states; state++)
+        {
+            for (idx = 0; idx < num_top && top[idx] != state; idx++)
+            {
+            }
+            if (idx == num_top && fan_out[state] > 0 &&
+                (best < 0 || fan_out[state] > fan_out[best]))
+            {
+                best = state;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        top[num_top] = best;
+    }
+
+    if (format == REGEX_EXPORT_JSON)
+    {
+        sprintf(line, "{\"automaton\": \"%s\", \"num_states\": %d, "
+                "\"num_edges\": %ld, \"start\": %d,\n \"largest_fan_out\": [",
+                name, num_states, num_edges, start);
+        len = explain_add(out, size, len, line);
+        for (idx = 0; idx < num_top; idx++)
+        {
+            sprintf(line, "%s{\"state\": %d, \"edges\": %d}",
+                    idx > 0 ? ", " : "", top[idx], fan_out[top[idx]]);
+            len = explain_add(out, size, len, line);
+        }
+        return explain_add(out, size, len, "],\n \"states\": [");
+    }
+
+    sprintf(line, "digraph %s {\n    /*  %d states, %ld edges", name,
+            num_states, num_edges);
+    len = explain_add(out, size, len, line);
+    for (idx = 0; idx < num_top; idx++)
+    {
+        sprintf(line, "%s%d (%d edge%s)",
+                idx > 0 ? ", " : "\n        largest fan-out: ", top[idx],
+                fan_out[top[idx]], fan_out[top[idx]] == 1 ? "" : "s");
+        len = explain_add(out, size, len, line);
+    }
+    len = explain_add(out, size, len, "  */\n    rankdir=LR;\n");
+    if (start >= 0)
+    {
+        sprintf(line, "    start [shape=point];\n    start -> %d;\n", start);
+        len = explain_add(out, size, len, line);
+    }
+    return len;
+}
+
+/*
+ * Write an edge for regex_export.
+ *
+ * @format: REGEX_EXPORT_DOT or REGEX_EXPORT_JSON.
+ * @from, @to: Ids of the states it joins.
+ * @label: The bytes it is taken on, empty if none.
+ * @first: Bool. It is the first edge of @from.
+ * @return: Length of the text written so far, as explain_add.
+ */
+static size_t export_edge(char *out, size_t size, size_t len, int format,
+                          int from, int to, const char *label, int first)
+{
+    char line[64];
+
+    if (format == REGEX_EXPORT_JSON)
+    {
+        sprintf(line, "%s{\"to\": %d, \"label\": \"", first ? "" : ", ", to);
+        len = explain_add(out, size, len, line);
+        len = explain_add(out, size, len, label);
+        return explain_add(out, size, len, "\"}");
+    }
+    sprintf(line, "    %d -> %d", from, to);
+    len = explain_add(out, size, len, line);
+    if (*label != '\0')
+    {
+        len = explain_add(out, size, len, " [label=\"");
+        len = explain_add(out, size, len, label);
+        len = explain_add(out, size, len, "\"]");
+    }
+    return explain_add(out, size, len, ";\n");
+}
+
+/*
+ * Export the NFA of a regex, see regex_export.
+ *
+ * @return: Length of the whole text, or 0 if out of memory.
+ */
+static size_t export_nfa(const Regex *regex, int format, char *out,
+                         size_t size)
+{
+    static const char *types[] = {"epsilon", "bytes", "match", "capture"};
+    const NfaLabel *label;
+    Bucket *bucket;
+    char line[128];
+    char bytes[EXPORT_LABEL_SIZE];
+    int *fan_out;
+    long num_edges;
+    size_t len;
+    int first;
+    int node;
+    int idx;
+
+    fan_out = calloc(regex->nfa.num_nodes + 1, sizeof(int));
+    if (fan_out == 0)
+    {
+        return 0;
+    }
+    num_edges = 0;
+    for (node = 0; node < regex->nfa.num_nodes; node++)
+    {
+        for (bucket = regex->nfa.nodes[node].edges_out; bucket != 0;
+             bucket = bucket->next)
+        {
+            for (idx = 0; idx < BUCKET_SIZE; idx++)
+            {
+                fan_out[node] += bucket->adj_nodes[idx] != 0;
+            }
+        }
+        num_edges += fan_out[node];
+    }
+    len = export_head(out, size, 0, format, "nfa", regex->nfa.num_nodes,
+                      num_edges,
+                      regex->nfa.num_nodes > 0 ? regex->nfa_start : -1,
+                      fan_out);
+    free(fan_out);
+
+    for (node = 0; node < regex->nfa.num_nodes; node++)
+    {
+        label = &regex->nfa_labels[node];
+        bytes[0] = '\0';
+        if (label->type == NFA_BYTES)
+        {
+            export_bytes(bytes, label->bytes);
+        }
+        if (format == REGEX_EXPORT_JSON)
+        {
+            sprintf(line, "%s\n  {\"id\": %d, \"type\": \"%s\", "
+                    "\"accept\": %s, \"edges\": [", node > 0 ? "," : "",
+                    node, types[label->type],
+                    label->type == NFA_MATCH ? "true" : "false");
+        }
+        else if (label->type == NFA_CAPTURE)
+        {
+            /*  where a group starts or ends, as '(1' or '1)'  */
+            sprintf(line, "    %d [shape=box label=\"%d: %s%d%s\"];\n", node,
+                    node, label->capture % 2 == 0 ? "(" : "",
+                    label->capture / 2, label->capture % 2 == 0 ? "" : ")");
+        }
+        else
+        {
+            sprintf(line, "    %d [shape=%s];\n", node,
+                    label->type == NFA_MATCH ? "doublecircle" : "circle");
+        }
+        len = explain_add(out, size, len, line);
+
+        first = 1;
+        for (bucket = regex->nfa.nodes[node].edges_out; bucket != 0;
+             bucket = bucket->next)
+        {
+            for (idx = 0; idx < BUCKET_SIZE; idx++)
+            {
+                if (bucket->adj_nodes[idx] != 0)
+                {
+                    len = export_edge(out, size, len, format, node,
+                                      bucket->adj_nodes[idx]->id, bytes,
+                                      first);
+                    first = 0;
+                }
+            }
+        }
+        if (format == REGEX_EXPORT_JSON)
+        {
+            len = explain_add(out, size, len, "]}");
+        }
+    }
+    return explain_add(out, size, len,
+                       format == REGEX_EXPORT_JSON ? "\n]}\n" : "}\n");
+}
+
+/*
+ * Group the transitions of a DFA state by the state they lead to.
+ *
+ * @state: Id of the state in @builder.
+ * @to: Set to each state other than the dead one the state leads to, in
+ *   order of their first byte.
+ * @bytes: Set to the bitset of bytes leading to each of @to.
+ * @complete: Set to 0 if some transitions weren't built, 1 if not.
+ * @return: The number of states in @to.
+ */
+static int export_targets(DfaBuilder *builder, int state, int *to,
+                          unsigned char (*bytes)[32], int *complete)
+{
+    int ends[256];
+    int targets[256];
+    int count;
+    int range;
+    int num_to;
+    int byte;
+    int idx;
+
+    count = builder_ranges(builder, state, ends, targets);
+    num_to = 0;
+    *complete = 1;
+    for (range = 0; range < count; range++)
+    {
+        if (targets[range] == BUILDER_UNKNOWN)
+        {
+            *complete = 0;
+            continue;
+        }
+        if (targets[range] == 0)
+        {
+            continue;
+        }
+        for (idx = 0; idx < num_to && to[idx] != targets[range]; idx++)
+        {
+        }
+        if (idx == num_to)
+        {
+            to[num_to] = targets[range];
+            memset(bytes[num_to], 0, 32);
+            num_to++;
+        }
+        for (byte = range > 0 ? ends[range - 1] + 1 : 0; byte <= ends[range];
+             byte++)
+        {
+            BYTES_ADD(bytes[idx], byte);
+        }
+    }
+    return num_to;
+}
+
+/*
+ * Export the DFA of a regex, see regex_export.
+ *
+ * @return: Length of the whole text, or 0 if out of memory.
+ */
+static size_t export_dfa(const Regex *regex, int format, int max_states,
+                         char *out, size_t size)
+{
+    DfaBuilder builder;
+    unsigned char (*bytes)[32];
+    char line[128];
+    char label[EXPORT_LABEL_SIZE];
+    int to[256];
+    int *fan_out;
+    long num_edges;
+    size_t len;
+    int complete;
+    int num_to;
+    int state;
+    int idx;
+
+    /*  a plain literal has no automata  */
+    if (regex->literal_only > 0)
+    {
+        len = export_head(out, size, 0, format, "dfa", 0, 0, -1, 0);
+        return explain_add(out, size, len,
+                           format == REGEX_EXPORT_JSON ? "\n]}\n" : "}\n");
+    }
+
+    /*  the table has lost the sets, so build the states again  */
+    bytes = 0;
+    fan_out = 0;
+    if (builder_init(&builder, regex, max_states, 0, 0) != REGEX_SUCCESS ||
+        builder_run(&builder) == REGEX_ERR_MEMORY ||
+        (bytes = malloc(256 * sizeof(*bytes))) == 0 ||
+        (fan_out = calloc(builder.num_states, sizeof(int))) == 0)
+    {
+        free(bytes);
+        builder_free(&builder);
+        return 0;
+    }
+    num_edges = 0;
+    for (state = 0; state < builder.num_states; state++)
+    {
+        fan_out[state] = export_targets(&builder, state, to, bytes,
+                                        &complete);
+        num_edges += fan_out[state];
+    }
+    len = export_head(out, size, 0, format, "dfa", builder.num_states,
+                      num_edges, builder.start, fan_out);
+
+    for (state = 0; state < builder.num_states; state++)
+    {
+        num_to = export_targets(&builder, state, to, bytes, &complete);
+        if (format == REGEX_EXPORT_JSON)
+        {
+            sprintf(line, "%s\n  {\"id\": %d, \"accept\": %s, "
+                    "\"complete\": %s, \"nfa_nodes\": %d, \"edges\": [",
+                    state > 0 ? "," : "", state,
+                    builder_accepts(&builder, state) ? "true" : "false",
+                    complete ? "true" : "false", builder.set_len[state]);
+        }
+        else if (state == 0)
+        {
+            /*  the dead state would only clutter the graph  */
+            continue;
+        }
+        else
+        {
+            sprintf(line, "    %d [shape=%s%s];\n", state,
+                    builder_accepts(&builder, state) ? "doublecircle" :
+                    "circle", complete ? "" : " style=dashed");
+        }
+        len = explain_add(out, size, len, line);
+
+        for (idx = 0; idx < num_to; idx++)
+        {
+            export_bytes(label, bytes[idx]);
+            len = export_edge(out, size, len, format, state, to[idx], label,
+                              idx == 0);
+        }
+        if (format == REGEX_EXPORT_JSON)
+        {
+            len = explain_add(out, size, len, "]}");
+        }
+    }
+
+    free(bytes);
+    free(fan_out);
+    builder_free(&builder);
+    return explain_add(out, size, len,
+                       format == REGEX_EXPORT_JSON ? "\n]}\n" : "}\n");
+}
+
+/*
+ * Build the DFAs searches use to find a match in two passes, see
+ * RegexOptions.reverse_dfa. Neither is kept if either goes over the budget.
+ *
+ * @regex: The regex, whose search and reverse DFAs are set.
+ * @reverse: The NFA of the reversed regex, with the classes of @regex.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short search_build(Regex *regex, Regex *reverse, RegexOptions *options)
+{
+    RegexOptions dense;
+    short status;
+
+    /*  they are small next to the DFA, and scanned with a tight loop  */
+    dense = *options;
+    dense.dfa_format = REGEX_DFA_DENSE;
+    status = dfa_build(regex, &dense, 1, &regex->search);
+    if (status == REGEX_SUCCESS)
+    {
+        status = dfa_build(reverse, &dense, 0, &regex->reverse);
+    }
+
+    if (status == STATUS_OVER_BUDGET)
+    {
+        free(regex->search.table);
+        free(regex->reverse.table);
+        regex->search.table = 0;
+        regex->reverse.table = 0;
+        status = REGEX_SUCCESS;
+    }
+    return status;
+}
+
+/*
+ * Run a whole subset construction and store its result.
+ *
+ * @regex: The regex whose NFA to convert.
+ * @search: Bool. Build a search DFA, see builder_search_next.
+ * @dfa: The DFA to populate.
+ * @return: REGEX_SUCCESS, REGEX_ERR_MEMORY or STATUS_OVER_BUDGET.
+ */
+static short dfa_build(Regex *regex, RegexOptions *options, int search,
+                       Dfa *dfa)
+{
+    DfaBuilder builder;
+    short status;
+
+    status = builder_init(&builder, regex, options->max_dfa_states,
+                          options->max_dfa_bytes, search);
+    if (status == REGEX_SUCCESS)
+    {
+        status = builder_run(&builder);
+    }
+    if (status == REGEX_SUCCESS)
+    {
+        status = dfa_encode(&builder, options, dfa);
+    }
+    builder_free(&builder);
+    return status;
+}
+
+/*
+ * Follow one transition of a dense DFA.
+ *
+ * @state: Offset of the state.
+ * @class_idx: Class of the byte to step on.
+ * @return: Offset of the next state.
+ */
+static unsigned int dense_next(const Dfa *dfa, unsigned int state,
+                               int class_idx)
+{
+    if (dfa->width == 2)
+    {
+        return ((const unsigned short *) dfa->table)[state + class_idx];
+    }
+    return ((const unsigned int *) dfa->table)[state + class_idx];
+}
+
+/*
+ * Find the leftmost-longest match at or after a position with the search
+ * and reverse DFAs of a regex, which must have been built.
+ *
+ * @str: The string searched.
+ * @len: Length of @str.
+ * @from: Where the search starts.
+ * @start, @end: Set to the span of the match.
+ * @limiter: Limits on the forward pass. The reverse pass goes back over no
+ *   more than it did.
+ * @return: 1 if there is a match, 0 if not or if a limit was hit.
+ */
+static int search_find(const Regex *regex, const unsigned char *str,
+                       size_t len, size_t from, size_t *start, size_t *end,
+                       Limiter *limiter)
+{
+    unsigned int state;
+    size_t chunk_end;
+    size_t pos;
+    int found;
+
+    /*  the match ends where the search DFA last accepts  */
+    found = 0;
+    state = regex->search.start;
+    if (state >= regex->search.accept_start)
+    {
+        found = 1;
+        *end = from;
+    }
+    pos = from;
+    while (pos < len && state != 0)
+    {
+        chunk_end = limiter_next(limiter, pos, len);
+        if (limiter->hit)
+        {
+            return 0;
+        }
+        for (; pos < chunk_end && state != 0; pos++)
+        {
+            state = dense_next(&regex->search, state,
+                               regex->classes[str[pos]]);
+            if (state >= regex->search.accept_start)
+            {
+                found = 1;
+                *end = pos + 1;
+            }
+        }
+    }
+    if (!found)
+    {
+        return 0;
+    }
+
+    /*  and starts where the reverse DFA, run back from there, last accepts  */
+    *start = *end;
+    state = regex->reverse.start;
+    for (pos = *end; pos > from && state != 0; pos--)
+    {
+        state = dense_next(&regex->reverse, state,
+                           regex->classes[str[pos - 1]]);
+        if (state >= regex->reverse.accept_start)
+        {
+            *start = pos - 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Find the next place some literal bytes occur in a string.
+ *
+ * @literal: The bytes looked for.
+ * @literal_len: Length of @literal, at least 1.
+ * @str: The string searched.
+ * @len: Length of @str.
+ * @from: Where the search starts.
+ * @return: Where the literal starts, @len if it doesn't occur.
+ */
+static size_t literal_find(const unsigned char *literal, size_t literal_len,
+                           const unsigned char *str, size_t len, size_t from)
+{
+    const unsigned char *found;
+    size_t last;
+
+    if (len < literal_len)
+    {
+        return len;
+    }
+
+    /*  look for the first byte, then check the rest  */
+    last = len - literal_len;
+    while (from <= last)
+    {
+        found = memchr(str + from, literal[0], last - from + 1);
+        if (found == 0)
+        {
+            break;
+        }
+        from = found - str;
+        if (memcmp(found, literal, literal_len) == 0)
+        {
+            return from;
+        }
+        from++;
+    }
+    return len;
+}
+
+/*
+ * Find where the first match to end at or after a position ends, with the
+ * search DFA of a regex, which must have been built. Until a match ends the
+ * DFA never stops starting matches, so it never dies.
+ *
+ * @str: The string searched.
+ * @len: Length of @str.
+ * @from: Where the search starts.
+ * @end: Set to the end of the match.
+ * @limiter: Limits on the search.
+ * @return: 1 if there is a match, 0 if not or if a limit was hit.
+ */
+static int search_earliest(const Regex *regex, const unsigned char *str,
+                           size_t len, size_t from, size_t *end,
+                           Limiter *limiter)
+{
+    const Dfa *dfa;
+    const unsigned char *found;
+    unsigned int state;
+    size_t chunk_end;
+    size_t pos;
+
+    dfa = &regex->search;
+    state = dfa->start;
+    if (state >= dfa->accept_start)
+    {
+        *end = from;
+        return 1;
+    }
+    pos = from;
+    while (pos < len)
+    {
+        chunk_end = limiter_next(limiter, pos, len);
+        if (limiter->hit)
+        {
+            return 0;
+        }
+        for (; pos < chunk_end; pos++)
+        {
+            /*  back at the start, nothing is under way, so skip ahead  */
+            if (state == dfa->start && regex->first_byte >= 0)
+            {
+                found = memchr(str + pos, regex->first_byte,
+                               chunk_end - pos);
+                if (found == 0)
+                {
+                    pos = chunk_end;
+                    break;
+                }
+                pos = found - str;
+            }
+            state = dense_next(dfa, state, regex->classes[str[pos]]);
+            if (state >= dfa->accept_start)
+            {
+                *end = pos + 1;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set up the pool of caches of a regex. Caches of a lazy DFA are limited by
+ * the same budget as the DFA was.
+ *
+ * @regex: The regex, otherwise compiled.
+ * @options: Options the regex is compiled with.
+ * @builder: The subset construction of the regex's DFA, which went over
+ *   budget if the regex is lazy.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short pool_init(Regex *regex, RegexOptions *options,
+                       DfaBuilder *builder)
+{
+    regex->caches = malloc(sizeof(RegexPool));
+    if (regex->caches == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    if (pthread_mutex_init(&regex->caches->lock, 0) != 0)
+    {
+        free(regex->caches);
+        regex->caches = 0;
+        return REGEX_ERR_MEMORY;
+    }
+    regex->caches->free = 0;
+    regex->caches->max_states = options->max_dfa_states;
+    regex->caches->max_memory = options->max_dfa_bytes;
+    regex->caches->shared = 0;
+    regex->caches->stats = 0;
+    if (options->stats)
+    {
+        regex->caches->stats = calloc(STATS_SHARDS * STATS_STRIDE,
+                                      sizeof(unsigned long));
+        if (regex->caches->stats == 0)
+        {
+            return REGEX_ERR_MEMORY;
+        }
+    }
+    if (regex->dfa.format == REGEX_DFA_LAZY && options->shared_cache)
+    {
+        return shared_init(regex, options, builder);
+    }
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Set up the shared states of a lazy regex, with the dead and start states.
+ * Half the budget goes to the states' transitions and half to their sets.
+ *
+ * @regex: The regex, with its pool.
+ * @options: Options the regex is compiled with.
+ * @builder: The subset construction of the regex's DFA.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short shared_init(Regex *regex, RegexOptions *options,
+                         DfaBuilder *builder)
+{
+    SharedDfa *shared;
+    unsigned long memory;
+    unsigned long cost;
+    long capacity;
+
+    shared = calloc(1, sizeof(SharedDfa));
+    if (shared == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    regex->caches->shared = shared;
+
+    memory = options->max_dfa_bytes > 0 ? options->max_dfa_bytes :
+             REGEX_DFA_BUDGET;
+    cost = builder->stride * sizeof(int) + sizeof(long) + 3 * sizeof(int) + 1;
+    capacity = (long) (memory / 2 / cost);
+    if (options->max_dfa_states > 0 && capacity > options->max_dfa_states)
+    {
+        capacity = options->max_dfa_states;
+    }
+    if (capacity > INT_MAX / 2 / builder->stride)
+    {
+        capacity = INT_MAX / 2 / builder->stride;
+    }
+    if (capacity < BUILDER_MIN_STATES)
+    {
+        capacity = BUILDER_MIN_STATES;
+    }
+    shared->labels = builder->labels;
+    shared->stride = builder->stride;
+    shared->capacity = (int) capacity;
+    shared->sets_size = (long) (memory / 2 / sizeof(int));
+    if (shared->sets_size < builder->nfa.num_nodes)
+    {
+        shared->sets_size = builder->nfa.num_nodes;
+    }
+    shared->hash_size = 64;
+    while (shared->hash_size < 2 * shared->capacity)
+    {
+        shared->hash_size *= 2;
+    }
+
+    /*  zeroed memory is only touched as states are added  */
+    shared->trans = calloc((size_t) shared->capacity * shared->stride,
+                           sizeof(int));
+    shared->accepts = calloc(shared->capacity, 1);
+    shared->sets = malloc(shared->sets_size * sizeof(int));
+    shared->set_offset = malloc(shared->capacity * sizeof(long));
+    shared->set_len = malloc(shared->capacity * sizeof(int));
+    shared->hash = calloc(shared->hash_size, sizeof(int));
+    if (shared->trans == 0 || shared->accepts == 0 || shared->sets == 0 ||
+        shared->set_offset == 0 || shared->set_len == 0 || shared->hash == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+
+    /*  the dead state is 0, like everywhere else  */
+    shared_intern(shared, 0, 0);
+    shared->start = shared_intern(shared,
+                                  &builder->pool[builder->set_offset[
+                                      builder->start]],
+                                  builder->set_len[builder->start]);
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Release the shared states of a lazy regex.
+ */
+static void shared_free(SharedDfa *shared)
+{
+    free((void *) shared->trans);
+    free(shared->accepts);
+    free(shared->sets);
+    free(shared->set_offset);
+    free(shared->set_len);
+    free((void *) shared->hash);
+    free(shared);
+}
+
+/*
+ * Find the shared state of a set of NFA nodes, adding it if it is new.
+ * Safe to call from several threads at once.
+ *
+ * @set: The sorted set of NFA nodes.
+ * @len: Number of nodes in @set.
+ * @return: Id of the state, or BUILDER_FULL if it is new but there is no
+ *   room left.
+ */
+static int shared_intern(SharedDfa *shared, int *set, int len)
+{
+    unsigned long hash;
+    long offset;
+    int entry;
+    int other;
+    int state;
+    int slot;
+    int idx;
+
+    hash = 2166136261UL;
+    for (idx = 0; idx < len; idx++)
+    {
+        hash = (hash ^ (unsigned long) set[idx]) * 16777619UL;
+    }
+
+    state = -1;
+    slot = (int) (hash & (shared->hash_size - 1));
+    for (;;)
+    {
+        entry = shared->hash[slot];
+        if (entry == 0)
+        {
+            if (state < 0)
+            {
+                /*  write out a copy of the state before publishing it  */
+                if (shared->num_states >= shared->capacity ||
+                    shared->sets_len + len > shared->sets_size)
+                {
+                    return BUILDER_FULL;
+                }
+                state = __sync_fetch_and_add(&shared->num_states, 1);
+                offset = __sync_fetch_and_add(&shared->sets_len, (long) len);
+                if (state >= shared->capacity ||
+                    offset + len > shared->sets_size)
+                {
+                    return BUILDER_FULL;
+                }
+                if (len > 0)
+                {
+                    memcpy(&shared->sets[offset], set, len * sizeof(int));
+                }
+                shared->set_offset[state] = offset;
+                shared->set_len[state] = len;
+                for (idx = 0; idx < len; idx++)
+                {
+                    if (shared->labels[set[idx]].type == NFA_MATCH)
+                    {
+                        shared->accepts[state] = 1;
+                    }
+                }
+            }
+            entry = __sync_val_compare_and_swap(&shared->hash[slot], 0,
+                                                state + 1);
+            if (entry == 0)
+            {
+                return state;
+            }
+        }
+
+        /*  make sure the state in the slot is seen whole  */
+        __sync_synchronize();
+        other = entry - 1;
+        if (shared->set_len[other] == len &&
+            memcmp(&shared->sets[shared->set_offset[other]], set,
+                   len * sizeof(int)) == 0)
+        {
+            return other;
+        }
+        slot = (slot + 1) & (shared->hash_size - 1);
+    }
+}
+
+/*
+ * Compute one transition of a shared state, like builder_step.
+ *
+ * @scratch: A thread's own builder, whose scratch space is used.
+ * @state: Id of the state to step.
+ * @class_idx: Class of the byte to step on.
+ * @return: Id of the next state, or BUILDER_FULL.
+ */
+static int shared_step(SharedDfa *shared, DfaBuilder *scratch, int state,
+                       int class_idx)
+{
+    NfaLabel *label;
+    int *set;
+    int num_seeds;
+    int byte;
+    int next;
+    int idx;
+
+    /*  make sure the state is seen whole  */
+    __sync_synchronize();
+    scratch->misses++;
+    byte = scratch->representative[class_idx];
+    set = &shared->sets[shared->set_offset[state]];
+    num_seeds = 0;
+    for (idx = 0; idx < shared->set_len[state]; idx++)
+    {
+        label = &shared->labels[set[idx]];
+        if (label->type == NFA_BYTES && BYTES_HAS(label->bytes, byte))
+        {
+            scratch->seeds[num_seeds++] =
+                scratch->nfa.nodes[set[idx]].edges_out->adj_nodes[0]->id;
+        }
+    }
+
+    num_seeds = builder_closure(scratch, scratch->seeds, num_seeds);
+    next = shared_intern(shared, scratch->seeds, num_seeds);
+    if (next >= 0)
+    {
+        __sync_val_compare_and_swap(
+            &shared->trans[state * shared->stride + class_idx], 0, next + 1);
+    }
+    return next;
+}
+
+/*
+ * Run a shared lazy DFA over some bytes, building the states it needs on the
+ * way. Stops early if there is no room left for a state.
+ *
+ * @scratch: A thread's own builder, whose scratch space is used.
+ * @state: Id of the state to start from, set to the state reached.
+ * @cursor: The first byte to run over.
+ * @end: Just past the last byte to run over.
+ * @return: The byte it stopped at, @end unless the states are full or the
+ *   dead state was reached.
+ */
+static const unsigned char *shared_scan(SharedDfa *shared, DfaBuilder *scratch,
+                                        int *state,
+                                        const unsigned char *cursor,
+                                        const unsigned char *end)
+{
+    int current;
+    int next;
+    int class_idx;
+
+    current = *state;
+    while (current != 0 && cursor < end)
+    {
+        class_idx = scratch->classes[*cursor];
+        next = shared->trans[current * shared->stride + class_idx] - 1;
+        if (next == BUILDER_UNKNOWN)
+        {
+            next = shared_step(shared, scratch, current, class_idx);
+            if (next < 0)
+            {
+                break;
+            }
+        }
+        current = next;
+        cursor++;
+    }
+
+    *state = current;
+    return cursor;
+}
+
+/*
+ * Carry a match on in a thread's own cache once the shared states are full.
+ *
+ * @builder: The thread's own cache.
+ * @state: Id of the shared state the match is in.
+ * @return: Id of the same state in @builder.
+ */
+static int shared_leave(SharedDfa *shared, DfaBuilder *builder, int state)
+{
+    int *set;
+    int len;
+    int next;
+
+    set = &shared->sets[shared->set_offset[state]];
+    len = shared->set_len[state];
+    next = builder_intern(builder, set, len);
+    if (next < 0)
+    {
+        builder_clear(builder);
+        next = builder_intern(builder, set, len);
+    }
+
+    /*  the minimum states always fit, so this is unreachable  */
+    return next < 0 ? 0 : next;
+}
+
+/*
+ * Run a lazy DFA over some bytes, building the states it needs on the way.
+ * When the cache is full it is cleared and matching carries on from the
+ * current state, so memory stays bounded whatever the input.
+ *
+ * @state: Id of the state to start from.
+ * @cursor: The first byte to run over.
+ * @end: Just past the last byte to run over.
+ * @return: Id of the state reached, or 0 if the dead state was reached.
+ */
+static int lazy_scan(DfaBuilder *builder, int state,
+                     const unsigned char *cursor, const unsigned char *end)
+{
+    int next;
+    int len;
+    int class_idx;
+
+    while (state != 0 && cursor < end)
+    {
+        class_idx = builder->classes[*cursor];
+        next = builder->trans[state * builder->stride + class_idx];
+        if (next == BUILDER_UNKNOWN)
+        {
+            next = builder_step(builder, state, class_idx);
+        }
+        if (next < 0)
+        {
+            /*  keep the current state's set across the clear  */
+            len = builder->set_len[state];
+            memcpy(builder->saved, &builder->pool[builder->set_offset[state]],
+                   len * sizeof(int));
+            builder_clear(builder);
+            state = builder_intern(builder, builder->saved, len);
+            next = state < 0 ? state : builder_step(builder, state, class_idx);
+            if (next < 0)
+            {
+                /*  the minimum states always fit, so this is unreachable  */
+                return 0;
+            }
+        }
+        state = next;
+        cursor++;
+    }
+
+    return state;
+}
+
+/*
+ * Run a DFA stored as a table over some bytes.
+ *
+ * @dfa: The DFA, in any format but REGEX_DFA_LAZY.
+ * @classes: Map of bytes to their class.
+ * @state: The state to start from.
+ * @cursor: The first byte to run over.
+ * @end: Just past the last byte to run over.
+ * @return: The state reached, or 0 if the dead state was reached.
+ */
+static unsigned int dfa_scan(const Dfa *dfa, const unsigned char *classes,
+                             unsigned int state, const unsigned char *cursor,
+                             const unsigned char *end)
+{
+    /*  the dead state is 0, so stop as soon as it is reached  */
+    if (dfa->format == REGEX_DFA_SPARSE)
+    {
+        const unsigned char *table = dfa->table;
+        const unsigned char *record;
+        int idx;
+
+        while (state != 0 && cursor < end)
+        {
+            /*  the last range always ends at 255, so this scan stops  */
+            record = table + state;
+            for (idx = 0; *cursor > record[1 + idx]; idx++)
+            {
+            }
+            state = ((const unsigned int *)
+                     (record + SPARSE_ENDS_SIZE(record[0] + 1)))[idx];
+            cursor++;
+        }
+    }
+    else if (dfa->format == REGEX_DFA_HYBRID)
+    {
+        const unsigned char *table = dfa->table;
+        const unsigned char *record;
+        const unsigned int *next;
+        int idx;
+
+        while (state != 0 && cursor < end)
+        {
+            record = table + (state & ~HYBRID_KIND_MASK);
+            switch (state & HYBRID_KIND_MASK)
+            {
+            case HYBRID_SINGLE:
+                next = (const unsigned int *) (record + 4);
+                if (*cursor >= record[0] && *cursor <= record[1])
+                {
+                    state = next[0];
+                }
+                else
+                {
+                    state = next[1];
+                }
+                break;
+            case HYBRID_RANGES:
+                for (idx = 0; *cursor > record[1 + idx]; idx++)
+                {
+                }
+                state = ((const unsigned int *)
+                         (record + SPARSE_ENDS_SIZE(record[0] + 1)))[idx];
+                break;
+            default:
+                state = ((const unsigned int *) record)[classes[*cursor]];
+                break;
+            }
+            cursor++;
+        }
+    }
+    else if (dfa->width == 2)
+    {
+        const unsigned short *table = dfa->table;
+
+        while (state != 0 && cursor < end)
+        {
+            state = table[state + classes[*cursor++]];
+        }
+    }
+    else
+    {
+        const unsigned int *table = dfa->table;
+
+        while (state != 0 && cursor < end)
+        {
+            state = table[state + classes[*cursor++]];
+        }
+    }
+
+    return state;
+}
+
+/*
+ * Read a monotonic clock.
+ *
+ * @return: The time in milliseconds since some fixed point.
+ */
+static unsigned long clock_millis(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000UL +
+           (unsigned long) now.tv_nsec / 1000000UL;
+}
+
+/*
+ * Start checking some limits, and their clock.
+ *
+ * @limits: The limits, or null for none.
+ * @begin: Offset the work starts at.
+ */
+static void limiter_init(Limiter *limiter, RegexLimits *limits, size_t begin)
+{
+    limiter->limits = limits;
+    limiter->begin = begin;
+    limiter->started = 0;
+    limiter->interval = REGEX_CHECK_INTERVAL;
+    limiter->hit = 0;
+    if (limits != 0)
+    {
+        if (limits->check_interval > 0)
+        {
+            limiter->interval = limits->check_interval;
+        }
+        if (limits->max_millis > 0)
+        {
+            limiter->started = clock_millis();
+        }
+    }
+}
+
+/*
+ * Check the limits before the next chunk of the input is run over. Chunks
+ * end at the next check and at the byte limit, so the loops running over
+ * a chunk never test the limits. Without limits the chunk is the rest of
+ * the input.
+ *
+ * @pos: Offset the chunk starts at.
+ * @end: Offset the input ends at, past @pos.
+ * @return: Offset the chunk ends at, at most @end, or @pos with
+ *   @limiter->hit set if a limit was hit.
+ */
+static size_t limiter_next(Limiter *limiter, size_t pos, size_t end)
+{
+    RegexLimits *limits;
+
+    limits = limiter->limits;
+    if (limits == 0)
+    {
+        return end;
+    }
+    if ((limits->max_bytes > 0 &&
+         (unsigned long) (pos - limiter->begin) >= limits->max_bytes) ||
+        (limits->cancel != 0 && *limits->cancel != 0) ||
+        (limits->max_millis > 0 &&
+         clock_millis() - limiter->started >= limits->max_millis))
+    {
+        limiter->hit = 1;
+        return pos;
+    }
+    if (end - pos > limiter->interval)
+    {
+        end = pos + limiter->interval;
+    }
+    if (limits->max_bytes > 0 &&
+        (unsigned long) (end - limiter->begin) > limits->max_bytes)
+    {
+        end = limiter->begin + limits->max_bytes;
+    }
+    return end;
+}
+
+/*
+ * Set a runner up at the start state of a regex.
+ *
+ * @regex: The regex to run.
+ * @cache: Cache for the states of a lazy DFA. May be null otherwise.
+ * @return: REGEX_SUCCESS, or REGEX_ABORTED if a lazy DFA has no cache.
+ */
+static short runner_init(Runner *runner, const Regex *regex, RegexCache *cache)
+{
+    runner->regex = regex;
+    runner->lazy = 0;
+    runner->shared = 0;
+    if (regex->dfa.format == REGEX_DFA_LAZY)
+    {
+        if (cache == 0 || cache->states == 0)
+        {
+            return REGEX_ABORTED;
+        }
+        runner->lazy = cache->states;
+        runner->shared = regex->caches->shared;
+    }
+    runner_reset(runner);
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Put a runner back at the start state.
+ */
+static void runner_reset(Runner *runner)
+{
+    if (runner->shared != 0)
+    {
+        runner->state = (unsigned long) runner->shared->start;
+    }
+    else if (runner->lazy != 0)
+    {
+        runner->state = (unsigned long) runner->lazy->start;
+    }
+    else
+    {
+        runner->state = runner->regex->dfa.start;
+    }
+}
+
+/*
+ * Run a runner over some bytes, stopping early if the dead state is reached.
+ *
+ * @cursor: The first byte to run over.
+ * @end: Just past the last byte to run over.
+ */
+static void runner_scan(Runner *runner, const unsigned char *cursor,
+                        const unsigned char *end)
+{
+    int current;
+
+    if (runner->shared != 0)
+    {
+        current = (int) runner->state;
+        cursor = shared_scan(runner->shared, runner->lazy, &current, cursor,
+                             end);
+        runner->state = (unsigned long) current;
+        if (cursor == end || current == 0)
+        {
+            return;
+        }
+
+        /*  the shared states are full, carry on in our own  */
+        runner->state = (unsigned long) shared_leave(runner->shared,
+                                                     runner->lazy, current);
+        runner->shared = 0;
+    }
+
+    if (runner->lazy != 0)
+    {
+        runner->state = (unsigned long) lazy_scan(runner->lazy,
+                                                  (int) runner->state, cursor,
+                                                  end);
+    }
+    else
+    {
+        runner->state = dfa_scan(&runner->regex->dfa, runner->regex->classes,
+                                 (unsigned int) runner->state, cursor, end);
+    }
+}
+
+/*
+ * Determine if the state of a runner accepts.
+ *
+ * @return: Bool. 1 if it accepts, 0 if not.
+ */
+static int runner_accepts(Runner *runner)
+{
+    if (runner->shared != 0)
+    {
+        /*  make sure the state is seen whole  */
+        __sync_synchronize();
+        return runner->shared->accepts[runner->state];
+    }
+    if (runner->lazy != 0)
+    {
+        return builder_accepts(runner->lazy, (int) runner->state);
+    }
+    return runner->state >= runner->regex->dfa.accept_start;
+}
+
+/*
+ * Set up the scratch space to find the groups of matches of a regex.
+ *
+ * @regex: The regex.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY. @pike needs to be freed
+ *   either way.
+ */
+static short pike_init(Pike *pike, const Regex *regex)
+{
+    size_t num_nodes;
+    size_t stack_size;
+
+    num_nodes = (size_t) regex->nfa.num_nodes;
+    stack_size = 2 * num_nodes + regex->nfa.num_edges + 1;
+    memset(pike, 0, sizeof(Pike));
+    pike->nfa = regex->nfa;
+    pike->labels = regex->nfa_labels;
+    pike->nfa_start = regex->nfa_start;
+    pike->num_slots = 2 * (regex->num_groups + 1);
+    pike->threads[0] = malloc(num_nodes * sizeof(int));
+    pike->threads[1] = malloc(num_nodes * sizeof(int));
+    pike->slots[0] = malloc(num_nodes * pike->num_slots * sizeof(size_t));
+    pike->slots[1] = malloc(num_nodes * pike->num_slots * sizeof(size_t));
+    pike->marks = calloc(num_nodes, sizeof(int));
+    pike->stack = malloc(stack_size * sizeof(int));
+    pike->saved = malloc(stack_size * sizeof(size_t));
+    pike->current = malloc(pike->num_slots * sizeof(size_t));
+    if (pike->threads[0] == 0 || pike->threads[1] == 0 ||
+        pike->slots[0] == 0 || pike->slots[1] == 0 || pike->marks == 0 ||
+        pike->stack == 0 || pike->saved == 0 || pike->current == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Release the scratch space to find groups.
+ */
+static void pike_free(Pike *pike)
+{
+    free(pike->threads[0]);
+    free(pike->threads[1]);
+    free(pike->slots[0]);
+    free(pike->slots[1]);
+    free(pike->marks);
+    free(pike->stack);
+    free(pike->saved);
+    free(pike->current);
+}
+
+/*
+ * Add a thread to a list, following epsilon edges in order of priority.
+ * Nodes already in the list were reached by a thread of higher priority, so
+ * they are skipped.
+ *
+ * @list: Index of the list to add to.
+ * @node_id: The node the thread is at.
+ * @pos: Position in the string, recorded by NFA_CAPTURE nodes.
+ */
+static void pike_add(Pike *pike, int list, int node_id, size_t pos)
+{
+    Bucket *bucket;
+    NfaLabel *label;
+    int depth;
+    int idx;
+
+    depth = 0;
+    pike->stack[depth++] = node_id;
+    while (depth > 0)
+    {
+        node_id = pike->stack[--depth];
+        if (node_id < 0)
+        {
+            /*  done with everything reached past a capture  */
+            pike->current[-1 - node_id] = pike->saved[depth];
+            continue;
+        }
+        if (pike->marks[node_id] == pike->mark)
+        {
+            continue;
+        }
+        pike->marks[node_id] = pike->mark;
+
+        label = &pike->labels[node_id];
+        if (label->type == NFA_BYTES || label->type == NFA_MATCH)
+        {
+            idx = pike->num_threads[list]++;
+            pike->threads[list][idx] = node_id;
+            memcpy(&pike->slots[list][(size_t) idx * pike->num_slots],
+                   pike->current, pike->num_slots * sizeof(size_t));
+            continue;
+        }
+        if (label->type == NFA_CAPTURE)
+        {
+            pike->saved[depth] = pike->current[label->capture];
+            pike->stack[depth++] = -1 - label->capture;
+            pike->current[label->capture] = pos;
+        }
+
+        /*  every node has one bucket, push its edges so the first pops
+            first  */
+        bucket = pike->nfa.nodes[node_id].edges_out;
+        for (idx = BUCKET_SIZE - 1; bucket != 0 && idx >= 0; idx--)
+        {
+            if (bucket->adj_nodes[idx] != 0)
+            {
+                pike->stack[depth++] = bucket->adj_nodes[idx]->id;
+            }
+        }
+    }
+}
+
+/*
+ * Start a new list of threads.
+ *
+ * @list: Index of the list.
+ */
+static void pike_clear(Pike *pike, int list)
+{
+    if (pike->mark == INT_MAX)
+    {
+        memset(pike->marks, 0, pike->nfa.num_nodes * sizeof(int));
+        pike->mark = 0;
+    }
+    pike->mark++;
+    pike->num_threads[list] = 0;
+}
+
+/*
+ * Find the groups of a match, by running the NFA over it. Of the ways the NFA
+ * can match exactly these bytes, the one of highest priority is taken, ie
+ * the one a backtracking engine would try first.
+ *
+ * @str: The string the match is in.
+ * @start: Offset of the match in @str.
+ * @end: Offset just past the match in @str.
+ * @slots: Set to the start and end of the match and of each group, NO_SLOT
+ *   for groups that took no part in it.
+ * @num_slots: Number of slots to set.
+ * @return: Bool. 1 if the NFA matches, which it always should.
+ */
+static int pike_run(Pike *pike, const unsigned char *str, size_t start,
+                    size_t end, size_t *slots, int num_slots)
+{
+    NfaLabel *label;
+    size_t pos;
+    int list;
+    int node_id;
+    int idx;
+
+    for (idx = 0; idx < pike->num_slots; idx++)
+    {
+        pike->current[idx] = NO_SLOT;
+    }
+    pike->current[0] = start;
+    list = 0;
+    pike_clear(pike, list);
+    pike_add(pike, list, pike->nfa_start, start);
+
+    for (pos = start; pike->num_threads[list] > 0; pos++)
+    {
+        if (pos == end)
+        {
+            /*  the first thread to match has the highest priority  */
+            for (idx = 0; idx < pike->num_threads[list]; idx++)
+            {
+                if (pike->labels[pike->threads[list][idx]].type == NFA_MATCH)
+                {
+                    memcpy(slots,
+                           &pike->slots[list][(size_t) idx * pike->num_slots],
+                           num_slots * sizeof(size_t));
+                    slots[1] = end;
+                    return 1;
+                }
+            }
+            return 0;
+        }
+
+        pike_clear(pike, 1 - list);
+        for (idx = 0; idx < pike->num_threads[list]; idx++)
+        {
+            node_id = pike->threads[list][idx];
+            label = &pike->labels[node_id];
+            if (label->type == NFA_BYTES && BYTES_HAS(label->bytes, str[pos]))
+            {
+                memcpy(pike->current,
+                       &pike->slots[list][(size_t) idx * pike->num_slots],
+                       pike->num_slots * sizeof(size_t));
+                pike_add(pike, 1 - list,
+                         pike->nfa.nodes[node_id].edges_out->adj_nodes[0]->id,
+                         pos + 1);
+            }
+        }
+        list = 1 - list;
+    }
+    return 0;
+}
+
+/*
+ * Find where the first match to end at or after a position ends, by running
+ * the NFA with a new thread started at every position.
+ *
+ * @str: The string searched.
+ * @len: Length of @str.
+ * @from: Where the search starts.
+ * @end: Set to the end of the match.
+ * @limiter: Limits on the search.
+ * @return: 1 if there is a match, 0 if not or if a limit was hit.
+ */
+static int pike_earliest(Pike *pike, const Regex *regex,
+                         const unsigned char *str, size_t len, size_t from,
+                         size_t *end, Limiter *limiter)
+{
+    const unsigned char *found;
+    size_t check_at;
+    size_t pos;
+    int list;
+    int node_id;
+    int idx;
+
+    for (idx = 0; idx < pike->num_slots; idx++)
+    {
+        pike->current[idx] = NO_SLOT;
+    }
+    list = 0;
+    pike_clear(pike, list);
+    check_at = from;
+    for (pos = from; ; pos++)
+    {
+        /*  no thread is under way, skip to where one can start  */
+        if (pike->num_threads[list] == 0 && pos > from && pos < len &&
+            regex->first_byte >= 0)
+        {
+            found = memchr(str + pos, regex->first_byte, len - pos);
+            if (found == 0)
+            {
+                return 0;
+            }
+            pos = found - str;
+        }
+
+        /*  the new thread has the lowest priority, it started last  */
+        pike_add(pike, list, pike->nfa_start, pos);
+        for (idx = 0; idx < pike->num_threads[list]; idx++)
+        {
+            if (pike->labels[pike->threads[list][idx]].type == NFA_MATCH)
+            {
+                *end = pos;
+                return 1;
+            }
+        }
+        if (pos == len)
+        {
+            return 0;
+        }
+
+        /*  check the limits once a chunk  */
+        if (pos >= check_at)
+        {
+            check_at = limiter_next(limiter, pos, len);
+            if (limiter->hit)
+            {
+                return 0;
+            }
+        }
+        pike_clear(pike, 1 - list);
+        for (idx = 0; idx < pike->num_threads[list]; idx++)
+        {
+            node_id = pike->threads[list][idx];
+            if (pike->labels[node_id].type == NFA_BYTES &&
+                BYTES_HAS(pike->labels[node_id].bytes, str[pos]))
+            {
+                pike_add(pike, 1 - list,
+                         pike->nfa.nodes[node_id].edges_out->adj_nodes[0]->id,
+                         pos + 1);
+            }
+        }
+        list = 1 - list;
+    }
+}
+
+/*
+ * Find the leftmost-first match at or after a position, by running the NFA
+ * with a new thread started at every position until one matches. Threads are
+ * kept in order of priority, so once one matches, those after it are dropped
+ * and the match is only replaced by a thread before it matching later.
+ *
+ * @str: The string searched.
+ * @len: Length of @str.
+ * @from: Where the search starts.
+ * @start, @end: Set to the span of the match.
+ * @limiter: Limits on the search.
+ * @return: 1 if there is a match, 0 if not or if a limit was hit.
+ */
+static int pike_first(Pike *pike, const Regex *regex, const unsigned char *str,
+                      size_t len, size_t from, size_t *start, size_t *end,
+                      Limiter *limiter)
+{
+    const unsigned char *found;
+    size_t check_at;
+    size_t pos;
+    int matched;
+    int list;
+    int node_id;
+    int idx;
+
+    for (idx = 0; idx < pike->num_slots; idx++)
+    {
+        pike->current[idx] = NO_SLOT;
+    }
+    matched = 0;
+    list = 0;
+    pike_clear(pike, list);
+    check_at = from;
+    for (pos = from; ; pos++)
+    {
+        if (!matched)
+        {
+            /*  no thread is under way, skip to where one can start  */
+            if (pike->num_threads[list] == 0 && pos > from && pos < len &&
+                regex->first_byte >= 0)
+            {
+                found = memchr(str + pos, regex->first_byte, len - pos);
+                if (found == 0)
+                {
+                    return 0;
+                }
+                pos = found - str;
+            }
+
+            /*  the first slot of a thread is where it started  */
+            pike->current[0] = pos;
+            pike_add(pike, list, pike->nfa_start, pos);
+        }
+
+        for (idx = 0; idx < pike->num_threads[list]; idx++)
+        {
+            if (pike->labels[pike->threads[list][idx]].type == NFA_MATCH)
+            {
+                matched = 1;
+                *start = pike->slots[list][(size_t) idx * pike->num_slots];
+                *end = pos;
+                pike->num_threads[list] = idx;
+                break;
+            }
+        }
+        if (pos == len || (matched && pike->num_threads[list] == 0))
+        {
+            return matched;
+        }
+
+        /*  check the limits once a chunk  */
+        if (pos >= check_at)
+        {
+            check_at = limiter_next(limiter, pos, len);
+            if (limiter->hit)
+            {
+                return 0;
+            }
+        }
+        pike_clear(pike, 1 - list);
+        for (idx = 0; idx < pike->num_threads[list]; idx++)
+        {
+            node_id = pike->threads[list][idx];
+            if (pike->labels[node_id].type == NFA_BYTES &&
+                BYTES_HAS(pike->labels[node_id].bytes, str[pos]))
+            {
+                memcpy(pike->current,
+                       &pike->slots[list][(size_t) idx * pike->num_slots],
+                       pike->num_slots * sizeof(size_t));
+                pike_add(pike, 1 - list,
+                         pike->nfa.nodes[node_id].edges_out->adj_nodes[0]->id,
+                         pos + 1);
+            }
+        }
+        list = 1 - list;
+    }
+}
+
+/*
+ * Give a cache the scratch space of the Pike VM, unless it has it already
+ * from an earlier search.
+ *
+ * @cache: The cache, of @regex.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short cache_pike(RegexCache *cache, const Regex *regex)
+{
+    if (cache->pike != 0)
+    {
+        return REGEX_SUCCESS;
+    }
+    cache->pike = malloc(sizeof(Pike));
+    if (cache->pike == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+    if (pike_init(cache->pike, regex) != REGEX_SUCCESS)
+    {
+        pike_free(cache->pike);
+        free(cache->pike);
+        cache->pike = 0;
+        return REGEX_ERR_MEMORY;
+    }
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Find the leftmost-longest match at or after a position, by running the NFA
+ * with a new thread started at every position until one matches. Threads are
+ * kept in the order they started, so of those reaching a node at once the one
+ * that started first is kept. Once one matches, threads that started after it
+ * are dropped, and the match is replaced by longer ones from the same start
+ * or by one from an earlier start.
+ *
+ * @str: The string searched.
+ * @len: Length of @str.
+ * @from: Where the search starts.
+ * @start, @end: Set to the span of the match.
+ * @limiter: Limits on the search.
+ * @return: 1 if there is a match, 0 if not or if a limit was hit.
+ */
+static int pike_longest(Pike *pike, const Regex *regex,
+                        const unsigned char *str, size_t len, size_t from,
+                        size_t *start, size_t *end, Limiter *limiter)
+{
+    const unsigned char *found;
+    size_t thread_start;
+    size_t check_at;
+    size_t pos;
+    int matched;
+    int list;
+    int node_id;
+    int kept;
+    int idx;
+
+    for (idx = 0; idx < pike->num_slots; idx++)
+    {
+        pike->current[idx] = NO_SLOT;
+    }
+    matched = 0;
+    list = 0;
+    pike_clear(pike, list);
+    check_at = from;
+    for (pos = from; ; pos++)
+    {
+        if (!matched)
+        {
+            /*  no thread is under way, skip to where one can start  */
+            if (pike->num_threads[list] == 0 && pos > from && pos < len &&
+                regex->first_byte >= 0)
+            {
+                found = memchr(str + pos, regex->first_byte, len - pos);
+                if (found == 0)
+                {
+                    return 0;
+                }
+                pos = found - str;
+            }
+
+            /*  the first slot of a thread is where it started  */
+            pike->current[0] = pos;
+            pike_add(pike, list, pike->nfa_start, pos);
+        }
+
+        for (idx = 0; idx < pike->num_threads[list]; idx++)
+        {
+            thread_start = pike->slots[list][(size_t) idx * pike->num_slots];
+            if (pike->labels[pike->threads[list][idx]].type == NFA_MATCH &&
+                (!matched || thread_start <= *start))
+            {
+                matched = 1;
+                *start = thread_start;
+                *end = pos;
+            }
+        }
+        if (matched)
+        {
+            /*  threads that started after the match can't beat it  */
+            kept = 0;
+            for (idx = 0; idx < pike->num_threads[list]; idx++)
+            {
+                if (pike->slots[list][(size_t) idx * pike->num_slots] <=
+                    *start)
+                {
+                    pike->threads[list][kept] = pike->threads[list][idx];
+                    memmove(&pike->slots[list][(size_t) kept *
+                                               pike->num_slots],
+                            &pike->slots[list][(size_t) idx *
+                                               pike->num_slots],
+                            pike->num_slots * sizeof(size_t));
+                    kept++;
+                }
+            }
+            pike->num_threads[list] = kept;
+        }
+        if (pos == len || (matched && pike->num_threads[list] == 0))
+        {
+            return matched;
+        }
+
+        /*  check the limits once a chunk  */
+        if (pos >= check_at)
+        {
+            check_at = limiter_next(limiter, pos, len);
+            if (limiter->hit)
+            {
+                return 0;
+            }
+        }
+        pike_clear(pike, 1 - list);
+        for (idx = 0; idx < pike->num_threads[list]; idx++)
+        {
+            node_id = pike->threads[list][idx];
+            if (pike->labels[node_id].type == NFA_BYTES &&
+                BYTES_HAS(pike->labels[node_id].bytes, str[pos]))
+            {
+                memcpy(pike->current,
+                       &pike->slots[list][(size_t) idx * pike->num_slots],
+                       pike->num_slots * sizeof(size_t));
+                pike_add(pike, 1 - list,
+                         pike->nfa.nodes[node_id].edges_out->adj_nodes[0]->id,
+                         pos + 1);
+            }
+        }
+        list = 1 - list;
+    }
+}
+
+/*
+ * Find every match of a regex in a string, as regex_find_next does.
+ *
+ * @str: The string.
+ * @len: Length of @str.
+ * @num_slots: Slots to keep per match, see pike_run. Groups are only found
+ *   if this is more than 2.
+ * @found: Set to the slots of every match, @num_slots each. Must be freed,
+ *   on success only.
+ * @num_found: Set to the number of matches.
+ * @limits: Limits on the whole search, or null for none.
+ * @return: REGEX_SUCCESS, REGEX_ERR_MEMORY, or REGEX_ABORTED if a limit was
+ *   hit.
+ */
+static short find_all(Regex *regex, const char *str, size_t len,
+                      int num_slots, size_t **found, size_t *num_found,
+                      RegexLimits *limits)
+{
+    RegexIter iter;
+    Pike pike;
+    size_t *slots;
+    size_t size;
+    size_t start;
+    size_t end;
+    void *grown;
+    short status;
+    short next;
+
+    status = regex_find_iter_limits(&iter, regex, str, len, limits);
+    if (status != REGEX_SUCCESS)
+    {
+        return status;
+    }
+    memset(&pike, 0, sizeof(Pike));
+    if (num_slots > 2)
+    {
+        status = pike_init(&pike, regex);
+    }
+
+    *found = 0;
+    *num_found = 0;
+    size = 0;
+    while (status == REGEX_SUCCESS)
+    {
+        next = regex_find_next(&iter, &start, &end);
+        if (next != REGEX_MATCH)
+        {
+            status = next == REGEX_ABORTED ? REGEX_ABORTED : REGEX_SUCCESS;
+            break;
+        }
+        if (*num_found == size)
+        {
+            size = size == 0 ? 16 : size * 2;
+            grown = realloc(*found, size * num_slots * sizeof(size_t));
+            if (grown == 0)
+            {
+                status = REGEX_ERR_MEMORY;
+                break;
+            }
+            *found = grown;
+        }
+
+        slots = &(*found)[*num_found * num_slots];
+        if (num_slots <= 2 ||
+            !pike_run(&pike, (const unsigned char *) str, start, end, slots,
+                      num_slots))
+        {
+            slots[0] = start;
+            slots[1] = end;
+        }
+        (*num_found)++;
+    }
+
+    pike_free(&pike);
+    regex_find_free(&iter);
+    if (status != REGEX_SUCCESS)
+    {
+        free(*found);
+    }
+    return status;
+}
+
+/*
+ * Read a reference to a group in a replacement: '$n', '${n}', or '$$' for a
+ * dollar sign.
+ *
+ * @cursor: Just past the '$'. Advanced past the reference if it is valid.
+ * @return: The number of the group, REF_DOLLAR or REF_INVALID.
+ */
+static int replacement_ref(const char **cursor)
+{
+    const char *text;
+    int group;
+
+    text = *cursor;
+    if (*text == '$')
+    {
+        *cursor = text + 1;
+        return REF_DOLLAR;
+    }
+    if (*text >= '0' && *text <= '9')
+    {
+        *cursor = text + 1;
+        return *text - '0';
+    }
+    if (*text != '{')
+    {
+        return REF_INVALID;
+    }
+
+    group = 0;
+    for (text++; *text >= '0' && *text <= '9'; text++)
+    {
+        group = group * 10 + (*text - '0');
+        if (group > MAX_GROUP_REF)
+        {
+            return REF_INVALID;
+        }
+    }
+    if (*text != '}' || text == *cursor + 1)
+    {
+        return REF_INVALID;
+    }
+    *cursor = text + 1;
+    return group;
+}
+
+/*
+ * Check the references to groups in a replacement.
+ *
+ * @replacement: The replacement.
+ * @num_groups: Number of groups of the regex.
+ * @return: The highest group referred to, or -1 if a reference is invalid
+ *   or refers to a group the regex doesn't have.
+ */
+static int replacement_check(const char *replacement, int num_groups)
+{
+    const char *cursor;
+    int max_group;
+    int group;
+
+    max_group = 0;
+    cursor = replacement;
+    while (*cursor != '\0')
+    {
+        if (*cursor++ != '$')
+        {
+            continue;
+        }
+        group = replacement_ref(&cursor);
+        if (group == REF_INVALID || group > num_groups)
+        {
+            return -1;
+        }
+        if (group > max_group)
+        {
+            max_group = group;
+        }
+    }
+    return max_group;
+}
+
+/*
+ * Expand the references to groups in a checked replacement.
+ *
+ * @out: Where to write the expansion, or null to only size it.
+ * @replacement: The replacement.
+ * @str: The string the match is in.
+ * @slots: The slots of the match, from pike_run.
+ * @return: The size of the expansion.
+ */
+static size_t replacement_expand(char *out, const char *replacement,
+                                 const char *str, const size_t *slots)
+{
+    const char *cursor;
+    size_t size;
+    size_t len;
+    int group;
+
+    size = 0;
+    cursor = replacement;
+    while (*cursor != '\0')
+    {
+        if (*cursor != '$')
+        {
+            if (out != 0)
+            {
+                out[size] = *cursor;
+            }
+            size++;
+            cursor++;
+            continue;
+        }
+
+        cursor++;
+        group = replacement_ref(&cursor);
+        if (group == REF_DOLLAR)
+        {
+            if (out != 0)
+            {
+                out[size] = '$';
+            }
+            size++;
+        }
+        else if (slots[2 * group] != NO_SLOT)
+        {
+            len = slots[2 * group + 1] - slots[2 * group];
+            if (out != 0)
+            {
+                memcpy(out + size, str + slots[2 * group], len);
+            }
+            size += len;
+        }
+    }
+    return size;
+}
+
+/*
+ * Get a buffer ready for the output of regex_replace_all or regex_split.
+ *
+ * @out: The caller's buffer, or null to allocate one.
+ * @out_len: Size of the caller's buffer. Set to @size if it's too small.
+ * @size: Size of the output.
+ * @return: REGEX_SUCCESS, REGEX_ERR_MEMORY or REGEX_ERR_SPACE.
+ */
+static short output_init(char **out, size_t *out_len, size_t size)
+{
+    if (*out == 0)
+    {
+        *out = malloc(size);
+        return *out == 0 ? REGEX_ERR_MEMORY : REGEX_SUCCESS;
+    }
+    if (*out_len < size)
+    {
+        *out_len = size;
+        return REGEX_ERR_SPACE;
+    }
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Pick the shard of some counters the calling thread adds to. C89 has no
+ * thread local storage, so the shard is picked from where the thread's stack
+ * is: threads' stacks are far apart, so they mostly land on different shards
+ * and rarely fight over a cache line.
+ *
+ * @num_shards: Number of shards.
+ * @return: The shard, below @num_shards.
+ */
+static int thread_shard(int num_shards)
+{
+    unsigned long here;
+
+    here = (unsigned long) &here;
+    return (int) (((here >> 12) * 2654435761UL >> 16) % num_shards);
+}
+
+/*
+ * Find the shard of a regex's counts for the calling thread.
+ *
+ * @regex: A regex keeping counts.
+ * @return: The NUM_STATS counts of the shard.
+ */
+static unsigned long *stats_shard(const Regex *regex)
+{
+    return &regex->caches->stats[thread_shard(STATS_SHARDS) * STATS_STRIDE];
+}
+
+/*
+ * Add to one of a regex's counts, if it keeps them.
+ *
+ * @stat: Which count, one of the STAT_ constants.
+ * @count: How much to add.
+ */
+static void stats_add(const Regex *regex, int stat, unsigned long count)
+{
+    if (regex->caches == 0 || regex->caches->stats == 0 || count == 0)
+    {
+        return;
+    }
+    __sync_fetch_and_add(&stats_shard(regex)[stat], count);
+}
+
+/*
+ * Count a call that matched or searched some bytes.
+ *
+ * @bytes: Bytes of input the call went over.
+ * @status: The result of the call.
+ */
+static void stats_call(const Regex *regex, size_t bytes, short status)
+{
+    unsigned long *shard;
+
+    if (regex->caches == 0 || regex->caches->stats == 0)
+    {
+        return;
+    }
+    shard = stats_shard(regex);
+    __sync_fetch_and_add(&shard[STAT_CALLS], 1UL);
+    __sync_fetch_and_add(&shard[STAT_BYTES], (unsigned long) bytes);
+    if (status == REGEX_MATCH)
+    {
+        __sync_fetch_and_add(&shard[STAT_MATCHES], 1UL);
+    }
+}
+
+/*
+ * Count the work a runner's lazy DFA did since some point.
+ *
+ * @misses, @clears: The cache's misses and clears at that point.
+ */
+static void stats_cache(const Regex *regex, Runner *runner,
+                        unsigned long misses, unsigned long clears)
+{
+    if (runner->lazy != 0)
+    {
+        stats_add(regex, STAT_CACHE_MISSES, runner->lazy->misses - misses);
+        stats_add(regex, STAT_CACHE_CLEARS, runner->lazy->clears - clears);
+    }
+}
+
+/*
+ * Count a call to regex_find_next.
+ *
+ * @bytes: Bytes of input the call went over.
+ * @status: The result of the call.
+ * @hits: Places the prefilter stopped at.
+ * @runner, @misses, @clears: As for stats_cache.
+ */
+static void find_stats(RegexIter *iter, size_t bytes, short status,
+                       unsigned long hits, Runner *runner,
+                       unsigned long misses, unsigned long clears)
+{
+    stats_call(&iter->regex, bytes, status);
+    stats_add(&iter->regex, STAT_PREFILTER_HITS, hits);
+    if (iter->regex.search.table == 0)
+    {
+        stats_add(&iter->regex, STAT_FALLBACKS, 1);
+    }
+    stats_cache(&iter->regex, runner, misses, clears);
+}
+
+/*
+ * Test if a regex matches a whole string, within some limits.
+ * Without limits the string is run through in one go. With limits it is run
+ * through in chunks of @limits->check_interval bytes, and the limits are
+ * checked between chunks by limiter_next, so the inner loops never test
+ * them.
+ * A null terminated string is run through in chunks too, its end found with
+ * memchr as it goes, so it is never read past where the DFA dies or a limit
+ * is hit.
+ *
+ * @cache: Cache for the states of a lazy DFA. May be null otherwise.
+ * @str: The string to match.
+ * @len: Length of @str, or LEN_UNKNOWN if it is null terminated.
+ * @limits: Limits on the work done, or null for none.
+ * @return: REGEX_MATCH, REGEX_NO_MATCH, or REGEX_ABORTED if a limit was hit
+ *   before the answer was known, or a lazy DFA has no cache.
+ */
+static short regex_exec(const Regex *regex, RegexCache *cache,
+                        const unsigned char *str, size_t len,
+                        RegexLimits *limits)
+{
+    Runner runner;
+    Limiter limiter;
+    const unsigned char *begin;
+    const unsigned char *end;
+    const unsigned char *chunk_end;
+    unsigned long misses;
+    unsigned long clears;
+    short status;
+
+    if (regex->literal_only > 0)
+    {
+        /*  strncmp stops at the end of a null terminated string  */
+        if (len == LEN_UNKNOWN)
+        {
+            status = strncmp((const char *) str, regex->text,
+                             regex->literal_only) == 0 &&
+                     str[regex->literal_only] == '\0' ?
+                     REGEX_MATCH : REGEX_NO_MATCH;
+        }
+        else
+        {
+            status = len == regex->literal_only &&
+                     memcmp(str, regex->text, len) == 0 ?
+                     REGEX_MATCH : REGEX_NO_MATCH;
+        }
+        stats_call(regex, status == REGEX_MATCH ? regex->literal_only : 0,
+                   status);
+        return status;
+    }
+
+    /*  with limits, the whole string mustn't be read just for the suffix  */
+    if (regex->literal_suffix && len == LEN_UNKNOWN && limits == 0)
+    {
+        len = strlen((const char *) str);
+    }
+
+    /*  a whole string can only match if it ends with the suffix  */
+    if (regex->literal_suffix && len != LEN_UNKNOWN &&
+        (len < (size_t) regex->literal_len ||
+         memcmp(str + len - regex->literal_len, regex->literal,
+                regex->literal_len) != 0))
+    {
+        stats_call(regex, 0, REGEX_NO_MATCH);
+        return REGEX_NO_MATCH;
+    }
+
+    begin = str;
+    end = len == LEN_UNKNOWN ? 0 : str + len;
+    limiter_init(&limiter, limits, 0);
+
+    if (runner_init(&runner, regex, cache) != REGEX_SUCCESS)
+    {
+        stats_call(regex, 0, REGEX_ABORTED);
+        return REGEX_ABORTED;
+    }
+    misses = runner.lazy != 0 ? runner.lazy->misses : 0;
+    clears = runner.lazy != 0 ? runner.lazy->clears : 0;
+    status = REGEX_NO_MATCH;
+    while ((end == 0 || str < end) && runner.state != 0)
+    {
+        chunk_end = end;
+        if (end == 0)
+        {
+            /*  look for the end of the string one chunk ahead  */
+            chunk_end = memchr(str, '\0', limiter.interval);
+            if (chunk_end == 0)
+            {
+                chunk_end = str + limiter.interval;
+            }
+            else if (chunk_end == str)
+            {
+                break;
+            }
+            else
+            {
+                end = chunk_end;
+            }
+        }
+        chunk_end = begin + limiter_next(&limiter, (size_t) (str - begin),
+                                         (size_t) (chunk_end - begin));
+        if (limiter.hit)
+        {
+            status = REGEX_ABORTED;
+            break;
+        }
+
+        runner_scan(&runner, str, chunk_end);
+        str = chunk_end;
+    }
+
+    if (status != REGEX_ABORTED && runner_accepts(&runner))
+    {
+        status = REGEX_MATCH;
+    }
+    stats_call(regex, str - begin, status);
+    stats_cache(regex, &runner, misses, clears);
+    return status;
+}
+
+/*
+ * Work on a batch of strings until every one has been taken.
+ * Lazy regexes use a cache from the regex's pool for the whole batch.
+ *
+ * @arg: The Batch.
+ * @return: Null.
+ */
+static void *batch_work(void *arg)
+{
+    Batch *batch;
+    RegexCache *cache;
+    const char *str;
+    size_t first;
+    size_t last;
+    size_t idx;
+
+    batch = arg;
+    cache = 0;
+    if (batch->regex.dfa.format == REGEX_DFA_LAZY)
+    {
+        cache = regex_cache_get(&batch->regex);
+    }
+
+    for (;;)
+    {
+        first = __sync_fetch_and_add(&batch->next, (size_t) BATCH_BLOCK);
+        if (first >= batch->num_strs)
+        {
+            break;
+        }
+        last = first + BATCH_BLOCK;
+        if (last > batch->num_strs)
+        {
+            last = batch->num_strs;
+        }
+        for (idx = first; idx < last; idx++)
+        {
+            str = batch->strs[idx];
+            batch->results[idx] = (unsigned char) regex_exec(
+                &batch->regex, cache, (const unsigned char *) str,
+                batch->lens != 0 ? batch->lens[idx] : LEN_UNKNOWN,
+                batch->limits);
+        }
+    }
+
+    if (cache != 0)
+    {
+        regex_cache_put(&batch->regex, cache);
+    }
+    return 0;
+}
+
+/*
+ * Compile the regexes of a call to regex_compile_many until every one has
+ * been taken.
+ *
+ * @arg: The CompileBatch.
+ * @return: Null.
+ */
+static void *compile_work(void *arg)
+{
+    CompileBatch *batch;
+    size_t idx;
+
+    batch = arg;
+    for (;;)
+    {
+        idx = __sync_fetch_and_add(&batch->next, (size_t) 1);
+        if (idx >= batch->num_texts)
+        {
+            break;
+        }
+        batch->statuses[idx] = regex_compile_options(batch->texts[idx],
+                                                     &batch->options,
+                                                     &batch->regexes[idx]);
+        if (batch->statuses[idx] != REGEX_SUCCESS)
+        {
+            __sync_fetch_and_add(&batch->failed, (size_t) 1);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Store the result of a subset construction in the format asked for by
+ * @options. States are renumbered so the dead state comes first and accepting
+ * states come last.
+ *
+ * @options: Options the regex is compiled with.
+ * @dfa: The DFA to populate.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short dfa_encode(DfaBuilder *builder, RegexOptions *options, Dfa *dfa)
+{
+    int *order;
+    int num_states;
+    int first_accepting;
+    int state;
+    int accepting;
+    int next_id;
+    int format;
+    int count;
+    int kind;
+    int ends[256];
+    int targets[256];
+    unsigned long dense_size;
+    unsigned long hybrid_size;
+    short status;
+
+    num_states = builder->num_states;
+    order = malloc(num_states * sizeof(int));
+    if (order == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+
+    /*  number the non-accepting states, then the accepting ones  */
+    next_id = 0;
+    first_accepting = 0;
+    for (accepting = 0; accepting < 2; accepting++)
+    {
+        if (accepting)
+        {
+            first_accepting = next_id;
+        }
+        for (state = 0; state < num_states; state++)
+        {
+            if (builder_accepts(builder, state) == accepting)
+            {
+                order[state] = next_id++;
+            }
+        }
+    }
+
+    /*  premultiplied offsets need 16 bits up to 64k cells  */
+    dfa->num_states = num_states;
+    dfa->stride = builder->stride;
+    dfa->width = (long) num_states * dfa->stride <= 65536L ? 2 : 4;
+
+    /*  only give up the dense table when it is worth it  */
+    format = options->dfa_format;
+    if (format == REGEX_DFA_AUTO)
+    {
+        dense_size = (unsigned long) num_states * dfa->stride * dfa->width;
+        hybrid_size = 0;
+        for (state = 0; state < num_states; state++)
+        {
+            count = builder_ranges(builder, state, ends, targets);
+            kind = record_kind(REGEX_DFA_HYBRID, dfa->stride, count, targets);
+            hybrid_size += record_size(kind, dfa->stride, count);
+        }
+        format = REGEX_DFA_DENSE;
+        if (dense_size > options->dense_limit && hybrid_size < dense_size)
+        {
+            format = REGEX_DFA_HYBRID;
+        }
+    }
+
+    dfa->format = format;
+    if (format == REGEX_DFA_DENSE)
+    {
+        status = dfa_encode_dense(builder, order, first_accepting, dfa);
+    }
+    else
+    {
+        status = dfa_encode_records(builder, order, first_accepting, dfa);
+    }
+
+    free(order);
+    return status;
+}
+
+/*
+ * Store the result of a subset construction as a dense, premultiplied table.
+ *
+ * @order: New id of each state of @builder.
+ * @first_accepting: New id of the first accepting state.
+ * @dfa: The DFA to populate. Its @stride and @width are already set.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short dfa_encode_dense(DfaBuilder *builder, int *order,
+                              int first_accepting, Dfa *dfa)
+{
+    int stride;
+    int state;
+    int idx;
+    long cell;
+    unsigned long offset;
+
+    stride = dfa->stride;
+    dfa->start = (unsigned int) (order[builder->start] * stride);
+    dfa->accept_start = (unsigned int) (first_accepting * stride);
+    dfa->size = (unsigned long) builder->num_states * stride * dfa->width;
+    dfa->table = malloc(dfa->size);
+    if (dfa->table == 0)
+    {
+        return REGEX_ERR_MEMORY;
+    }
+
+    for (state = 0; state < builder->num_states; state++)
+    {
+        for (idx = 0; idx < stride; idx++)
+        {
+            cell = (long) order[state] * stride + idx;
+            offset = (unsigned long)
+                     order[builder->trans[state * stride + idx]] * stride;
+            if (dfa->width == 2)
+            {
+                ((unsigned short *) dfa->table)[cell] = (unsigned short) offset;
+            }
+            else
+            {
+                ((unsigned int *) dfa->table)[cell] = (unsigned int) offset;
+            }
+        }
+    }
+
+    return REGEX_SUCCESS;
+}
+
+/*
+ * Split the transitions of a state into byte ranges: one per run of bytes
+ * leading to the same state, including runs leading to the dead state.
+ *
+ * @state: Id of the state in @builder.
+ * @ends: Set to the last byte of each range, in increasing order.
+ * @targets: Set to the id in @builder of the state each range leads to.
+ * @return: The number of ranges, between 1 and 256.
+ */
+static int builder_ranges(DfaBuilder *builder, int state, int *ends,
+                          int *targets)
+{
+    unsigned char *classes;
+    int *row;
+    int count;
+    int byte;
+
+    classes = builder->classes;
+    row = &builder->trans[state * builder->stride];
+    count = 0;
+    for (byte = 0; byte < 256; byte++)
+    {
+        if (byte == 255 || row[classes[byte]] != row[classes[byte + 1]])
+        {
+            ends[count] = byte;
+            targets[count] = row[classes[byte]];
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Choose how to store a state in a sparse or hybrid DFA.
+ * Sparse DFAs only use range lists. Hybrid DFAs pick by out-degree: a single
+ * range over a default, a short range list, or a dense row for busy states.
+ *
+ * @format: REGEX_DFA_SPARSE or REGEX_DFA_HYBRID.
+ * @stride: Number of byte classes.
+ * @count: Number of ranges of the state.
+ * @targets: Where each range of the state leads.
+ * @return: One of the HYBRID_* kinds.
+ */
+static int record_kind(int format, int stride, int count, int *targets)
+{
+    if (format == REGEX_DFA_SPARSE)
+    {
+        return HYBRID_RANGES;
+    }
+    if (count <= 2 || (count == 3 && targets[0] == targets[2]))
+    {
+        return HYBRID_SINGLE;
+    }
+    if (count <= HYBRID_MAX_RANGES &&
+        SPARSE_RECORD_SIZE(count) < 4UL * stride)
+    {
+        return HYBRID_RANGES;
+    }
+    return HYBRID_DENSE;
+}
+
+/*
+ * Size of a record in a sparse or hybrid DFA, a multiple of 4 bytes.
+ *
+ * @kind: One of the HYBRID_* kinds.
+ * @stride: Number of byte classes.
+ * @count: Number of ranges of the state.
+ */
+static unsigned long record_size(int kind, int stride, int count)
+{
+    if (kind == HYBRID_SINGLE)
+    {
+        return HYBRID_SINGLE_SIZE;
+    }
+    if (kind == HYBRID_RANGES)
+    {
+        return SPARSE_RECORD_SIZE(count);
+    }
+    return 4UL * stride;
+}
+
+/*
+ * Store the result of a subset construction as a sparse or hybrid DFA.
+ * Each state is a record identified by its offset in the table. Records are
+ * 4 byte aligned and come in three kinds:
+ *   - HYBRID_RANGES: byte ranges covering all 256 bytes.
+ *       1 byte: the number of ranges minus one.
+ *       1 byte per range: the last byte of the range, in increasing order.
+ *       padding up to a multiple of 4 bytes.
+ *       4 bytes per range: the state the range leads to.
+ *   - HYBRID_SINGLE: one range over a default.
+ *       2 bytes: the first and last byte of the range. Empty if first > last.
+ *       2 bytes of padding.
+ *       4 bytes: the state the range leads to.
+ *       4 bytes: the state every other byte leads to.
+ *   - HYBRID_DENSE: a dense row.
+ *       4 bytes per byte class: the state the class leads to.
+ * Sparse DFAs only have HYBRID_RANGES records. Hybrid DFAs mix all three,
+ * and keep the kind in the two low bits of the state, so it is known without
+ * touching the record.
+ *
+ * @order: New id of each state of @builder.
+ * @first_accepting: New id of the first accepting state.
+ * @dfa: The DFA to populate. Its @format and @stride are already set.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY.
+ */
+static short dfa_encode_records(DfaBuilder *builder, int *order,
+                                int first_accepting, Dfa *dfa)
+{
+    unsigned char *record;
+    unsigned int *next;
+    unsigned long *states;
+    int ends[256];
+    int targets[256];
+    int *by_id;
+    int *row;
+    int num_states;
+    int state;
+    int count;
+    int kind;
+    int idx;
+    int id;
+
+    num_states = builder->num_states;
+    states = malloc(num_states * sizeof(unsigned long));
+    by_id = malloc(num_states * sizeof(int));
+    if (states == 0 || by_id == 0)
+    {
+        free(states);
+        free(by_id);
+        return REGEX_ERR_MEMORY;
+    }
+
+    /*  lay the records out in order of the new ids  */
+    for (state = 0; state < num_states; state++)
+    {
+        by_id[order[state]] = state;
+    }
+    dfa->size = 0;
+    dfa->accept_start = 0;
+    for (id = 0; id < num_states; id++)
+    {
+        if (id == first_accepting)
+        {
+            dfa->accept_start = (unsigned int) dfa->size;
+        }
+        count = builder_ranges(builder, by_id[id], ends, targets);
+        kind = record_kind(dfa->format, dfa->stride, count, targets);
+        states[id] = dfa->size;
+        if (dfa->format == REGEX_DFA_HYBRID)
+        {
+            states[id] |= (unsigned long) kind;
+        }
+        dfa->size += record_size(kind, dfa->stride, count);
+    }
+    if (first_accepting == num_states)
+    {
+        dfa->accept_start = (unsigned int) dfa->size;
+    }
+    dfa->start = (unsigned int) states[order[builder->start]];
+
+    dfa->table = malloc(dfa->size);
+    if (dfa->table == 0)
+    {
+        free(states);
+        free(by_id);
+        return REGEX_ERR_MEMORY;
+    }
+
+    for (id = 0; id < num_states; id++)
+    {
+        state = by_id[id];
+        count = builder_ranges(builder, state, ends, targets);
+        kind = record_kind(dfa->format, dfa->stride, count, targets);
+        record = (unsigned char *) dfa->table +
+                 (states[id] & ~HYBRID_KIND_MASK);
+
+        if (kind == HYBRID_SINGLE)
+        {
+            /*  the range is whichever run doesn't lead to the default  */
+            next = (unsigned int *) (record + 4);
+            record[0] = 1;
+            record[1] = 0;
+            record[2] = 0;
+            record[3] = 0;
+            next[0] = (unsigned int) states[order[targets[0]]];
+            next[1] = (unsigned int) states[order[targets[count - 1]]];
+            if (count == 2)
+            {
+                record[0] = 0;
+                record[1] = (unsigned char) ends[0];
+            }
+            else if (count == 3)
+            {
+                record[0] = (unsigned char) (ends[0] + 1);
+                record[1] = (unsigned char) ends[1];
+                next[0] = (unsigned int) states[order[targets[1]]];
+            }
+        }
+        else if (kind == HYBRID_RANGES)
+        {
+            next = (unsigned int *) (record + SPARSE_ENDS_SIZE(count));
+            record[0] = (unsigned char) (count - 1);
+            for (idx = 0; idx < count; idx++)
+            {
+                record[1 + idx] = (unsigned char) ends[idx];
+                next[idx] = (unsigned int) states[order[targets[idx]]];
+            }
+        }
+        else
+        {
+            next = (unsigned int *) record;
+            row = &builder->trans[state * dfa->stride];
+            for (idx = 0; idx < dfa->stride; idx++)
+            {
+                next[idx] = (unsigned int) states[order[row[idx]]];
+            }
+        }
+    }
 
+    free(states);
+    free(by_id);
+    return REGEX_SUCCESS;
 }
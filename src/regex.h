@@ -1,7 +1,10 @@
 /*
  * A simple regex engine written in C.
  *
- * TODO add a simple description.
+ * Regexes are compiled in three steps: the text is parsed into a syntax tree,
+ * the tree is turned into an NFA with Thompson's construction, and the NFA is
+ * turned into a DFA with the subset construction. The DFA is then stored as a
+ * table of transitions which is simulated to match strings.
  *
  * Written by Max Hanson, September 2019.
  * Licensed under MIT, see LICENSE.md for details.
@@ -10,31 +13,971 @@
 #ifndef REGEX_H
 #define REGEX_H
 
+#include <signal.h>
+#include <stddef.h>
+
 #include "graph.h"
 
+/*  return codes of regex_compile  */
+#define REGEX_SUCCESS 0
+#define REGEX_ERR_SYNTAX 1
+#define REGEX_ERR_MEMORY 2
+/*  return code of regex_replace_all and regex_split if the buffer is small  */
+#define REGEX_ERR_SPACE 3
+
+/*  return codes of regex_match  */
+#define REGEX_MATCH 0
+#define REGEX_NO_MATCH 1
+#define REGEX_ABORTED 2
+
+/*  which match searches find where several start at the leftmost place  */
+#define REGEX_LEFTMOST_LONGEST 0
+#define REGEX_LEFTMOST_FIRST 1
+
+/*  formats of the DFA  */
+#define REGEX_DFA_AUTO 0
+#define REGEX_DFA_DENSE 1
+#define REGEX_DFA_SPARSE 2
+#define REGEX_DFA_HYBRID 3
+#define REGEX_DFA_LAZY 4
+
+/*  engines a regex can be run with, see RegexPlan  */
+#define REGEX_ENGINE_LITERAL 0
+#define REGEX_ENGINE_DFA 1
+#define REGEX_ENGINE_LAZY_DFA 2
+#define REGEX_ENGINE_SEARCH_DFA 3
+#define REGEX_ENGINE_PIKE 4
+
+/*  ways searches skip to where a match may be, see RegexPlan  */
+#define REGEX_PREFILTER_NONE 0
+#define REGEX_PREFILTER_BYTE 1
+#define REGEX_PREFILTER_BYTES 2
+#define REGEX_PREFILTER_LITERAL 3
+
+/*  automata and formats of regex_export  */
+#define REGEX_EXPORT_NFA 0
+#define REGEX_EXPORT_DFA 1
+#define REGEX_EXPORT_DOT 0
+#define REGEX_EXPORT_JSON 1
+
+/*  default size, in bytes, above which REGEX_DFA_AUTO goes hybrid  */
+#define REGEX_DENSE_LIMIT (1UL << 20)
+
+/*  default most memory, in bytes, a DFA may take while it is built  */
+#define REGEX_DFA_BUDGET (8UL << 20)
+
+/*  default bytes matched between checks of RegexLimits  */
+#define REGEX_CHECK_INTERVAL (64UL << 10)
+
+/*  longest literal a regex keeps to search for, see Regex.literal  */
+#define REGEX_MAX_LITERAL 16
+
+/*  types of NFA nodes  */
+#define NFA_EPSILON 0
+#define NFA_BYTES 1
+#define NFA_MATCH 2
+#define NFA_CAPTURE 3
+
+/*
+ * Extra information kept about each node of the NFA graph.
+ * The graph itself only keeps the edges, in order of priority. A NFA_BYTES
+ * node has one edge, taken on any byte in @bytes. A NFA_EPSILON node has any
+ * number of edges, taken without consuming input. A NFA_MATCH node has none.
+ * A NFA_CAPTURE node is a NFA_EPSILON node at the start or end of a group,
+ * which the DFA ignores but which records where groups are when they're
+ * asked for.
+ *
+ * @type: One of NFA_EPSILON, NFA_BYTES, NFA_MATCH or NFA_CAPTURE.
+ * @bytes: Bitset of the bytes a NFA_BYTES node consumes.
+ * @capture: Slot a NFA_CAPTURE node records the position in: 2 * n at the
+ *   start of group n and 2 * n + 1 at its end. Groups are numbered from 1 in
+ *   the order of their '('.
+ */
+typedef struct NfaLabelTag
+{
+    unsigned char type;
+    unsigned char bytes[32];
+    int capture;
+} NfaLabel;
+
+/*
+ * A DFA stored as a table of transitions, in one of three formats.
+ *
+ * REGEX_DFA_DENSE: Bytes are mapped to equivalence classes first, so each
+ * state has a row of @stride cells, one per class. States are identified by
+ * the offset of their row in @table (ie their index premultiplied by
+ * @stride), so following a transition is a single load:
+ * 'state = table[state + class]'.
+ *
+ * REGEX_DFA_SPARSE: Each state is a variable length record listing its
+ * transitions as sorted byte ranges, and is identified by the byte offset of
+ * its record in @table. Following a transition scans the ranges, which is a
+ * little slower but takes far less memory when states have few transitions.
+ *
+ * REGEX_DFA_HYBRID: Like REGEX_DFA_SPARSE, but each state's record is chosen
+ * by its number of transitions: a single byte range over a default state, a
+ * range list, or a dense row for the few busy states. The kind of record is
+ * kept in the two low bits of the state, which are otherwise always 0.
+ *
+ * REGEX_DFA_LAZY: There is no table, the DFA went over its budget while it
+ * was built. States are built while matching instead, see RegexCache.
+ *
+ * In both formats the dead state is at offset 0 and accepting states are
+ * ordered after every non-accepting state, so a state accepts iff it is
+ * >= @accept_start.
+ *
+ * @format: REGEX_DFA_DENSE, REGEX_DFA_SPARSE, REGEX_DFA_HYBRID or
+ *   REGEX_DFA_LAZY.
+ * @num_states: Number of states in the DFA, including the dead state.
+ * @stride: Number of byte classes, ie the length of each dense row.
+ * @width: Size of each dense cell in bytes. 2 if every offset fits in 16
+ *   bits, 4 otherwise.
+ * @start: Offset of the start state.
+ * @accept_start: Offset of the first accepting state.
+ * @size: Size of @table in bytes.
+ * @table: The transitions.
+ */
+typedef struct DfaTag
+{
+    int format;
+    int num_states;
+    int stride;
+    int width;
+    unsigned int start;
+    unsigned int accept_start;
+    unsigned long size;
+    void *table;
+} Dfa;
+
+/*
+ * Options for compiling a regex. Initialize them with regex_options_init
+ * before changing any.
+ *
+ * @dfa_format: How the DFA is stored. REGEX_DFA_DENSE, REGEX_DFA_SPARSE,
+ *   REGEX_DFA_HYBRID, or REGEX_DFA_AUTO to store it hybrid only if the dense
+ *   table would be bigger than @dense_limit and the hybrid one is smaller.
+ * @dense_limit: Size in bytes used by REGEX_DFA_AUTO.
+ * @max_dfa_states: Most states the DFA may have, 0 if unlimited.
+ * @max_dfa_bytes: Most memory the automata may take while they are built, 0
+ *   if unlimited. The NFAs are charged first, and a regex whose NFAs alone go
+ *   over fails to compile with REGEX_ERR_MEMORY. The DFA gets the rest, a
+ *   little more than the size of its final table. If it would go over either
+ *   limit, building it stops and the regex uses a lazy DFA instead, whose
+ *   cache of states is held to the same limits. So compiling and matching
+ *   never take much more memory than this.
+ * @shared_cache: Bool. If the regex uses a lazy DFA, have every thread share
+ *   one cache of states, added to without locks, on top of their own. Threads
+ *   then reuse the states others built, so many short lived threads warm up
+ *   faster. It takes the budget above up front. Once it is full, threads
+ *   carry on in their own caches.
+ * @reverse_dfa: Bool. Also build the DFAs searches use to find matches in
+ *   two passes: a forward one that runs from where the search starts to find
+ *   where the leftmost match ends, then one of the reversed regex
+ *   that runs backward from there to find where it starts. Only kept if both
+ *   fit in the budget above, dense. Otherwise searches run the NFA from every
+ *   place a match could start at once, which is slower but still one pass.
+ * @match_kind: Which match searches find among those that start at the
+ *   leftmost place. REGEX_LEFTMOST_LONGEST for the longest, as POSIX does,
+ *   or REGEX_LEFTMOST_FIRST for the one a backtracking engine like Perl's
+ *   would find, eg 'a|ab' finds 'a' in 'ab'. Whole strings match the same
+ *   either way. A regex with a lazy quantifier, eg 'a*?', is always
+ *   REGEX_LEFTMOST_FIRST, since that is the only kind they change.
+ * @stats: Bool. Count the work done with the regex, see regex_stats.
+ */
+typedef struct RegexOptionsTag
+{
+    int dfa_format;
+    unsigned long dense_limit;
+    int max_dfa_states;
+    unsigned long max_dfa_bytes;
+    int shared_cache;
+    int reverse_dfa;
+    int match_kind;
+    int stats;
+} RegexOptions;
+
+/*
+ * Counts of the work done with a regex since it was compiled or its counts
+ * were reset, see RegexOptions.stats.
+ *
+ * @calls: Matches and searches: each string matched, each call to
+ *   regex_find_next and each to regex_is_match or regex_shortest_match.
+ * @bytes: Bytes of input the calls went over.
+ * @matches: Calls that found a match.
+ * @prefilter_hits: Places a prefilter stopped at for an engine to check. The
+ *   fewer of them that turn out to be @matches, the less the prefilter helps.
+ * @cache_misses: Transitions of a lazy DFA built while matching.
+ * @cache_clears: Times the cache of a lazy DFA filled up and was cleared.
+ * @fallbacks: Searches without search DFAs, which ran the Pike VM.
+ */
+typedef struct RegexStatsTag
+{
+    unsigned long calls;
+    unsigned long bytes;
+    unsigned long matches;
+    unsigned long prefilter_hits;
+    unsigned long cache_misses;
+    unsigned long cache_clears;
+    unsigned long fallbacks;
+} RegexStats;
+
+/*
+ * Limits on the work done by a single match, search or batch, see the
+ * *_limits functions. Initialize them with regex_limits_init before
+ * changing any.
+ * Limits are checked every @check_interval bytes rather than every byte,
+ * so they cost next to nothing, but may be overshot by up to that much.
+ * Bytes a search skips looking for where a match can start count towards
+ * @max_bytes, but are skipped without a check.
+ *
+ * @max_bytes: Most bytes to run the regex over, 0 if unlimited.
+ * @max_millis: Most wall clock time to take, in milliseconds, 0 if unlimited.
+ * @check_interval: Bytes run over between checks of @max_millis and @cancel.
+ * @cancel: Flag another thread or a signal handler can set to non-zero to
+ *   abort the match. May be null.
+ */
+typedef struct RegexLimitsTag
+{
+    unsigned long max_bytes;
+    unsigned long max_millis;
+    unsigned long check_interval;
+    volatile sig_atomic_t *cancel;
+} RegexLimits;
+
+/*
+ * The mutable state a thread needs to match a lazy regex: the states of its
+ * lazy DFA built so far. Matching never changes a compiled Regex, so one
+ * regex can be shared by any number of threads as long as each uses its own
+ * cache. Caches of other regexes have nothing in them. See
+ * RegexOptions.shared_cache for states shared between threads as well.
+ *
+ * @states: The states of the lazy DFA, null if the regex isn't lazy.
+ * @pike: Scratch space of the Pike VM, made the first time a search needs it,
+ *   null until then.
+ * @next: Next cache in the pool of the regex.
+ */
+typedef struct RegexCacheTag
+{
+    struct DfaBuilderTag *states;
+    struct PikeTag *pike;
+    struct RegexCacheTag *next;
+} RegexCache;
+
+/*
+ * The engines regex_compile chose for a regex, and why. See regex_explain
+ * for the same as text.
+ *
+ * REGEX_ENGINE_LITERAL: The regex has no metacharacters, so it is compared
+ *   and searched for as plain bytes.
+ * REGEX_ENGINE_DFA: The DFA, in the format of Regex.dfa.
+ * REGEX_ENGINE_LAZY_DFA: The same, with states built while matching.
+ * REGEX_ENGINE_SEARCH_DFA: Searches run a forward DFA to find where a match
+ *   ends and a reverse one to find where it starts, see Regex.search.
+ * REGEX_ENGINE_PIKE: Searches run the NFA from every start at once, in one
+ *   pass, keeping the priorities leftmost-first matches need.
+ *
+ * REGEX_PREFILTER_NONE: Every position is tried, since a match can be empty
+ *   or start with any byte.
+ * REGEX_PREFILTER_BYTE: Searches skip to the only byte a match starts with.
+ * REGEX_PREFILTER_BYTES: Searches skip to a byte in Regex.first_bytes.
+ * REGEX_PREFILTER_LITERAL: Searches look for Regex.literal first.
+ *
+ * @match_engine: REGEX_ENGINE_* matching whole strings.
+ * @search_engine: REGEX_ENGINE_* finding matches within strings.
+ * @prefilter: REGEX_PREFILTER_* searches use.
+ * @match_reason: Why @match_engine was chosen.
+ * @search_reason: Why @search_engine was chosen.
+ * @prefilter_reason: Why @prefilter was chosen.
+ */
+typedef struct RegexPlanTag
+{
+    int match_engine;
+    int search_engine;
+    int prefilter;
+    const char *match_reason;
+    const char *search_reason;
+    const char *prefilter_reason;
+} RegexPlan;
+
+/*
+ * A compiled regex.
+ * Everything is allocated by regex_compile and released by regex_free.
+ * A regex is never changed by matching and can be used by several threads.
+ *
+ * @nfa: The NFA built from the regex, kept so it can be inspected.
+ * @nfa_labels: Extra information on each node of @nfa, indexed by node id.
+ * @nfa_buckets: Storage for the edges of @nfa, one bucket per node.
+ * @nfa_start: Id of the start node of @nfa.
+ * @num_groups: Number of groups in the regex.
+ * @match_kind: REGEX_LEFTMOST_LONGEST or REGEX_LEFTMOST_FIRST.
+ * @classes: Map of each of the 256 bytes to its equivalence class.
+ * @dfa: The DFA used for matching.
+ * @search: Dense DFA finding where the leftmost match after some position
+ *   ends, as set by @match_kind, see RegexOptions.reverse_dfa. Its table is
+ *   null if it wasn't built.
+ * @reverse: Dense DFA of the reversed regex, run backward from where a match
+ *   ends to find where it starts. Built along with @search.
+ * @caches: Pool of caches not in use, for regex_cache_get, and the counts
+ *   of RegexOptions.stats.
+ * @first_bytes: Bitset of the bytes a non-empty match can start with, used
+ *   to skip ahead when searching.
+ * @first_byte: The only byte in @first_bytes, or -1 if there are several.
+ * @literal: Bytes every match holds, which searches look for first. Matches
+ *   can only start so far back from where it is found.
+ * @literal_len: Length of @literal, 0 if the regex has none.
+ * @literal_suffix: Bool. Every match ends with @literal, so strings that
+ *   don't can't match as a whole.
+ * @literal_before: Longest a match can be before @literal, -1 if unbounded.
+ * @literal_only: Length of @text if it has no metacharacters, 0 if not.
+ *   Such a regex is compared and searched for as plain bytes, and has no NFA,
+ *   classes or DFAs.
+ * @plan: The engines chosen to run the regex.
+ * @text: The text representation of the regex.
+ */
 typedef struct RegexTag
 {
-    Graph dfa; /*  the compiled version of the regex  */
-    char* text; /*  the text representation of the regex  */
+    Graph nfa;
+    NfaLabel *nfa_labels;
+    Bucket *nfa_buckets;
+    int nfa_start;
+    int num_groups;
+    int match_kind;
+    unsigned char *classes;
+    Dfa dfa;
+    Dfa search;
+    Dfa reverse;
+    struct RegexPoolTag *caches;
+    unsigned char first_bytes[32];
+    int first_byte;
+    unsigned char literal[REGEX_MAX_LITERAL];
+    int literal_len;
+    int literal_suffix;
+    long literal_before;
+    size_t literal_only;
+    RegexPlan plan;
+    char* text;
 } Regex;
 
+/*
+ * A search for every match of a regex in a string, see regex_find_iter.
+ *
+ * @regex: The regex searched for.
+ * @str: The string searched.
+ * @len: Length of @str.
+ * @pos: Where the next search starts, past @len once there are no more.
+ * @empty_at: Where the last match was if it was empty, past @len if not.
+ * @literal_at: Where the regex's literal next occurs at or after @pos, @len
+ *   if it doesn't, past @len if it wasn't looked for yet.
+ * @cache: Cache of a lazy regex, from the regex's pool.
+ * @pike: Scratch space to find matches without the search DFAs, null if not
+ *   needed.
+ * @limits: Limits on the whole search, null if none.
+ * @started: When the search started, in milliseconds of a monotonic clock,
+ *   if @limits has a time limit.
+ */
+typedef struct RegexIterTag
+{
+    Regex regex;
+    const char *str;
+    size_t len;
+    size_t pos;
+    size_t empty_at;
+    size_t literal_at;
+    RegexCache *cache;
+    struct PikeTag *pike;
+    RegexLimits *limits;
+    unsigned long started;
+} RegexIter;
+
+/*
+ * A set of regexes searched for together, see regex_set_init. Each regex is
+ * compiled on its own when it is added, so changing a few of them never
+ * recompiles the rest.
+ *
+ * @regexes: The regexes, indexed by id. Ids not in use have a null text.
+ * @num_ids: Ids handed out so far, in use or not.
+ * @size: Capacity of @regexes.
+ * @count: Number of regexes in the set.
+ * @options: Options every regex is compiled with.
+ */
+typedef struct RegexSetTag
+{
+    Regex *regexes;
+    int num_ids;
+    int size;
+    int count;
+    RegexOptions options;
+} RegexSet;
+
+/*
+ * A set of regexes that can be swapped for a new one while other threads
+ * search it, see regex_handle_init. Searches take the current set and give
+ * it back when done. A new set is published at once, and the old one is
+ * freed once the searches that may have it are done. Searches never wait.
+ *
+ * @current: The set searches are given.
+ * @epoch: Bumped by each publish. Searches count in on the side of
+ *   @readers of its parity, so a publish knows which ones to wait for.
+ * @writing: Bool. A publish is under way, others wait their turn.
+ * @readers: Searches under way, for each parity of @epoch, spread over
+ *   several cache lines.
+ */
+typedef struct RegexHandleTag
+{
+    RegexSet *volatile current;
+    volatile unsigned long epoch;
+    volatile int writing;
+    volatile unsigned long *readers;
+} RegexHandle;
+
 /*
  * Compile a regex into a deterministic finite automata (DFA).
  *
  * @regex_text: text representation of the regex.
  * @empty_regex: empty regex struct that this method will populate. Text member
  *   will be set to @regex_text, make sure it isn't deallocated.
- * @return: TODO sort out error codes
+ * @return: REGEX_SUCCESS, REGEX_ERR_SYNTAX if @regex_text isn't a valid regex
+ *   or REGEX_ERR_MEMORY if an allocation failed or its NFA is too big for the
+ *   budget. @empty_regex only needs to be freed on success.
  */
 short regex_compile(char* regex_text, Regex* empty_regex);
 
+/*
+ * Set options to their defaults: REGEX_DFA_AUTO with REGEX_DENSE_LIMIT, no
+ * limit on states, REGEX_DFA_BUDGET bytes, no shared cache, a reverse DFA,
+ * REGEX_LEFTMOST_LONGEST and no stats.
+ *
+ * @options: the options to initialize.
+ */
+void regex_options_init(RegexOptions* options);
+
+/*
+ * Compile a regex like regex_compile, with options.
+ *
+ * @regex_text: text representation of the regex.
+ * @options: options initialized with regex_options_init.
+ * @empty_regex: empty regex struct that this method will populate.
+ * @return: same as regex_compile.
+ */
+short regex_compile_options(char* regex_text, RegexOptions* options,
+                            Regex* empty_regex);
+
+/*
+ * Compile many regexes like regex_compile_options, spread over several
+ * threads. Regexes are handed out one at a time, so a few slow ones don't
+ * hold up the rest, and each lands in the slot of its text whichever thread
+ * compiled it.
+ *
+ * @texts: text of each regex, kept like regex_compile does.
+ * @num_texts: number of regexes.
+ * @options: options to compile every regex with, or null for the defaults.
+ * @regexes: set to each compiled regex, in the order of @texts. Only those
+ *   that compiled need freeing.
+ * @statuses: set to the result of compiling each regex, as regex_compile.
+ * @num_threads: most threads to compile with, counting the caller. Less
+ *   than 1 counts as 1.
+ * @return: number of regexes that failed to compile.
+ */
+size_t regex_compile_many(char** texts, size_t num_texts,
+                          RegexOptions* options, Regex* regexes,
+                          short* statuses, int num_threads);
+
 /*
  * Simulate a regex DFA to test if it matches a string.
+ * The whole string has to match, as if the regex was anchored at both ends.
  *
  * @str: string to test against the regex.
  * @regex: the DFA to simulate.
- * @return: a boolean, 0 if @str matches and 1 if not.
+ * @return: 0 if @str matches, 1 if not, or REGEX_ABORTED if @regex uses a
+ *   lazy DFA and there was no memory for a cache of its states.
  */
 short regex_match(char* str, Regex regex);
 
+/*
+ * Start a search for every match of a regex in a string, in order, from
+ * left to right. Matches never overlap. Where several matches start at the
+ * same place, the one RegexOptions.match_kind asks for is found, by default
+ * the longest, or the first one if the regex has a lazy quantifier, so eg
+ * '<.*?>' finds "<a>" in "<a><b>". An empty match is found right after a
+ * non-empty one, but never twice at the same place, so eg 'a*' finds three
+ * matches in "baa": "" at 0, "aa" at 1 and "" at 3.
+ *
+ * @iter: the search to start.
+ * @regex: the regex to search for.
+ * @str: the string to search. Needn't be null terminated.
+ * @len: length of @str.
+ * @return: REGEX_SUCCESS, or REGEX_ERR_MEMORY if a lazy regex couldn't get a
+ *   cache or scratch space. @iter only needs to be freed on success.
+ */
+short regex_find_iter(RegexIter* iter, Regex* regex, const char* str,
+                      size_t len);
+
+/*
+ * Find the next match of a search started by regex_find_iter.
+ *
+ * @iter: the search.
+ * @start: set to the offset of the first byte of the match.
+ * @end: set to the offset just past the last byte of the match.
+ * @return: REGEX_MATCH if a match was found, REGEX_NO_MATCH if there are no
+ *   more, or REGEX_ABORTED if the search was started by
+ *   regex_find_iter_limits and a limit was hit.
+ */
+short regex_find_next(RegexIter* iter, size_t* start, size_t* end);
+
+/*
+ * Release everything allocated by regex_find_iter.
+ *
+ * @iter: the search.
+ */
+void regex_find_free(RegexIter* iter);
+
+/*
+ * Test if a regex matches anywhere in a string. This stops as soon as any
+ * match ends, without looking for where it starts or how long it could be,
+ * so it is the fastest way to filter strings.
+ *
+ * @regex: the regex to look for.
+ * @str: the string to look in. Needn't be null terminated.
+ * @len: length of @str.
+ * @return: REGEX_MATCH, REGEX_NO_MATCH, or REGEX_ABORTED if memory ran out.
+ */
+short regex_is_match(const Regex* regex, const char* str, size_t len);
+
+/*
+ * Find where the first match of a regex to end in a string ends, like
+ * regex_is_match. Matches that start further left but end later are passed
+ * over, eg 'abcd|c' in 'abcd' ends at 3.
+ *
+ * @regex: the regex to look for.
+ * @str: the string to look in. Needn't be null terminated.
+ * @len: length of @str.
+ * @end: set to the offset just past the last byte of the match.
+ * @return: same as regex_is_match.
+ */
+short regex_shortest_match(const Regex* regex, const char* str, size_t len,
+                           size_t* end);
+
+/*
+ * Replace every match of a regex in a string, as found by regex_find_iter.
+ * In @replacement, '$0' stands for the match, '$1' to '$9' and '${n}' for
+ * its groups, and '$$' for a dollar sign. A group that took no part in the
+ * match stands for nothing. Where a group could match several ways, it is
+ * the way a backtracking engine would try first.
+ * Matches are found in one pass, then the output is sized and written in
+ * one go, so it takes a single allocation, or none.
+ *
+ * @regex: the regex to replace.
+ * @str: the string to replace in. Needn't be null terminated.
+ * @len: length of @str.
+ * @replacement: null terminated replacement of each match.
+ * @out: if null, set to a buffer allocated for the output, which must be
+ *   freed. Otherwise a buffer to write the output to.
+ * @out_len: the size of @out if given. Set to the length of the output, not
+ *   counting its null terminator, or to the size needed if @out is too small.
+ * @return: REGEX_SUCCESS, REGEX_ERR_SYNTAX if @replacement refers to a group
+ *   the regex doesn't have, REGEX_ERR_SPACE if @out is too small, or
+ *   REGEX_ERR_MEMORY.
+ */
+short regex_replace_all(Regex* regex, const char* str, size_t len,
+                        const char* replacement, char** out,
+                        size_t* out_len);
+
+/*
+ * Split a string around every match of a regex, as found by
+ * regex_find_iter, like regex_replace_all with an empty replacement. The
+ * pieces are written back to back to a single buffer, each null terminated.
+ * There is one more piece than there are matches, and pieces may be empty.
+ *
+ * @regex: the regex to split around.
+ * @str: the string to split. Needn't be null terminated.
+ * @len: length of @str.
+ * @out: if null, set to a buffer allocated for the pieces, which must be
+ *   freed. Otherwise a buffer to write them to.
+ * @out_len: the size of @out if given. Set to the size of the pieces with
+ *   their terminators, or to the size needed if @out is too small.
+ * @num_pieces: set to the number of pieces.
+ * @return: REGEX_SUCCESS, REGEX_ERR_SPACE if @out is too small, or
+ *   REGEX_ERR_MEMORY.
+ */
+short regex_split(Regex* regex, const char* str, size_t len, char** out,
+                  size_t* out_len, size_t* num_pieces);
+
+/*
+ * Set limits to their defaults: no limits, checked every
+ * REGEX_CHECK_INTERVAL bytes.
+ *
+ * @limits: the limits to initialize.
+ */
+void regex_limits_init(RegexLimits* limits);
+
+/*
+ * Test if a regex matches a string like regex_match, within limits.
+ * The end of @str is found as it is read, so no more of it is read than
+ * the limits allow.
+ *
+ * @str: string to test against the regex.
+ * @regex: the DFA to simulate.
+ * @limits: the limits, initialized with regex_limits_init.
+ * @return: 0 if @str matches, 1 if not, and REGEX_ABORTED if a limit was hit
+ *   or the match was cancelled before the answer was known, or a lazy regex
+ *   couldn't get a cache.
+ */
+short regex_match_limits(char* str, Regex regex, RegexLimits* limits);
+
+/*
+ * Test if a regex matches a string like regex_match_limits, with the given
+ * cache. The cache keeps the states built by earlier matches, and must not be
+ * used by two threads at once.
+ *
+ * @str: string to test against the regex.
+ * @regex: the DFA to simulate.
+ * @cache: a cache of @regex, from regex_cache_init or regex_cache_get.
+ * @limits: the limits, or null for none.
+ * @return: same as regex_match_limits.
+ */
+short regex_match_cache(char* str, Regex regex, RegexCache* cache,
+                        RegexLimits* limits);
+
+/*
+ * Start a search like regex_find_iter, within limits. The limits are on the
+ * whole search, every call to regex_find_next together: bytes count from
+ * the start of @str, and time from this call. Once a limit is hit,
+ * regex_find_next returns REGEX_ABORTED instead of a match.
+ *
+ * @iter: the search to start.
+ * @regex: the regex to search for.
+ * @str: the string to search. Needn't be null terminated.
+ * @len: length of @str.
+ * @limits: the limits, or null for none. Must outlive the search.
+ * @return: same as regex_find_iter.
+ */
+short regex_find_iter_limits(RegexIter* iter, Regex* regex, const char* str,
+                             size_t len, RegexLimits* limits);
+
+/*
+ * Test if a regex matches anywhere in a string like regex_is_match, within
+ * limits.
+ *
+ * @regex: the regex to look for.
+ * @str: the string to look in. Needn't be null terminated.
+ * @len: length of @str.
+ * @limits: the limits, or null for none.
+ * @return: REGEX_MATCH, REGEX_NO_MATCH, or REGEX_ABORTED if memory ran out
+ *   or a limit was hit before the answer was known.
+ */
+short regex_is_match_limits(const Regex* regex, const char* str, size_t len,
+                            RegexLimits* limits);
+
+/*
+ * Find where the first match of a regex to end in a string ends like
+ * regex_shortest_match, within limits.
+ *
+ * @regex: the regex to look for.
+ * @str: the string to look in. Needn't be null terminated.
+ * @len: length of @str.
+ * @end: set to the offset just past the last byte of the match.
+ * @limits: the limits, or null for none.
+ * @return: same as regex_is_match_limits.
+ */
+short regex_shortest_match_limits(const Regex* regex, const char* str,
+                                  size_t len, size_t* end,
+                                  RegexLimits* limits);
+
+/*
+ * Replace every match of a regex in a string like regex_replace_all, within
+ * limits on the whole search for the matches.
+ *
+ * @regex, @str, @len, @replacement, @out, @out_len: as for
+ *   regex_replace_all.
+ * @limits: the limits, or null for none.
+ * @return: same as regex_replace_all, or REGEX_ABORTED if a limit was hit,
+ *   in which case nothing is written.
+ */
+short regex_replace_all_limits(Regex* regex, const char* str, size_t len,
+                               const char* replacement, char** out,
+                               size_t* out_len, RegexLimits* limits);
+
+/*
+ * Split a string around every match of a regex like regex_split, within
+ * limits on the whole search for the matches.
+ *
+ * @regex, @str, @len, @out, @out_len, @num_pieces: as for regex_split.
+ * @limits: the limits, or null for none.
+ * @return: same as regex_split, or REGEX_ABORTED if a limit was hit, in
+ *   which case nothing is written.
+ */
+short regex_split_limits(Regex* regex, const char* str, size_t len,
+                         char** out, size_t* out_len, size_t* num_pieces,
+                         RegexLimits* limits);
+
+/*
+ * Test if a regex matches each of many strings, like regex_match.
+ * Saves the overhead of a call per string, and a lazy regex takes a cache
+ * from its pool once for the whole batch.
+ *
+ * @regex: the DFA to simulate.
+ * @strs: the strings to test.
+ * @lens: the length of each string, so they needn't be null terminated. May
+ *   be null if they all are.
+ * @num_strs: number of strings.
+ * @results: set to the result of regex_match for each string: REGEX_MATCH,
+ *   REGEX_NO_MATCH, or REGEX_ABORTED if a lazy regex couldn't get a cache.
+ */
+void regex_match_batch(const Regex* regex, const char** strs,
+                       const size_t* lens, size_t num_strs,
+                       unsigned char* results);
+
+/*
+ * Test if a regex matches each of many strings like regex_match_batch,
+ * spread over several threads. The strings are handed out in blocks, and
+ * each thread uses its own cache from the regex's pool.
+ *
+ * @regex: the DFA to simulate.
+ * @strs: the strings to test.
+ * @lens: the length of each string, or null.
+ * @num_strs: number of strings.
+ * @results: set to the result of regex_match for each string.
+ * @num_threads: most threads to use, including the calling thread. Less
+ *   than 1 counts as 1.
+ */
+void regex_match_batch_threads(const Regex* regex, const char** strs,
+                               const size_t* lens, size_t num_strs,
+                               unsigned char* results, int num_threads);
+
+/*
+ * Test if a regex matches each of many strings like
+ * regex_match_batch_threads, within limits. The limits are on each string
+ * on its own, so a string that hits one is REGEX_ABORTED and the rest
+ * still run, except that once @limits->cancel is set the strings left are
+ * each given up at their first check.
+ *
+ * @regex, @strs, @lens, @num_strs, @num_threads: as for
+ *   regex_match_batch_threads.
+ * @results: set to the result of regex_match_limits for each string.
+ * @limits: the limits, or null for none.
+ */
+void regex_match_batch_limits(const Regex* regex, const char** strs,
+                              const size_t* lens, size_t num_strs,
+                              unsigned char* results, int num_threads,
+                              RegexLimits* limits);
+
+/*
+ * Make an empty cache for matching a regex.
+ *
+ * @cache: the cache to initialize.
+ * @regex: the regex it is for.
+ * @return: REGEX_SUCCESS or REGEX_ERR_MEMORY. @cache only needs to be freed
+ *   on success.
+ */
+short regex_cache_init(RegexCache* cache, Regex* regex);
+
+/*
+ * Release everything allocated by regex_cache_init. Only for caches made with
+ * regex_cache_init: one from regex_cache_get goes back with regex_cache_put,
+ * and regex_free frees it along with the pool.
+ *
+ * @cache: the cache to free.
+ */
+void regex_cache_free(RegexCache* cache);
+
+/*
+ * Take a cache from the pool of a regex, or make a new one if the pool is
+ * empty. Safe to call from several threads at once. Caches made by an earlier
+ * thread keep their states, so a pool of caches warms up over time.
+ *
+ * @regex: the regex.
+ * @return: the cache, or null if an allocation failed. It must be given back
+ *   with regex_cache_put, never freed.
+ */
+RegexCache* regex_cache_get(Regex* regex);
+
+/*
+ * Give a cache from regex_cache_get back to the pool of a regex.
+ * Safe to call from several threads at once.
+ *
+ * @regex: the regex.
+ * @cache: the cache, no longer used.
+ */
+void regex_cache_put(Regex* regex, RegexCache* cache);
+
+/*
+ * Describe the engines and prefilter chosen for a regex and why, one per
+ * line, eg for 'a+b':
+ *
+ *     match: dense DFA with 4 states, the table is within dense_limit
+ *     search: forward and reverse DFAs with 4 and 4 states, both are within
+ *       the budget
+ *     prefilter: literal of 1 byte, every match holds it
+ *
+ * See Regex.plan for the same choices as numbers.
+ *
+ * @regex: a compiled regex.
+ * @out: buffer to write the text and a null to, truncated if it is short.
+ *   May be null if @size is 0.
+ * @size: size of @out.
+ * @return: length of the whole text, without the null, like snprintf.
+ */
+size_t regex_explain(const Regex* regex, char* out, size_t size);
+
+/*
+ * Write the NFA or the DFA of a regex as a Graphviz DOT graph or as JSON, to
+ * see why its DFA is big. Both start with the number of states and edges and
+ * the few states with the most edges out, then list each state, whether it
+ * accepts, and its edges labelled with the bytes they are taken on, written
+ * like a class without the brackets, eg 'a-z_'. Epsilon edges of the NFA
+ * have no bytes.
+ *
+ * The DFA is built again from the NFA, since its table doesn't keep the sets
+ * of NFA nodes behind each state, which the JSON counts as 'nfa_nodes'. It
+ * has the same states as the regex's DFA, numbered in the order they were
+ * found, with the dead state first. Edges to the dead state are left out, as
+ * is the dead state itself from DOT graphs. Building stops at @max_states,
+ * and states whose edges weren't all built are marked incomplete, dashed in
+ * DOT graphs. A lazy regex's DFA may be huge, so give it a limit.
+ * A plain literal has no automata and exports with no states.
+ *
+ * @regex: a compiled regex.
+ * @automaton: REGEX_EXPORT_NFA or REGEX_EXPORT_DFA.
+ * @format: REGEX_EXPORT_DOT or REGEX_EXPORT_JSON.
+ * @max_states: most DFA states to build, 0 if unlimited.
+ * @out: buffer to write the text and a null to, truncated if it is short.
+ *   May be null if @size is 0.
+ * @size: size of @out.
+ * @return: length of the whole text, without the null, like snprintf, or 0
+ *   if an allocation failed.
+ */
+size_t regex_export(const Regex* regex, int automaton, int format,
+                    int max_states, char* out, size_t size);
+
+/*
+ * Read the counts of the work done with a regex compiled with
+ * RegexOptions.stats. Threads add to the counts without locks, spread over
+ * several cache lines, so the counts of matches under way may be partly in.
+ *
+ * @regex: a compiled regex.
+ * @stats: set to the counts, all 0 if the regex doesn't keep them.
+ */
+void regex_stats(const Regex* regex, RegexStats* stats);
+
+/*
+ * Set the counts of a regex back to 0, see regex_stats.
+ *
+ * @regex: a compiled regex.
+ */
+void regex_stats_reset(Regex* regex);
+
+/*
+ * Release everything allocated by regex_compile.
+ * The text of the regex is not freed. Caches in its pool are freed, any taken
+ * out must be put back or freed with regex_cache_free first.
+ *
+ * @regex: a regex successfully compiled by regex_compile.
+ */
+void regex_free(Regex* regex);
+
+/*
+ * Start an empty set of regexes. Regexes are added and removed one at a time,
+ * each compiled or freed on its own, so a change takes as long as compiling
+ * the regexes changed, however many the set holds.
+ * A set must not be changed while it is searched, see RegexHandle to
+ * swap in a new one instead.
+ *
+ * @set: the set to initialize.
+ * @options: options to compile every regex with, or null for the defaults.
+ */
+void regex_set_init(RegexSet* set, RegexOptions* options);
+
+/*
+ * Compile a regex and add it to a set.
+ *
+ * @set: the set.
+ * @regex_text: text of the regex, kept by the set like regex_compile does,
+ *   so it must outlive the regex.
+ * @id: set to the regex's id, the lowest not in use.
+ * @return: same as regex_compile. The set is unchanged on failure.
+ */
+short regex_set_add(RegexSet* set, char* regex_text, int* id);
+
+/*
+ * Remove a regex from a set and free it. Its id may be handed out again.
+ * Ids not in the set are ignored.
+ *
+ * @set: the set.
+ * @id: id of the regex, from regex_set_add.
+ */
+void regex_set_remove(RegexSet* set, int id);
+
+/*
+ * Find which regexes of a set match somewhere in a string, like
+ * regex_is_match.
+ *
+ * @set: the set.
+ * @str: the string searched.
+ * @len: length of @str.
+ * @ids: set to the ids of the regexes that match, in increasing order, up
+ *   to @max_ids of them. May be null if @max_ids is 0.
+ * @max_ids: size of @ids.
+ * @return: the number of regexes that match, even past @max_ids.
+ */
+size_t regex_set_matches(const RegexSet* set, const char* str, size_t len,
+                         int* ids, size_t max_ids);
+
+/*
+ * Free every regex of a set. Their texts are not freed.
+ *
+ * @set: the set.
+ */
+void regex_set_free(RegexSet* set);
+
+/*
+ * Start a handle on a set of regexes.
+ *
+ * @handle: the handle to initialize.
+ * @set: the first set searches get. The handle takes it over, so it must
+ *   not be changed or freed by the caller after.
+ * @return: REGEX_SUCCESS, or REGEX_ERR_MEMORY in which case @set is still
+ *   the caller's.
+ */
+short regex_handle_init(RegexHandle* handle, RegexSet* set);
+
+/*
+ * Take the current set of a handle to search it. It stays valid, even if a
+ * new set is published meanwhile, until it is given back with
+ * regex_handle_release. Never waits, though it may retry if a publish is
+ * under way.
+ *
+ * @handle: the handle.
+ * @ticket: set to what regex_handle_release needs.
+ * @return: the set.
+ */
+const RegexSet* regex_handle_acquire(RegexHandle* handle, int* ticket);
+
+/*
+ * Give back a set taken with regex_handle_acquire.
+ *
+ * @handle: the handle.
+ * @ticket: as set by regex_handle_acquire.
+ */
+void regex_handle_release(RegexHandle* handle, int ticket);
+
+/*
+ * Make a new set the one searches get from now on, then wait for the
+ * searches that may still have the old set to give it back, and free it.
+ * Only the publishing thread waits. Publishes from several threads take
+ * turns.
+ *
+ * @handle: the handle.
+ * @set: the new set. The handle takes it over, like regex_handle_init.
+ * @return: REGEX_SUCCESS, or REGEX_ERR_MEMORY in which case @set is still
+ *   the caller's and the old set is kept.
+ */
+short regex_handle_publish(RegexHandle* handle, RegexSet* set);
+
+/*
+ * Free a handle and its current set. No thread may be using it.
+ *
+ * @handle: the handle.
+ */
+void regex_handle_free(RegexHandle* handle);
+
 #endif
@@ -0,0 +1,941 @@
+/*
+ * Benchmarks of the regex engine.
+ * Runs a few regexes over generated text and reports how fast each goes. With
+ * -c, hardware counters are read around each benchmark as well and reported
+ * per byte, which tells cache and branch behaviour apart from time. Counters
+ * are read with perf_event_open, so they need Linux and permission to use it,
+ * see /proc/sys/kernel/perf_event_paranoid.
+ * Then a corpus of pathological regexes is run, each with limits on its
+ * compile time, DFA size and match time, and the run fails if any is over.
+ * With -p, only the corpus is run.
+ * With -t, the benchmarks are instead run on 1 up to the given number of
+ * threads at once, each over its own slice of text with the same compiled
+ * regex, to show how matching scales.
+ *
+ * Usage: bench [-c] [-p] [-t threads] [-n repeats]
+ *
+ * Written by Max Hanson, September 2019.
+ * Licensed under MIT, see LICENSE.md for details.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "regex.h"
+
+/*  size of the generated text, in bytes  */
+#define TEXT_SIZE (4UL << 20)
+/*  times each benchmark runs by default, the fastest is reported  */
+#define DEFAULT_REPEATS 5
+/*  length of the slice of text each thread runs over, with -t  */
+#define SLICE_SIZE (1UL << 20)
+/*  length of the inputs of the pathological corpus, before their tail  */
+#define CASE_INPUT_SIZE (1UL << 20)
+/*  number of words in the huge alternation of the corpus  */
+#define ALTERNATION_SIZE 2000
+/*  least a time limit of the corpus is, shorter times are mostly noise  */
+#define MIN_LIMIT_MS 1.0
+/*  number of hardware counters read  */
+#define NUM_COUNTERS 5
+
+/*  what a benchmark does with its regex  */
+#define BENCH_MATCH 0
+#define BENCH_SEARCH 1
+#define BENCH_IS_MATCH 2
+
+typedef struct BenchTag Bench;
+typedef struct CaseTag Case;
+typedef struct CountersTag Counters;
+typedef struct WorkerTag Worker;
+
+static void throughput_run(char *text, size_t len, int repeats,
+                           int use_counters);
+static int corpus_run(int repeats);
+static double calibrate(int repeats, Counters *counters);
+static void scaling_run(int max_threads, int repeats);
+static double scaling_step(const Bench *bench, Regex *regex, Worker *workers,
+                           int num_threads);
+static void *worker_run(void *arg);
+static char *alternation_build(int count);
+static char *input_build(const char *unit, const char *tail, size_t *len);
+static char *text_build(size_t size);
+static double bench_run(int kind, Regex *regex, char *text, size_t len,
+                        Counters *counters);
+static double seconds_now(void);
+static void counters_open(Counters *counters, int enabled);
+static void counters_start(Counters *counters);
+static void counters_stop(Counters *counters);
+static void counters_close(Counters *counters);
+
+/*
+ * A benchmark.
+ *
+ * @name: Name it is reported under.
+ * @regex: The regex run.
+ * @kind: BENCH_MATCH to match the whole text, BENCH_SEARCH to find every match
+ *   in it or BENCH_IS_MATCH to ask if it holds one.
+ * @max_dfa_states: RegexOptions.max_dfa_states, to benchmark a lazy DFA.
+ */
+struct BenchTag
+{
+    const char *name;
+    char *regex;
+    int kind;
+    int max_dfa_states;
+};
+
+/*
+ * A pathological case: a regex that blows up some engines, an input to run
+ * it over, and the most it may cost. A case over any of its limits fails the
+ * run, so the linear time guarantees hold over time. Time limits are in
+ * units of a calibration pass measured in the same run, see calibrate, so
+ * they hold on slower and faster machines alike.
+ *
+ * @name: Name it is reported under.
+ * @regex: The regex, or null for an alternation of ALTERNATION_SIZE words,
+ *   see alternation_build.
+ * @unit: The input is @unit repeated to CASE_INPUT_SIZE bytes...
+ * @tail: ...then @tail.
+ * @kind: BENCH_MATCH, BENCH_SEARCH or BENCH_IS_MATCH.
+ * @max_compile: Most time compiling may take, in calibration passes.
+ * @max_dfa_bytes: Most bytes the DFA tables may take, the search and reverse
+ *   DFAs included.
+ * @max_match: Most time running over the input may take, in calibration
+ *   passes.
+ * @cache_bytes: If the DFA is expected to be lazy, the budget it is compiled
+ *   with, which its cache of states is held to. 0 if the DFA must be built
+ *   in full, so one that blows up can't hide behind an empty table.
+ */
+struct CaseTag
+{
+    const char *name;
+    char *regex;
+    const char *unit;
+    const char *tail;
+    int kind;
+    double max_compile;
+    unsigned long max_dfa_bytes;
+    double max_match;
+    unsigned long cache_bytes;
+};
+
+/*
+ * A thread of the scaling benchmark.
+ *
+ * @kind: What the benchmark does, see Bench.
+ * @regex: The regex, shared by every thread.
+ * @text: The thread's own slice of text, null terminated.
+ * @len: Length of @text.
+ * @repeats: Times to run over @text.
+ */
+struct WorkerTag
+{
+    int kind;
+    Regex *regex;
+    char *text;
+    size_t len;
+    int repeats;
+};
+
+/*
+ * Hardware counters, see counters_open.
+ *
+ * @fds: File descriptor of each counter, -1 if it couldn't be opened.
+ * @totals: Count of each counter over every run so far.
+ */
+struct CountersTag
+{
+    int fds[NUM_COUNTERS];
+    double totals[NUM_COUNTERS];
+};
+
+static const Bench benches[] = {
+    {"literal", "needle", BENCH_SEARCH, 0},
+    {"required literal", "[a-z]+ing", BENCH_SEARCH, 0},
+    {"first byte", "q[a-z]*", BENCH_SEARCH, 0},
+    {"words", "[a-z]+", BENCH_SEARCH, 0},
+    {"no match", "[0-9]+x", BENCH_IS_MATCH, 0},
+    {"whole text", "[a-z \n]*", BENCH_MATCH, 0},
+    {"lazy whole text", "[a-z \n]*e[a-z \n]{14}", BENCH_MATCH, 64}
+};
+
+/*  time limits are about 3 times the most each case took over repeated runs,
+    in calibration passes, and at least MIN_LIMIT_MS  */
+static const Case corpus[] = {
+    {"nested star", "(a*)*b", "a", "b", BENCH_SEARCH,
+     1, 192, 7, 0},
+    {"overlapping alt", "(a|aa)*c", "a", "c", BENCH_SEARCH,
+     1, 320, 7, 0},
+    {"repeated dot star", "(.*a){20}", "ab", "", BENCH_SEARCH,
+     1, 2048, 7, 0},
+    {"optional prefix", "(a?){500}a{500}", "a", "", BENCH_MATCH,
+     150, 49152, 1, 0},
+    {"exponential DFA", "[ab]*a[ab]{20}", "abbab", "", BENCH_MATCH,
+     1, 0, 5, 65536},
+    {"large count", "[a-z]{1000}", "abc", "", BENCH_SEARCH,
+     50, 49152, 7, 0},
+    {"huge alternation", 0, "k12345 ", "", BENCH_SEARCH,
+     300, 262144, 9, 0}
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "cyc/B", "ins/B", "L1D/B", "LLC/B", "brm/B"
+};
+
+
+int main(int argc, char **argv)
+{
+    char *text;
+    int use_counters;
+    int corpus_only;
+    int max_threads;
+    int repeats;
+    int failed;
+    int idx;
+
+    use_counters = 0;
+    corpus_only = 0;
+    max_threads = 0;
+    repeats = DEFAULT_REPEATS;
+    for (idx = 1; idx < argc; idx++)
+    {
+        if (strcmp(argv[idx], "-c") == 0)
+        {
+            use_counters = 1;
+        }
+        else if (strcmp(argv[idx], "-p") == 0)
+        {
+            corpus_only = 1;
+        }
+        else if (strcmp(argv[idx], "-t") == 0 && idx + 1 < argc &&
+                 atoi(argv[idx + 1]) > 0)
+        {
+            max_threads = atoi(argv[++idx]);
+        }
+        else if (strcmp(argv[idx], "-n") == 0 && idx + 1 < argc &&
+                 atoi(argv[idx + 1]) > 0)
+        {
+            repeats = atoi(argv[++idx]);
+        }
+        else
+        {
+            printf("usage: %s [-c] [-p] [-t threads] [-n repeats]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+
+    if (max_threads > 0)
+    {
+        scaling_run(max_threads, repeats);
+        return 0;
+    }
+
+    if (!corpus_only)
+    {
+        text = text_build(TEXT_SIZE);
+        if (text == 0)
+        {
+            printf("failed to allocate the text\n");
+            return 1;
+        }
+        throughput_run(text, TEXT_SIZE, repeats, use_counters);
+        free(text);
+        printf("\n");
+    }
+
+    /*  the run fails if any pathological case is over its limits  */
+    failed = corpus_run(repeats);
+    if (failed > 0)
+    {
+        printf("%d pathological cases over their limits\n", failed);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*  === HELPER METHODS ===  */
+
+/*
+ * Run every benchmark and report its speed, with its counters if asked to.
+ *
+ * @text: The text to run them over, null terminated.
+ * @len: Length of @text.
+ * @repeats: Times each benchmark runs, the fastest is reported.
+ * @use_counters: Bool. Read and report the hardware counters.
+ */
+static void throughput_run(char *text, size_t len, int repeats,
+                           int use_counters)
+{
+    RegexOptions options;
+    Regex regex;
+    Counters counters;
+    size_t bench;
+    double best;
+    double seconds;
+    int run;
+    int idx;
+
+    printf("%-18s %9s", "benchmark", "MB/s");
+    for (idx = 0; use_counters && idx < NUM_COUNTERS; idx++)
+    {
+        printf(" %8s", counter_names[idx]);
+    }
+    printf("\n");
+
+    for (bench = 0; bench < sizeof(benches) / sizeof(Bench); bench++)
+    {
+        regex_options_init(&options);
+        options.max_dfa_states = benches[bench].max_dfa_states;
+        if (regex_compile_options(benches[bench].regex, &options, &regex) !=
+            REGEX_SUCCESS)
+        {
+            printf("%-18s failed to compile\n", benches[bench].name);
+            continue;
+        }
+
+        counters_open(&counters, use_counters);
+        best = 0;
+        for (run = 0; run < repeats; run++)
+        {
+            seconds = bench_run(benches[bench].kind, &regex, text, len,
+                                &counters);
+            if (run == 0 || seconds < best)
+            {
+                best = seconds;
+            }
+        }
+        counters_close(&counters);
+        regex_free(&regex);
+
+        printf("%-18s %9.1f", benches[bench].name,
+               best > 0 ? len / best / 1e6 : 0.0);
+        for (idx = 0; use_counters && idx < NUM_COUNTERS; idx++)
+        {
+            if (counters.fds[idx] < 0)
+            {
+                printf(" %8s", "-");
+            }
+            else
+            {
+                printf(" %8.4f",
+                       counters.totals[idx] / ((double) len * repeats));
+            }
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Run every case of the pathological corpus and check it against its limits.
+ * Compile and match times are the fastest of the repeats.
+ *
+ * @repeats: Times each case is compiled and run.
+ * @return: Number of cases over their limits, or that failed to run.
+ */
+static int corpus_run(int repeats)
+{
+    RegexOptions options;
+    RegexStats stats;
+    Regex regex;
+    Counters counters;
+    char *regex_text;
+    char *input;
+    size_t len;
+    size_t idx;
+    unsigned long dfa_bytes;
+    double unit_ms;
+    double compile_ms;
+    double match_ms;
+    double max_compile_ms;
+    double max_match_ms;
+    double started;
+    double took;
+    int failed;
+    int lazy;
+    int run;
+
+    counters_open(&counters, 0);
+    unit_ms = calibrate(repeats, &counters);
+    printf("%-18s %11s %11s %11s %11s\n", "pathological", "compile ms",
+           "DFA bytes", "match ms", "misses");
+    printf("%-18s %11s %11s %11.2f\n", "calibration", "", "", unit_ms);
+    failed = 0;
+    for (idx = 0; idx < sizeof(corpus) / sizeof(Case); idx++)
+    {
+        /*  a lazy DFA is held to a budget of its own, and counts its misses  */
+        regex_options_init(&options);
+        if (corpus[idx].cache_bytes > 0)
+        {
+            options.max_dfa_bytes = corpus[idx].cache_bytes;
+            options.stats = 1;
+        }
+        regex_text = corpus[idx].regex != 0 ? corpus[idx].regex :
+                     alternation_build(ALTERNATION_SIZE);
+        input = input_build(corpus[idx].unit, corpus[idx].tail, &len);
+        if (regex_text == 0 || input == 0)
+        {
+            printf("%-18s failed to allocate\n", corpus[idx].name);
+            failed++;
+            continue;
+        }
+
+        compile_ms = 0;
+        match_ms = 0;
+        dfa_bytes = 0;
+        lazy = 0;
+        stats.cache_misses = 0;
+        for (run = 0; run < repeats; run++)
+        {
+            started = seconds_now();
+            if (regex_compile_options(regex_text, &options, &regex) !=
+                REGEX_SUCCESS)
+            {
+                break;
+            }
+            took = (seconds_now() - started) * 1e3;
+            compile_ms = run == 0 || took < compile_ms ? took : compile_ms;
+            dfa_bytes = regex.dfa.size + regex.search.size +
+                        regex.reverse.size;
+            lazy = regex.dfa.format == REGEX_DFA_LAZY;
+
+            took = bench_run(corpus[idx].kind, &regex, input, len,
+                             &counters) * 1e3;
+            match_ms = run == 0 || took < match_ms ? took : match_ms;
+            regex_stats(&regex, &stats);
+            regex_free(&regex);
+        }
+
+        if (run < repeats)
+        {
+            printf("%-18s failed to compile\n", corpus[idx].name);
+            failed++;
+        }
+        else
+        {
+            max_compile_ms = corpus[idx].max_compile * unit_ms;
+            max_compile_ms = max_compile_ms > MIN_LIMIT_MS ? max_compile_ms :
+                             MIN_LIMIT_MS;
+            max_match_ms = corpus[idx].max_match * unit_ms;
+            max_match_ms = max_match_ms > MIN_LIMIT_MS ? max_match_ms :
+                           MIN_LIMIT_MS;
+            printf("%-18s %11.2f %11lu %11.2f %11lu", corpus[idx].name,
+                   compile_ms, dfa_bytes, match_ms, stats.cache_misses);
+            if (compile_ms > max_compile_ms ||
+                dfa_bytes > corpus[idx].max_dfa_bytes ||
+                match_ms > max_match_ms)
+            {
+                printf("  over (%.1f ms, %lu bytes, %.1f ms)",
+                       max_compile_ms, corpus[idx].max_dfa_bytes,
+                       max_match_ms);
+                failed++;
+            }
+            else if (lazy != (corpus[idx].cache_bytes > 0))
+            {
+                printf("  %s", lazy ? "lazy" : "not lazy");
+                failed++;
+            }
+            printf("\n");
+        }
+
+        if (corpus[idx].regex == 0)
+        {
+            free(regex_text);
+        }
+        free(input);
+    }
+    counters_close(&counters);
+    return failed;
+}
+
+/*
+ * Time the unit the corpus's time limits are in: matching '[ab]*' against
+ * CASE_INPUT_SIZE bytes, a plain pass of a dense DFA. Compiling and matching
+ * slow down alike on a slower or busier machine, so limits in this unit
+ * hold wherever the corpus runs.
+ *
+ * @repeats: Times the pass is run, the fastest counts.
+ * @return: Milliseconds the pass takes, or 0 if it couldn't be run.
+ */
+static double calibrate(int repeats, Counters *counters)
+{
+    Regex regex;
+    char *input;
+    size_t len;
+    double took;
+    double best;
+    int run;
+
+    input = input_build("ab", "", &len);
+    if (input == 0)
+    {
+        return 0;
+    }
+    if (regex_compile("[ab]*", &regex) != REGEX_SUCCESS)
+    {
+        free(input);
+        return 0;
+    }
+    best = 0;
+    for (run = 0; run < repeats; run++)
+    {
+        took = bench_run(BENCH_MATCH, &regex, input, len, counters) * 1e3;
+        best = run == 0 || took < best ? took : best;
+    }
+    regex_free(&regex);
+    free(input);
+    return best;
+}
+
+/*
+ * Run every benchmark on 1, 2, 4... up to @max_threads threads at once, and
+ * report the throughput of all the threads together and their efficiency:
+ * that throughput over the one thread's times the number of threads. Each
+ * thread has its own slice of text, so only the regex is shared.
+ *
+ * @max_threads: Most threads to run on.
+ * @repeats: Times each thread runs over its slice.
+ */
+static void scaling_run(int max_threads, int repeats)
+{
+    RegexOptions options;
+    Regex regex;
+    Worker *workers;
+    size_t bench;
+    double single;
+    double rate;
+    int num_threads;
+    int idx;
+
+    /*  separate allocations, so threads don't share cache lines of text  */
+    workers = calloc(max_threads, sizeof(Worker));
+    for (idx = 0; workers != 0 && idx < max_threads; idx++)
+    {
+        workers[idx].text = text_build(SLICE_SIZE);
+        workers[idx].len = SLICE_SIZE;
+        workers[idx].repeats = repeats;
+        if (workers[idx].text == 0)
+        {
+            max_threads = idx;
+            break;
+        }
+    }
+    if (workers == 0 || max_threads == 0)
+    {
+        printf("failed to allocate the text\n");
+        free(workers);
+        return;
+    }
+
+    printf("%-18s %7s %9s %10s\n", "benchmark", "threads", "GB/s",
+           "efficiency");
+    for (bench = 0; bench < sizeof(benches) / sizeof(Bench); bench++)
+    {
+        regex_options_init(&options);
+        options.max_dfa_states = benches[bench].max_dfa_states;
+        if (regex_compile_options(benches[bench].regex, &options, &regex) !=
+            REGEX_SUCCESS)
+        {
+            printf("%-18s failed to compile\n", benches[bench].name);
+            continue;
+        }
+
+        single = 0;
+        num_threads = 1;
+        while (1)
+        {
+            rate = scaling_step(&benches[bench], &regex, workers,
+                                num_threads);
+            single = num_threads == 1 ? rate : single;
+            printf("%-18s %7d %9.3f %10.2f\n", benches[bench].name,
+                   num_threads, rate / 1e9,
+                   single > 0 ? rate / (single * num_threads) : 0.0);
+            if (num_threads == max_threads)
+            {
+                break;
+            }
+
+            /*  end on @max_threads even if it isn't a power of 2  */
+            num_threads = num_threads * 2 < max_threads ? num_threads * 2 :
+                          max_threads;
+        }
+        regex_free(&regex);
+    }
+
+    for (idx = 0; idx < max_threads; idx++)
+    {
+        free(workers[idx].text);
+    }
+    free(workers);
+}
+
+/*
+ * Run a benchmark on some threads at once.
+ *
+ * @regex: The benchmark's regex, compiled.
+ * @workers: The threads' slices of text, at least @num_threads.
+ * @num_threads: Number of threads to run on.
+ * @return: Bytes matched per second by all the threads together, 0 if
+ *   no thread could be started.
+ */
+static double scaling_step(const Bench *bench, Regex *regex, Worker *workers,
+                           int num_threads)
+{
+    pthread_t *threads;
+    double started;
+    double bytes;
+    int started_threads;
+    int idx;
+
+    threads = malloc(num_threads * sizeof(pthread_t));
+    if (threads == 0)
+    {
+        return 0;
+    }
+
+    bytes = 0;
+    started_threads = 0;
+    started = seconds_now();
+    for (idx = 0; idx < num_threads; idx++)
+    {
+        workers[idx].kind = bench->kind;
+        workers[idx].regex = regex;
+        if (pthread_create(&threads[idx], 0, worker_run, &workers[idx]) != 0)
+        {
+            break;
+        }
+        bytes += (double) workers[idx].len * workers[idx].repeats;
+        started_threads++;
+    }
+    for (idx = 0; idx < started_threads; idx++)
+    {
+        pthread_join(threads[idx], 0);
+    }
+    started = seconds_now() - started;
+
+    free(threads);
+    return started > 0 ? bytes / started : 0;
+}
+
+/*
+ * Run a thread of the scaling benchmark.
+ *
+ * @arg: The thread's Worker.
+ * @return: Null.
+ */
+static void *worker_run(void *arg)
+{
+    Worker *worker;
+    Counters counters;
+    int run;
+
+    worker = arg;
+    counters_open(&counters, 0);
+    for (run = 0; run < worker->repeats; run++)
+    {
+        bench_run(worker->kind, worker->regex, worker->text, worker->len,
+                  &counters);
+    }
+    counters_close(&counters);
+    return 0;
+}
+
+/*
+ * Build an alternation of distinct words, eg 'k0000|k0001|k0002'.
+ *
+ * @count: Number of words.
+ * @return: The regex, to be freed, or null if it couldn't be allocated.
+ */
+static char *alternation_build(int count)
+{
+    char *text;
+    char *cursor;
+    int idx;
+
+    text = malloc(count * 6 + 1);
+    if (text == 0)
+    {
+        return 0;
+    }
+    cursor = text;
+    for (idx = 0; idx < count; idx++)
+    {
+        cursor += sprintf(cursor, "%sk%04d", idx > 0 ? "|" : "", idx % 10000);
+    }
+    return text;
+}
+
+/*
+ * Build the input of a pathological case.
+ *
+ * @unit: Repeated to CASE_INPUT_SIZE bytes.
+ * @tail: Appended after the repeats.
+ * @len: Set to the length of the input.
+ * @return: The input, null terminated and to be freed, or null if it
+ *   couldn't be allocated.
+ */
+static char *input_build(const char *unit, const char *tail, size_t *len)
+{
+    char *input;
+    size_t unit_len;
+    size_t tail_len;
+    size_t pos;
+
+    unit_len = strlen(unit);
+    tail_len = strlen(tail);
+    input = malloc(CASE_INPUT_SIZE + tail_len + 1);
+    if (input == 0)
+    {
+        return 0;
+    }
+    for (pos = 0; pos < CASE_INPUT_SIZE; pos++)
+    {
+        input[pos] = unit[pos % unit_len];
+    }
+    memcpy(input + CASE_INPUT_SIZE, tail, tail_len + 1);
+    *len = CASE_INPUT_SIZE + tail_len;
+    return input;
+}
+
+/*
+ * Generate text to run the benchmarks over: lines of lowercase words, with
+ * the same words every time.
+ *
+ * @size: Length of the text.
+ * @return: The text, null terminated, or null if it couldn't be allocated.
+ */
+static char *text_build(size_t size)
+{
+    static const char *words[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+        "running", "regex", "engine", "matching", "table", "state", "quiet",
+        "needle", "haystack", "automaton", "byte", "search"
+    };
+    char *text;
+    const char *word;
+    size_t pos;
+    size_t line;
+    unsigned long seed;
+
+    text = malloc(size + 1);
+    if (text == 0)
+    {
+        return 0;
+    }
+
+    /*  a fixed seed, so runs can be compared  */
+    seed = 1;
+    pos = 0;
+    line = 0;
+    while (pos < size)
+    {
+        seed = seed * 1103515245UL + 12345UL;
+        word = words[(seed >> 16) % (sizeof(words) / sizeof(char *))];
+        while (*word != '\0' && pos < size)
+        {
+            text[pos++] = *word++;
+        }
+        if (pos < size)
+        {
+            text[pos] = pos - line >= 72 ? '\n' : ' ';
+            line = text[pos] == '\n' ? pos + 1 : line;
+            pos++;
+        }
+    }
+    text[size] = '\0';
+    return text;
+}
+
+/*
+ * Run a benchmark once.
+ *
+ * @kind: BENCH_MATCH, BENCH_SEARCH or BENCH_IS_MATCH.
+ * @regex: The benchmark's regex, compiled.
+ * @text: The text to run it over, null terminated.
+ * @len: Length of @text.
+ * @counters: Open counters to add the run's counts to.
+ * @return: How long the run took, in seconds.
+ */
+static double bench_run(int kind, Regex *regex, char *text, size_t len,
+                        Counters *counters)
+{
+    RegexIter iter;
+    size_t start;
+    size_t end;
+    size_t found;
+    double started;
+
+    counters_start(counters);
+    started = seconds_now();
+
+    found = 0;
+    if (kind == BENCH_MATCH)
+    {
+        found = regex_match(text, *regex) == REGEX_MATCH;
+    }
+    else if (kind == BENCH_IS_MATCH)
+    {
+        found = regex_is_match(regex, text, len) == REGEX_MATCH;
+    }
+    else if (regex_find_iter(&iter, regex, text, len) == REGEX_SUCCESS)
+    {
+        while (regex_find_next(&iter, &start, &end) == REGEX_MATCH)
+        {
+            found++;
+        }
+        regex_find_free(&iter);
+    }
+
+    started = seconds_now() - started;
+    counters_stop(counters);
+
+    /*  so the work can't be optimized away  */
+    if (found == (size_t) -1)
+    {
+        printf("%lu\n", (unsigned long) found);
+    }
+    return started;
+}
+
+/*
+ * @return: Seconds since some fixed point, for timing.
+ */
+static double seconds_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Open the hardware counters, stopped and at 0. Counters that can't be
+ * opened, eg without a PMU or the permission to use it, are left out.
+ *
+ * @counters: The counters to open.
+ * @enabled: Bool. Open them, or leave them all out.
+ */
+static void counters_open(Counters *counters, int enabled)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    static const unsigned int types[NUM_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    static const unsigned long configs[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+#endif
+    int idx;
+
+    for (idx = 0; idx < NUM_COUNTERS; idx++)
+    {
+        counters->fds[idx] = -1;
+        counters->totals[idx] = 0;
+#ifdef __linux__
+        if (!enabled)
+        {
+            continue;
+        }
+
+        /*  only this thread in user space is counted  */
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[idx];
+        attr.config = configs[idx];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters->fds[idx] = syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                                     0);
+#endif
+    }
+}
+
+/*
+ * Start the counters from 0.
+ *
+ * @counters: The open counters.
+ */
+static void counters_start(Counters *counters)
+{
+    int idx;
+
+    for (idx = 0; idx < NUM_COUNTERS; idx++)
+    {
+#ifdef __linux__
+        if (counters->fds[idx] >= 0)
+        {
+            ioctl(counters->fds[idx], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[idx], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+}
+
+/*
+ * Stop the counters and add their counts to the totals.
+ *
+ * @counters: The started counters.
+ */
+static void counters_stop(Counters *counters)
+{
+#ifdef __linux__
+    __u64 count;
+#endif
+    int idx;
+
+    for (idx = 0; idx < NUM_COUNTERS; idx++)
+    {
+#ifdef __linux__
+        if (counters->fds[idx] >= 0)
+        {
+            ioctl(counters->fds[idx], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counters->fds[idx], &count, sizeof(count)) ==
+                sizeof(count))
+            {
+                counters->totals[idx] += (double) count;
+            }
+        }
+#endif
+    }
+}
+
+/*
+ * Close the counters. Their totals are kept.
+ *
+ * @counters: The open counters.
+ */
+static void counters_close(Counters *counters)
+{
+    int idx;
+
+    for (idx = 0; idx < NUM_COUNTERS; idx++)
+    {
+#ifdef __linux__
+        if (counters->fds[idx] >= 0)
+        {
+            close(counters->fds[idx]);
+        }
+#endif
+    }
+}
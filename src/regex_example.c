@@ -0,0 +1,39 @@
+/*
+ * A small example of using the regex engine.
+ * Matches each of the program's arguments against a regex for dates.
+ *
+ * Written by Max Hanson, September 2019.
+ * Licensed under MIT, see LICENSE.md for details.
+ */
+
+#include <stdio.h>
+
+#include "regex.h"
+
+
+int main(int argc, char **argv)
+{
+    Regex regex;
+    int idx;
+
+    if (regex_compile("\\d{4}-\\d\\d-\\d\\d", &regex) != REGEX_SUCCESS)
+    {
+        printf("failed to compile the regex\n");
+        return 1;
+    }
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        if (regex_match(argv[idx], regex) == REGEX_MATCH)
+        {
+            printf("%s is a date\n", argv[idx]);
+        }
+        else
+        {
+            printf("%s is not a date\n", argv[idx]);
+        }
+    }
+
+    regex_free(&regex);
+    return 0;
+}
@@ -0,0 +1,1371 @@
+/*
+ * Unit tests for the regex engine.
+ *
+ * Written by Max Hanson, September 2019.
+ * Licensed under MIT, see LICENSE.md for details.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+#include "../src/regex.h"
+
+
+/*
+ * Compile @text and check that it matches exactly the strings in @matches
+ * and none of the strings in @misses. Both lists are null terminated.
+ */
+static void check_regex(char *text, char **matches, char **misses)
+{
+    Regex regex;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile(text, &regex));
+    for (; *matches != 0; matches++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(REGEX_MATCH, regex_match(*matches, regex),
+                                      *matches);
+    }
+    for (; *misses != 0; misses++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(REGEX_NO_MATCH,
+                                      regex_match(*misses, regex), *misses);
+    }
+    regex_free(&regex);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_literal(void)
+{
+    char *matches[] = {"abc", 0};
+    char *misses[] = {"", "ab", "abcd", "xabc", 0};
+
+    check_regex("abc", matches, misses);
+}
+
+void test_empty(void)
+{
+    char *matches[] = {"", 0};
+    char *misses[] = {"a", 0};
+
+    check_regex("", matches, misses);
+}
+
+void test_alternate(void)
+{
+    char *matches[] = {"cat", "dog", "", 0};
+    char *misses[] = {"catdog", "ca", 0};
+
+    check_regex("cat|dog|", matches, misses);
+}
+
+void test_quantifiers(void)
+{
+    char *matches[] = {"ac", "abbbc", "abd", "abbd", 0};
+    char *misses[] = {"ad", "abbbcd", "a", 0};
+
+    check_regex("ab*c|ab+d?", matches, misses);
+}
+
+void test_counted(void)
+{
+    char *matches[] = {"aab", "aaab", "aaaab", "xxyy", "xxyyy", 0};
+    char *misses[] = {"ab", "aaaaab", "xy", "xxy", 0};
+
+    check_regex("a{2,4}b|x{2}y{2,}", matches, misses);
+}
+
+void test_counted_literal_brace(void)
+{
+    char *matches[] = {"a{", "a{x}", 0};
+    char *misses[] = {"a", 0};
+
+    check_regex("a{x?}?", matches, misses);
+}
+
+void test_classes(void)
+{
+    char *matches[] = {"a1", "Z9", "_-", "]x", 0};
+    char *misses[] = {"1a", "a", "^x", 0};
+
+    check_regex("[a-zA-Z_\\]][0-9\\-x]", matches, misses);
+}
+
+void test_negated_class(void)
+{
+    char *matches[] = {"x.y", "xzy", 0};
+    char *misses[] = {"xay", "x\ny", "xy", 0};
+
+    check_regex("x[^a\\n]y", matches, misses);
+}
+
+void test_dot(void)
+{
+    char *matches[] = {"xay", "x.y", 0};
+    char *misses[] = {"x\ny", "xy", 0};
+
+    check_regex("x.y", matches, misses);
+}
+
+void test_escapes(void)
+{
+    char *matches[] = {"12 ab_", "0\tZ", 0};
+    char *misses[] = {"12ab", "a b", 0};
+    char *upper_d[] = {"D", 0};
+    char *upper_s[] = {"S", 0};
+    char *upper_w[] = {"W", 0};
+    char *not_letter[] = {"E", "d", "1", 0};
+    char *controls[] = {"\x05", "\x01", "\x1f", "-", 0};
+    char *not_controls[] = {" ", "\x7f", 0};
+    char *set_ends[] = {"[!-\\d]", "[!-\\w]", "[!-\\s]", "[!-\\D]",
+                        "[!-\\W]", "[!-\\S]", 0};
+    Regex regex;
+    int idx;
+
+    check_regex("\\d+\\s\\w+", matches, misses);
+
+    /*  hex escapes of the letters of negated sets are just those letters  */
+    check_regex("\\x44", upper_d, not_letter);
+    check_regex("\\x53", upper_s, not_letter);
+    check_regex("\\x57", upper_w, not_letter);
+
+    /*  an escaped byte can start a range  */
+    check_regex("[\\x01-\\x1f-]", controls, not_controls);
+
+    /*  but a set can't end one  */
+    for (idx = 0; set_ends[idx] != 0; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(REGEX_ERR_SYNTAX,
+                                      regex_compile(set_ends[idx], &regex),
+                                      set_ends[idx]);
+    }
+}
+
+void test_groups(void)
+{
+    char *matches[] = {"", "ab", "abab", "abc", 0};
+    char *misses[] = {"a", "aba", "abcab", 0};
+
+    check_regex("(ab)*c?", matches, misses);
+}
+
+void test_syntax_errors(void)
+{
+    Regex regex;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_compile("(ab", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_compile("ab)", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_compile("*a", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_compile("[ab", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_compile("[z-a]", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_compile("a{3,2}", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_compile("a\\q", &regex));
+}
+
+void test_narrow_table(void)
+{
+    Regex regex;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("[a-c]+x", &regex));
+    TEST_ASSERT_EQUAL_INT(2, regex.dfa.width);
+    TEST_ASSERT_EQUAL_INT(0, regex.dfa.start % regex.dfa.stride);
+    regex_free(&regex);
+}
+
+void test_wide_table(void)
+{
+    Regex regex;
+
+    /*  needs more than 64k cells, so offsets don't fit in 16 bits  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("(a|b|c|d|e|f|g|h)*a.{14}", &regex));
+    TEST_ASSERT_EQUAL_INT(4, regex.dfa.width);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match("hhhabcdefghabcdefg", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH,
+                          regex_match("hhhbbcdefghabcdefg", regex));
+    regex_free(&regex);
+}
+
+void test_sparse(void)
+{
+    RegexOptions options;
+    Regex regex;
+
+    regex_options_init(&options);
+    options.dfa_format = REGEX_DFA_SPARSE;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("[a-f0-9]+(\\.x|\xff)?",
+                                                &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_SPARSE, regex.dfa.format);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("09af", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("0.x", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("0\xff", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("0g", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("0.", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("0\xfe", regex));
+    regex_free(&regex);
+}
+
+void test_hybrid(void)
+{
+    RegexOptions options;
+    Regex regex;
+    char *matches[] = {"a1.", "c3xyz", "j0\n", "e5ee", 0};
+    char *misses[] = {"a2.", "k1.", "a1", "c3xyzw", "j0\n\n", 0};
+    int idx;
+
+    /*  the start state is busy, the rest have a handful of transitions  */
+    regex_options_init(&options);
+    options.dfa_format = REGEX_DFA_HYBRID;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("(a1|b2|c3|d4|e5|f6|g7|h8|"
+                                                "i9|j0)(.|xyz|\\n|[a-e]{2})",
+                                                &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_HYBRID, regex.dfa.format);
+    for (idx = 0; matches[idx] != 0; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(REGEX_MATCH,
+                                      regex_match(matches[idx], regex),
+                                      matches[idx]);
+    }
+    for (idx = 0; misses[idx] != 0; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(REGEX_NO_MATCH,
+                                      regex_match(misses[idx], regex),
+                                      misses[idx]);
+    }
+    regex_free(&regex);
+}
+
+void test_auto_format(void)
+{
+    RegexOptions options;
+    Regex regex;
+    char *text;
+
+    text = "alpha|bravo|charlie|delta|echo|foxtrot";
+    regex_options_init(&options);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options(text, &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_DENSE, regex.dfa.format);
+    regex_free(&regex);
+
+    /*  hybrid is smaller for literals, so it is used past the limit  */
+    options.dense_limit = 0;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options(text, &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_HYBRID, regex.dfa.format);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("charlie", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("charles", regex));
+    regex_free(&regex);
+}
+
+void test_budget_fallback(void)
+{
+    RegexOptions options;
+    Regex regex;
+    char *text;
+
+    /*  the DFA has 2^11 states, more than the budget  */
+    text = "(a|b)*a(a|b){10}";
+    regex_options_init(&options);
+    options.max_dfa_states = 100;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options(text, &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_LAZY, regex.dfa.format);
+
+    /*  the cache is cleared many times over these  */
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match("babbabaabbabababbabaabbba", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH,
+                          regex_match("babbabaabbababbbbabaabbba", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match("babbabaabbabababbabaabbba", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("abbbbbbbbb", regex));
+    regex_free(&regex);
+
+    /*  the same goes for a budget in bytes  */
+    options.max_dfa_states = 0;
+    options.max_dfa_bytes = 65536;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options(text, &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_LAZY, regex.dfa.format);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match("babbabaabbabababbabaabbba", regex));
+    regex_free(&regex);
+
+    /*  small DFAs are unaffected  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("ab+", &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_DENSE, regex.dfa.format);
+    regex_free(&regex);
+
+    /*  the NFAs count against the budget too, and are capped without one  */
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_MEMORY,
+                          regex_compile_options("[a-z]{200}", &options,
+                                                &regex));
+    regex_options_init(&options);
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_MEMORY,
+                          regex_compile_options("([a-z]{1000}){1000}",
+                                                &options, &regex));
+    options.max_dfa_bytes = 0;
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_MEMORY,
+                          regex_compile_options("(([a-z]{1000}){1000}){10}",
+                                                &options, &regex));
+}
+
+void test_limits(void)
+{
+    RegexLimits limits;
+    Regex regex;
+    volatile sig_atomic_t cancel;
+    char unterminated[8];
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("a*b", &regex));
+    regex_limits_init(&limits);
+    limits.check_interval = 2;
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match_limits("aaaaab", regex, &limits));
+
+    /*  out of bytes before the answer is known  */
+    limits.max_bytes = 4;
+    TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                          regex_match_limits("aaaaab", regex, &limits));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match_limits("aaab", regex, &limits));
+
+    /*  the answer is known before the bytes run out  */
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH,
+                          regex_match_limits("abaaaa", regex, &limits));
+
+    /*  cancelled from the outside  */
+    limits.max_bytes = 0;
+    cancel = 1;
+    limits.cancel = &cancel;
+    TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                          regex_match_limits("aaaaab", regex, &limits));
+    cancel = 0;
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match_limits("aaaaab", regex, &limits));
+
+    /*  the string is never read past the limit, even to find its end  */
+    memset(unterminated, 'a', sizeof(unterminated));
+    limits.cancel = 0;
+    limits.max_bytes = 4;
+    TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                          regex_match_limits(unterminated, regex, &limits));
+    regex_free(&regex);
+}
+
+void test_search_limits(void)
+{
+    RegexOptions options;
+    RegexLimits limits;
+    RegexIter iter;
+    Regex regexes[2];
+    volatile sig_atomic_t cancel;
+    const char *strs[2];
+    unsigned char results[2];
+    char *out;
+    size_t out_len;
+    size_t num_pieces;
+    size_t start;
+    size_t end;
+    int idx;
+
+    /*  searched with the search DFAs, then without them by the Pike VM  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("ab*cd|c", &regexes[0]));
+    TEST_ASSERT_NOT_NULL(regexes[0].search.table);
+    regex_options_init(&options);
+    options.max_dfa_states = 4;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("ab*cd|c", &options,
+                                                &regexes[1]));
+    TEST_ASSERT_NULL(regexes[1].search.table);
+
+    for (idx = 0; idx < 2; idx++)
+    {
+        regex_limits_init(&limits);
+        limits.check_interval = 2;
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_is_match_limits(&regexes[idx],
+                                                    "abbbbbbbcd", 10,
+                                                    &limits));
+
+        /*  out of bytes before the first match ends, then after  */
+        limits.max_bytes = 4;
+        TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                              regex_is_match_limits(&regexes[idx],
+                                                    "abbbbbbbcd", 10,
+                                                    &limits));
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_shortest_match_limits(&regexes[idx],
+                                                          "abcd", 4, &end,
+                                                          &limits));
+        TEST_ASSERT_EQUAL_INT(3, end);
+
+        /*  the limits are on the whole search, not each match  */
+        limits.max_bytes = 8;
+        TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                              regex_find_iter_limits(&iter, &regexes[idx],
+                                                     "abcd abbbbbbcd", 14,
+                                                     &limits));
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_find_next(&iter, &start, &end));
+        TEST_ASSERT_EQUAL_INT(0, start);
+        TEST_ASSERT_EQUAL_INT(4, end);
+        TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                              regex_find_next(&iter, &start, &end));
+        regex_find_free(&iter);
+        out = 0;
+        TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                              regex_replace_all_limits(&regexes[idx],
+                                                       "abcd abbbbbbcd", 14,
+                                                       "x", &out, &out_len,
+                                                       &limits));
+        TEST_ASSERT_NULL(out);
+        TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                              regex_split_limits(&regexes[idx],
+                                                 "abcd abbbbbbcd", 14, &out,
+                                                 &out_len, &num_pieces,
+                                                 &limits));
+        TEST_ASSERT_NULL(out);
+
+        /*  each string of a batch has limits of its own  */
+        strs[0] = "abcd";
+        strs[1] = "abbbbbbcd";
+        limits.max_bytes = 4;
+        regex_match_batch_limits(&regexes[idx], strs, 0, 2, results, 1,
+                                 &limits);
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH, results[0]);
+        TEST_ASSERT_EQUAL_INT(REGEX_ABORTED, results[1]);
+
+        /*  cancelled from the outside  */
+        limits.max_bytes = 0;
+        cancel = 1;
+        limits.cancel = &cancel;
+        TEST_ASSERT_EQUAL_INT(REGEX_ABORTED,
+                              regex_is_match_limits(&regexes[idx], "xxc", 3,
+                                                    &limits));
+        cancel = 0;
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_is_match_limits(&regexes[idx], "xxc", 3,
+                                                    &limits));
+        regex_free(&regexes[idx]);
+    }
+}
+
+void test_caches(void)
+{
+    RegexOptions options;
+    RegexCache cache;
+    RegexCache *pooled;
+    Regex regex;
+
+    regex_options_init(&options);
+    options.max_dfa_states = 100;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("(a|b)*a(a|b){10}", &options,
+                                                &regex));
+
+    /*  a cache of one's own  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_cache_init(&cache, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match_cache("babbabaabbabababbabaabbba", regex,
+                                            &cache, 0));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH,
+                          regex_match_cache("babbabaabbababbbbabaabbba", regex,
+                                            &cache, 0));
+    regex_cache_free(&cache);
+
+    /*  caches given back to the pool are reused  */
+    pooled = regex_cache_get(&regex);
+    TEST_ASSERT_NOT_NULL(pooled);
+    regex_cache_put(&regex, pooled);
+    TEST_ASSERT_EQUAL_PTR(pooled, regex_cache_get(&regex));
+    regex_cache_put(&regex, pooled);
+    regex_free(&regex);
+
+    /*  caches of a regex that isn't lazy work too  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("ab+", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_cache_init(&cache, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_match_cache("abb", regex, &cache, 0));
+    regex_cache_free(&cache);
+    regex_free(&regex);
+}
+
+/*  regex shared by the threads of test_shared_regex  */
+static Regex shared_regex;
+
+/*
+ * Match the shared regex many times, with a cache from its pool.
+ * Returns the number of wrong answers.
+ */
+static void *match_shared(void *arg)
+{
+    long wrong;
+    int idx;
+
+    wrong = 0;
+    for (idx = 0; idx < 200; idx++)
+    {
+        wrong += regex_match("babbabaabbabababbabaabbba", shared_regex) !=
+                 REGEX_MATCH;
+        wrong += regex_match("babbabaabbababbbbabaabbba", shared_regex) !=
+                 REGEX_NO_MATCH;
+    }
+    return (void *) wrong;
+}
+
+/*
+ * Compile the shared regex with @options and match it from several threads.
+ */
+static void check_shared_regex(RegexOptions *options)
+{
+    pthread_t threads[4];
+    void *wrong;
+    int idx;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("(a|b)*a(a|b){10}", options,
+                                                &shared_regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_DFA_LAZY, shared_regex.dfa.format);
+    for (idx = 0; idx < 4; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[idx], 0,
+                                                match_shared, 0));
+    }
+    for (idx = 0; idx < 4; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[idx], &wrong));
+        TEST_ASSERT_EQUAL_INT(0, (long) wrong);
+    }
+    regex_free(&shared_regex);
+}
+
+void test_shared_regex(void)
+{
+    RegexOptions options;
+
+    regex_options_init(&options);
+    options.max_dfa_states = 100;
+    check_shared_regex(&options);
+}
+
+void test_shared_cache(void)
+{
+    RegexOptions options;
+
+    /*  every state needed fits in the shared cache  */
+    regex_options_init(&options);
+    options.max_dfa_states = 1000;
+    options.shared_cache = 1;
+    check_shared_regex(&options);
+
+    /*  the shared cache fills up and threads carry on in their own  */
+    options.max_dfa_states = 20;
+    check_shared_regex(&options);
+}
+
+void test_match_batch(void)
+{
+    const char *strs[] = {"ab", "abbb", "a", "", "abc"};
+    size_t lens[] = {2, 4, 1, 0, 2};
+    unsigned char results[5];
+    Regex regex;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("ab+", &regex));
+    regex_match_batch(&regex, strs, 0, 5, results);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, results[0]);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, results[1]);
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, results[2]);
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, results[3]);
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, results[4]);
+
+    /*  with lengths, "abc" is cut to "ab"  */
+    regex_match_batch(&regex, strs, lens, 5, results);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, results[4]);
+    regex_free(&regex);
+}
+
+void test_match_batch_threads(void)
+{
+    RegexOptions options;
+    const char *strs[1000];
+    unsigned char results[1000];
+    Regex regex;
+    int idx;
+
+    regex_options_init(&options);
+    options.max_dfa_states = 100;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("(a|b)*a(a|b){10}", &options,
+                                                &regex));
+    for (idx = 0; idx < 1000; idx++)
+    {
+        strs[idx] = idx % 2 == 0 ? "babbabaabbabababbabaabbba" :
+                    "babbabaabbababbbbabaabbba";
+    }
+    regex_match_batch_threads(&regex, strs, 0, 1000, results, 4);
+    for (idx = 0; idx < 1000; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT(idx % 2 == 0 ? REGEX_MATCH : REGEX_NO_MATCH,
+                              results[idx]);
+    }
+
+    /*  no threads asked for means the caller alone  */
+    memset(results, 0xff, sizeof(results));
+    regex_match_batch_threads(&regex, strs, 0, 1000, results, -1);
+    for (idx = 0; idx < 1000; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT(idx % 2 == 0 ? REGEX_MATCH : REGEX_NO_MATCH,
+                              results[idx]);
+    }
+    regex_free(&regex);
+}
+
+/*
+ * Find every match of @text in @str and check their spans against @spans,
+ * a list of start and end offsets terminated by -1.
+ */
+static void check_find_regex(Regex *regex, char *str, int *spans)
+{
+    RegexIter iter;
+    size_t start;
+    size_t end;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_find_iter(&iter, regex, str, strlen(str)));
+    for (; *spans >= 0; spans += 2)
+    {
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_find_next(&iter, &start, &end));
+        TEST_ASSERT_EQUAL_INT(spans[0], start);
+        TEST_ASSERT_EQUAL_INT(spans[1], end);
+    }
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_find_next(&iter, &start, &end));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_find_next(&iter, &start, &end));
+    regex_find_free(&iter);
+}
+
+static void check_find(char *text, char *str, int *spans)
+{
+    Regex regex;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile(text, &regex));
+    check_find_regex(&regex, str, spans);
+    regex_free(&regex);
+}
+
+void test_find_iter(void)
+{
+    int words[] = {0, 3, 4, 9, 11, 16, -1};
+    int longest[] = {1, 5, 5, 7, -1};
+    int empty[] = {0, 0, 1, 3, 3, 3, -1};
+    int none[] = {-1};
+
+    check_find("[a-z]+", "the quick, brown!", words);
+    check_find("ab|abcd", "xabcdab", longest);
+    check_find("a*", "baa", empty);
+    check_find("z", "baa", none);
+    check_find("a", "", none);
+}
+
+void test_reverse_dfa(void)
+{
+    RegexOptions options;
+    Regex regex;
+    int spans[] = {1, 5, 5, 6, 7, 8, 8, 9, -1};
+    int later[] = {1, 7, 7, 8, -1};
+    int kept;
+
+    /*  the earliest match to end isn't the leftmost one  */
+    for (kept = 1; kept >= 0; kept--)
+    {
+        regex_options_init(&options);
+        options.reverse_dfa = kept;
+        TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                              regex_compile_options("ab*cd|c", &options,
+                                                    &regex));
+        TEST_ASSERT_EQUAL_INT(kept, regex.search.table != 0);
+        TEST_ASSERT_EQUAL_INT(kept, regex.reverse.table != 0);
+        check_find_regex(&regex, "xabcdcxcc", spans);
+        regex_free(&regex);
+
+        /*  a match from a later start ends first, and loses  */
+        TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                              regex_compile_options("a[ab]*c|b", &options,
+                                                    &regex));
+        check_find_regex(&regex, "xabbbbcb", later);
+        regex_free(&regex);
+    }
+
+    /*  neither is kept over budget, and searches still work  */
+    regex_options_init(&options);
+    options.max_dfa_states = 4;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("ab*cd|c", &options, &regex));
+    TEST_ASSERT_NULL(regex.search.table);
+    TEST_ASSERT_NULL(regex.reverse.table);
+    check_find_regex(&regex, "xabcdcxcc", spans);
+    regex_free(&regex);
+}
+
+void test_required_literal(void)
+{
+    Regex regex;
+    int spans[] = {0, 10, 12, 21, -1};
+
+    /*  a suffix, which whole strings must end with  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("[a-z]*\\.log", &regex));
+    TEST_ASSERT_EQUAL_INT(4, regex.literal_len);
+    TEST_ASSERT_EQUAL_MEMORY(".log", regex.literal, 4);
+    TEST_ASSERT_EQUAL_INT(1, regex.literal_suffix);
+    TEST_ASSERT_EQUAL_INT(-1, regex.literal_before);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("app.log", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("app.lo", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("App.log", regex));
+    regex_free(&regex);
+
+    /*  a suffix after a bounded prefix  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("[a-z]{1,3}@ex\\.com", &regex));
+    TEST_ASSERT_EQUAL_INT(7, regex.literal_len);
+    TEST_ASSERT_EQUAL_INT(3, regex.literal_before);
+    check_find_regex(&regex, "joe@ex.com, al@ex.com", spans);
+    regex_free(&regex);
+
+    /*  the longest literal, since there is no suffix  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("a?(bc|d)xyz+", &regex));
+    TEST_ASSERT_EQUAL_INT(2, regex.literal_len);
+    TEST_ASSERT_EQUAL_MEMORY("xy", regex.literal, 2);
+    TEST_ASSERT_EQUAL_INT(0, regex.literal_suffix);
+    TEST_ASSERT_EQUAL_INT(3, regex.literal_before);
+    regex_free(&regex);
+
+    /*  none to be found  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("a*|b", &regex));
+    TEST_ASSERT_EQUAL_INT(0, regex.literal_len);
+    regex_free(&regex);
+}
+
+void test_literal_only(void)
+{
+    Regex regex;
+    size_t end;
+    int spans[] = {2, 8, 10, 16, 16, 22, -1};
+
+    /*  no metacharacters, so no automata are built  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("needle", &regex));
+    TEST_ASSERT_EQUAL_INT(6, regex.literal_only);
+    TEST_ASSERT_NULL(regex.nfa.nodes);
+    TEST_ASSERT_NULL(regex.dfa.table);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("needle", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("needles", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("needl", regex));
+    check_find_regex(&regex, "a needle, needleneedle", spans);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                          regex_shortest_match(&regex, "nneedle", 7, &end));
+    TEST_ASSERT_EQUAL_INT(7, end);
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH,
+                          regex_is_match(&regex, "needl", 5));
+    regex_free(&regex);
+
+    /*  closing brackets, ^ and $ are plain bytes to the parser  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("a]}^$", &regex));
+    TEST_ASSERT_EQUAL_INT(5, regex.literal_only);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("a]}^$", regex));
+    regex_free(&regex);
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("1+1", &regex));
+    TEST_ASSERT_EQUAL_INT(0, regex.literal_only);
+    regex_free(&regex);
+}
+
+void test_is_match(void)
+{
+    RegexOptions options;
+    RegexCache *cache;
+    Regex regex;
+    size_t end;
+    int dfa;
+
+    /*  the same with the search DFA and without  */
+    for (dfa = 1; dfa >= 0; dfa--)
+    {
+        regex_options_init(&options);
+        options.reverse_dfa = dfa;
+        TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                              regex_compile_options("abcd|c|[0-9]+", &options,
+                                                    &regex));
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_shortest_match(&regex, "xabcd", 5, &end));
+        TEST_ASSERT_EQUAL_INT(4, end);
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_shortest_match(&regex, "ab 123", 6, &end));
+        TEST_ASSERT_EQUAL_INT(4, end);
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_is_match(&regex, "c", 1));
+        TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH,
+                              regex_is_match(&regex, "abd xyz", 7));
+        TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_is_match(&regex, "", 0));
+
+        /*  the scratch space of the NFA is kept in the pool  */
+        cache = regex_cache_get(&regex);
+        TEST_ASSERT_EQUAL_INT(dfa, cache->pike == 0);
+        regex_cache_put(&regex, cache);
+        regex_free(&regex);
+
+        TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                              regex_compile_options("b*", &options, &regex));
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH,
+                              regex_shortest_match(&regex, "abb", 3, &end));
+        TEST_ASSERT_EQUAL_INT(0, end);
+        regex_free(&regex);
+    }
+}
+
+void test_leftmost_first(void)
+{
+    RegexOptions options;
+    Regex regex;
+    int first[] = {0, 1, 3, 4, 5, 6, -1};
+    int longest[] = {0, 2, 3, 4, 5, 9, -1};
+    int dfa;
+
+    /*  alternatives are tried in order, with the search DFA and without  */
+    for (dfa = 1; dfa >= 0; dfa--)
+    {
+        regex_options_init(&options);
+        options.reverse_dfa = dfa;
+        options.match_kind = REGEX_LEFTMOST_FIRST;
+        TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                              regex_compile_options("a|ab|c|cd(e|ef)", &options,
+                                                    &regex));
+        check_find_regex(&regex, "ab c cdef", first);
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("ab", regex));
+        regex_free(&regex);
+    }
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("a|ab|c|cd(e|ef)", &regex));
+    check_find_regex(&regex, "ab c cdef", longest);
+    regex_free(&regex);
+}
+
+void test_lazy(void)
+{
+    RegexOptions options;
+    Regex regex;
+    char *out;
+    size_t out_len;
+    int lazy[] = {0, 3, 4, 8, -1};
+    int greedy[] = {0, 8, -1};
+
+    /*  lazy quantifiers end leftmost-first matches early  */
+    regex_options_init(&options);
+    options.match_kind = REGEX_LEFTMOST_FIRST;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("a.*?b", &options, &regex));
+    check_find_regex(&regex, "axbxaxxb", lazy);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("axbxaxxb", regex));
+    regex_free(&regex);
+
+    /*  and make leftmost-longest regexes leftmost-first  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("a.*?b", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_LEFTMOST_FIRST, regex.match_kind);
+    check_find_regex(&regex, "axbxaxxb", lazy);
+    regex_free(&regex);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("a.*b", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_LEFTMOST_LONGEST, regex.match_kind);
+    check_find_regex(&regex, "axbxaxxb", greedy);
+    regex_free(&regex);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("(a+?)(a*)", &regex));
+    out = 0;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_replace_all(&regex, "aaa", 3, "$1|$2", &out,
+                                            &out_len));
+    TEST_ASSERT_EQUAL_STRING("a|aa", out);
+    free(out);
+    regex_free(&regex);
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("x??y{1,2}?", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("xyy", regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("x?y", regex));
+    regex_free(&regex);
+}
+
+void test_explain(void)
+{
+    RegexOptions options;
+    Regex regex;
+    char text[256];
+    char short_text[8];
+    size_t len;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("[a-z]*\\.log", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ENGINE_DFA, regex.plan.match_engine);
+    TEST_ASSERT_EQUAL_INT(REGEX_ENGINE_SEARCH_DFA, regex.plan.search_engine);
+    TEST_ASSERT_EQUAL_INT(REGEX_PREFILTER_LITERAL, regex.plan.prefilter);
+    len = regex_explain(&regex, text, sizeof(text));
+    TEST_ASSERT_EQUAL_INT(strlen(text), len);
+    TEST_ASSERT_EQUAL_INT(0, strncmp(text, "match: dense DFA", 16));
+    TEST_ASSERT_NOT_NULL(strstr(text, "prefilter: literal of 4 bytes"));
+
+    /*  truncated like snprintf  */
+    TEST_ASSERT_EQUAL_INT(len, regex_explain(&regex, short_text,
+                                             sizeof(short_text)));
+    TEST_ASSERT_EQUAL_STRING("match: ", short_text);
+    regex_free(&regex);
+
+    /*  a single byte every match starts with is left to memchr  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("x[0-9]+", &regex));
+    TEST_ASSERT_EQUAL_INT(1, regex.literal_len);
+    TEST_ASSERT_EQUAL_INT(REGEX_PREFILTER_BYTE, regex.plan.prefilter);
+    regex_free(&regex);
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("a*|b", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_PREFILTER_NONE, regex.plan.prefilter);
+    regex_free(&regex);
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("needle", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ENGINE_LITERAL, regex.plan.match_engine);
+    TEST_ASSERT_EQUAL_INT(REGEX_ENGINE_LITERAL, regex.plan.search_engine);
+    regex_free(&regex);
+
+    /*  leftmost-first without the search DFAs needs the NFA  */
+    regex_options_init(&options);
+    options.reverse_dfa = 0;
+    options.match_kind = REGEX_LEFTMOST_FIRST;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("a|ab", &options, &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ENGINE_PIKE, regex.plan.search_engine);
+    TEST_ASSERT_EQUAL_STRING("reverse_dfa is off", regex.plan.search_reason);
+    regex_free(&regex);
+
+    /*  the search DFAs aren't tried once the DFA is over budget  */
+    regex_options_init(&options);
+    options.max_dfa_states = 100;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("(a|b)*a(a|b){10}", &options,
+                                                &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_ENGINE_LAZY_DFA, regex.plan.match_engine);
+    TEST_ASSERT_EQUAL_INT(REGEX_ENGINE_PIKE, regex.plan.search_engine);
+    TEST_ASSERT_NULL(regex.search.table);
+    regex_free(&regex);
+}
+
+void test_stats(void)
+{
+    RegexOptions options;
+    RegexStats stats;
+    RegexIter iter;
+    Regex regex;
+    char text[4097];
+    unsigned long seed;
+    size_t start;
+    size_t end;
+    int idx;
+
+    regex_options_init(&options);
+    options.stats = 1;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("[a-z]*\\.log", &options,
+                                                &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("app.log", regex));
+    /*  turned down by the suffix without running the DFA  */
+    TEST_ASSERT_EQUAL_INT(REGEX_NO_MATCH, regex_match("app.txt", regex));
+    regex_stats(&regex, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.calls);
+    TEST_ASSERT_EQUAL_INT(7, stats.bytes);
+    TEST_ASSERT_EQUAL_INT(1, stats.matches);
+
+    /*  two matches then the end, each found through the literal  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_find_iter(&iter, &regex, "a.log b.log", 11));
+    while (regex_find_next(&iter, &start, &end) == REGEX_MATCH)
+    {
+    }
+    regex_find_free(&iter);
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_is_match(&regex, "x.log", 5));
+    regex_stats(&regex, &stats);
+    TEST_ASSERT_EQUAL_INT(6, stats.calls);
+    TEST_ASSERT_EQUAL_INT(7 + 11 + 5, stats.bytes);
+    TEST_ASSERT_EQUAL_INT(4, stats.matches);
+    TEST_ASSERT_EQUAL_INT(3, stats.prefilter_hits);
+    TEST_ASSERT_EQUAL_INT(0, stats.fallbacks);
+    TEST_ASSERT_EQUAL_INT(0, stats.cache_misses);
+
+    regex_stats_reset(&regex);
+    regex_stats(&regex, &stats);
+    TEST_ASSERT_EQUAL_INT(0, stats.calls);
+    TEST_ASSERT_EQUAL_INT(0, stats.bytes);
+    TEST_ASSERT_EQUAL_INT(0, stats.prefilter_hits);
+    regex_free(&regex);
+
+    /*  a lazy DFA builds its transitions as it goes, and clears when full  */
+    seed = 1;
+    for (idx = 0; idx < 4096; idx++)
+    {
+        seed = seed * 1103515245UL + 12345;
+        text[idx] = (seed >> 16) & 1 ? 'a' : 'b';
+    }
+    text[4096] = '\0';
+    options.max_dfa_states = 100;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("(a|b)*a(a|b){10}", &options,
+                                                &regex));
+    regex_match(text, regex);
+    regex_stats(&regex, &stats);
+    TEST_ASSERT_EQUAL_INT(1, stats.calls);
+    TEST_ASSERT_EQUAL_INT(4096, stats.bytes);
+    TEST_ASSERT_TRUE(stats.cache_misses > 100);
+    TEST_ASSERT_TRUE(stats.cache_clears > 0);
+    regex_free(&regex);
+
+    /*  nothing is counted unless asked for  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("a+", &regex));
+    TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("aa", regex));
+    regex_stats(&regex, &stats);
+    TEST_ASSERT_EQUAL_INT(0, stats.calls);
+    regex_free(&regex);
+}
+
+void test_export(void)
+{
+    RegexOptions options;
+    Regex regex;
+    char text[4096];
+    char short_text[8];
+    size_t len;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("(a|b)*c", &regex));
+    len = regex_export(&regex, REGEX_EXPORT_DFA, REGEX_EXPORT_DOT, 0, text,
+                       sizeof(text));
+    TEST_ASSERT_EQUAL_INT(strlen(text), len);
+    TEST_ASSERT_EQUAL_INT(0, strncmp(text, "digraph dfa {", 13));
+    TEST_ASSERT_NOT_NULL(strstr(text, "3 states, 2 edges"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "1 -> 1 [label=\"ab\"];"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "2 [shape=doublecircle];"));
+
+    /*  truncated like snprintf  */
+    TEST_ASSERT_EQUAL_INT(len, regex_export(&regex, REGEX_EXPORT_DFA,
+                                            REGEX_EXPORT_DOT, 0, short_text,
+                                            sizeof(short_text)));
+    TEST_ASSERT_EQUAL_STRING("digraph", short_text);
+
+    regex_export(&regex, REGEX_EXPORT_DFA, REGEX_EXPORT_JSON, 0, text,
+                 sizeof(text));
+    TEST_ASSERT_NOT_NULL(strstr(text, "\"largest_fan_out\": "
+                                      "[{\"state\": 1, \"edges\": 2}]"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "{\"to\": 2, \"label\": \"c\"}"));
+    regex_export(&regex, REGEX_EXPORT_NFA, REGEX_EXPORT_JSON, 0, text,
+                 sizeof(text));
+    TEST_ASSERT_NOT_NULL(strstr(text, "\"type\": \"match\", "
+                                      "\"accept\": true"));
+    regex_free(&regex);
+
+    /*  bytes that need escaping are written in hex  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("[^a]\"", &regex));
+    regex_export(&regex, REGEX_EXPORT_DFA, REGEX_EXPORT_DOT, 0, text,
+                 sizeof(text));
+    TEST_ASSERT_NOT_NULL(strstr(text, "[label=\"\\\\x00-`b-\\\\xff\"]"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "[label=\"\\\\x22\"]"));
+    regex_free(&regex);
+
+    /*  a lazy regex's DFA is only built so far  */
+    regex_options_init(&options);
+    options.max_dfa_states = 100;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile_options("(a|b)*a(a|b){10}", &options,
+                                                &regex));
+    regex_export(&regex, REGEX_EXPORT_DFA, REGEX_EXPORT_JSON, 20, text,
+                 sizeof(text));
+    TEST_ASSERT_NOT_NULL(strstr(text, "\"num_states\": 20,"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "\"complete\": false"));
+    regex_free(&regex);
+}
+
+void test_set(void)
+{
+    RegexSet set;
+    int ids[4];
+    int id;
+
+    regex_set_init(&set, 0);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_set_add(&set, "error", &id));
+    TEST_ASSERT_EQUAL_INT(0, id);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_set_add(&set, "[0-9]+ms", &id));
+    TEST_ASSERT_EQUAL_INT(1, id);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_set_add(&set, "warn|error",
+                                                       &id));
+    TEST_ASSERT_EQUAL_INT(2, id);
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, regex_set_add(&set, "(a", &id));
+    TEST_ASSERT_EQUAL_INT(3, set.count);
+
+    TEST_ASSERT_EQUAL_INT(2, regex_set_matches(&set, "error after 30ms", 12,
+                                               ids, 4));
+    TEST_ASSERT_EQUAL_INT(0, ids[0]);
+    TEST_ASSERT_EQUAL_INT(2, ids[1]);
+    TEST_ASSERT_EQUAL_INT(3, regex_set_matches(&set, "error after 30ms", 16,
+                                               ids, 1));
+    TEST_ASSERT_EQUAL_INT(0, ids[0]);
+
+    /*  removing one leaves the others as they were, and frees its id  */
+    regex_set_remove(&set, 0);
+    regex_set_remove(&set, 0);
+    TEST_ASSERT_EQUAL_INT(2, set.count);
+    TEST_ASSERT_EQUAL_INT(2, regex_set_matches(&set, "error after 30ms", 16,
+                                               ids, 4));
+    TEST_ASSERT_EQUAL_INT(1, ids[0]);
+    TEST_ASSERT_EQUAL_INT(2, ids[1]);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_set_add(&set, "after", &id));
+    TEST_ASSERT_EQUAL_INT(0, id);
+    TEST_ASSERT_EQUAL_INT(0, regex_set_matches(&set, "none", 4, 0, 0));
+    regex_set_free(&set);
+}
+
+/*  handle searched by the threads of test_handle  */
+static RegexHandle shared_handle;
+static volatile int handle_done;
+
+/*
+ * Search the sets of the shared handle until told to stop, while they are
+ * swapped. Returns the number of wrong answers.
+ */
+static void *search_handle(void *arg)
+{
+    const RegexSet *set;
+    long wrong;
+    int ticket;
+    int ids[2];
+
+    wrong = 0;
+    while (__sync_fetch_and_add(&handle_done, 0) == 0)
+    {
+        set = regex_handle_acquire(&shared_handle, &ticket);
+        wrong += set->count != 2;
+        wrong += regex_set_matches(set, "rule 17", 7, ids, 2) != 1;
+        regex_handle_release(&shared_handle, ticket);
+    }
+    return (void *) wrong;
+}
+
+/*
+ * Build a set for test_handle.
+ */
+static void handle_set(RegexSet *set)
+{
+    int id;
+
+    regex_set_init(set, 0);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_set_add(set, "rule [0-9]+",
+                                                       &id));
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_set_add(set, "x{3}", &id));
+}
+
+void test_handle(void)
+{
+    pthread_t threads[4];
+    const RegexSet *set;
+    RegexSet fresh;
+    void *wrong;
+    int ticket;
+    int idx;
+
+    handle_set(&fresh);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_handle_init(&shared_handle, &fresh));
+
+    /*  a set taken before a publish is the old one until given back  */
+    set = regex_handle_acquire(&shared_handle, &ticket);
+    regex_handle_release(&shared_handle, ticket);
+    handle_set(&fresh);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_handle_publish(&shared_handle, &fresh));
+    TEST_ASSERT_TRUE(set != regex_handle_acquire(&shared_handle, &ticket));
+    regex_handle_release(&shared_handle, ticket);
+
+    /*  swap sets under searches that never stop  */
+    handle_done = 0;
+    for (idx = 0; idx < 4; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[idx], 0,
+                                                search_handle, 0));
+    }
+    for (idx = 0; idx < 50; idx++)
+    {
+        handle_set(&fresh);
+        TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                              regex_handle_publish(&shared_handle, &fresh));
+    }
+    __sync_fetch_and_add(&handle_done, 1);
+    for (idx = 0; idx < 4; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[idx], &wrong));
+        TEST_ASSERT_EQUAL_INT(0, (long) wrong);
+    }
+    regex_handle_free(&shared_handle);
+}
+
+void test_compile_many(void)
+{
+    char *texts[] = {"a+b", "(c", "[0-9]{3}", "needle", "d|e)", "x*"};
+    Regex regexes[6];
+    short statuses[6];
+    int threads;
+    int idx;
+
+    /*  no threads asked for means the caller alone  */
+    for (threads = -2; threads <= 4; threads += 3)
+    {
+        TEST_ASSERT_EQUAL_INT(2, regex_compile_many(texts, 6, 0, regexes,
+                                                    statuses, threads));
+        TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, statuses[1]);
+        TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX, statuses[4]);
+
+        /*  each regex is in the slot of its text  */
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("aab", regexes[0]));
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("123", regexes[2]));
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("needle", regexes[3]));
+        TEST_ASSERT_EQUAL_INT(REGEX_MATCH, regex_match("xx", regexes[5]));
+        for (idx = 0; idx < 6; idx++)
+        {
+            if (statuses[idx] == REGEX_SUCCESS)
+            {
+                regex_free(&regexes[idx]);
+            }
+        }
+    }
+}
+
+void test_replace_all(void)
+{
+    Regex regex;
+    char buffer[32];
+    char *out;
+    size_t out_len;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_compile("(\\w+)@(\\w+)\\.com", &regex));
+    TEST_ASSERT_EQUAL_INT(2, regex.num_groups);
+
+    /*  allocated output, with references to groups  */
+    out = 0;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_replace_all(&regex, "to bob@example.com!", 19,
+                                            "$2:${1}$$", &out, &out_len));
+    TEST_ASSERT_EQUAL_STRING("to example:bob$!", out);
+    TEST_ASSERT_EQUAL_INT(16, out_len);
+    free(out);
+
+    /*  the caller's buffer, too small then big enough  */
+    out = buffer;
+    out_len = 4;
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SPACE,
+                          regex_replace_all(&regex, "a@b.com c@d.com", 15,
+                                            "<$0>", &out, &out_len));
+    TEST_ASSERT_EQUAL_INT(20, out_len);
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_replace_all(&regex, "a@b.com c@d.com", 15,
+                                            "<$0>", &out, &out_len));
+    TEST_ASSERT_EQUAL_STRING("<a@b.com> <c@d.com>", buffer);
+
+    /*  references to groups the regex doesn't have  */
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX,
+                          regex_replace_all(&regex, "", 0, "$3", &out,
+                                            &out_len));
+    TEST_ASSERT_EQUAL_INT(REGEX_ERR_SYNTAX,
+                          regex_replace_all(&regex, "", 0, "${}", &out,
+                                            &out_len));
+    regex_free(&regex);
+
+    /*  a group that took no part in the match is empty  */
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile("(a)|b", &regex));
+    out = 0;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_replace_all(&regex, "abc", 3, "[$1]", &out,
+                                            &out_len));
+    TEST_ASSERT_EQUAL_STRING("[a][]c", out);
+    free(out);
+    regex_free(&regex);
+}
+
+void test_split(void)
+{
+    Regex regex;
+    char *out;
+    size_t out_len;
+    size_t num_pieces;
+
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS, regex_compile(", *", &regex));
+    out = 0;
+    TEST_ASSERT_EQUAL_INT(REGEX_SUCCESS,
+                          regex_split(&regex, "a, b,,c", 7, &out, &out_len,
+                                      &num_pieces));
+    TEST_ASSERT_EQUAL_INT(4, num_pieces);
+    TEST_ASSERT_EQUAL_INT(7, out_len);
+    TEST_ASSERT_EQUAL_MEMORY("a\0b\0\0c", out, 7);
+    free(out);
+    regex_free(&regex);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_literal);
+    RUN_TEST(test_empty);
+    RUN_TEST(test_alternate);
+    RUN_TEST(test_quantifiers);
+    RUN_TEST(test_counted);
+    RUN_TEST(test_counted_literal_brace);
+    RUN_TEST(test_classes);
+    RUN_TEST(test_negated_class);
+    RUN_TEST(test_dot);
+    RUN_TEST(test_escapes);
+    RUN_TEST(test_groups);
+    RUN_TEST(test_syntax_errors);
+    RUN_TEST(test_narrow_table);
+    RUN_TEST(test_wide_table);
+    RUN_TEST(test_sparse);
+    RUN_TEST(test_hybrid);
+    RUN_TEST(test_auto_format);
+    RUN_TEST(test_budget_fallback);
+    RUN_TEST(test_limits);
+    RUN_TEST(test_search_limits);
+    RUN_TEST(test_caches);
+    RUN_TEST(test_shared_regex);
+    RUN_TEST(test_shared_cache);
+    RUN_TEST(test_match_batch);
+    RUN_TEST(test_match_batch_threads);
+    RUN_TEST(test_find_iter);
+    RUN_TEST(test_reverse_dfa);
+    RUN_TEST(test_required_literal);
+    RUN_TEST(test_literal_only);
+    RUN_TEST(test_is_match);
+    RUN_TEST(test_leftmost_first);
+    RUN_TEST(test_lazy);
+    RUN_TEST(test_explain);
+    RUN_TEST(test_stats);
+    RUN_TEST(test_export);
+    RUN_TEST(test_set);
+    RUN_TEST(test_handle);
+    RUN_TEST(test_compile_many);
+    RUN_TEST(test_replace_all);
+    RUN_TEST(test_split);
+    return UNITY_END();
+}